@@ -1,199 +1,1321 @@
-'''
-TODO:
-- probably don't pass $stack everywhere since we don't need it
-'''
-
+import argparse
+import concurrent.futures
+import hashlib
+import inspect
+import json
+import os
+import re
+import struct
 import subprocess
 import sys
 
-# TODO: fixme
-CLANG_PATH = "C:\\Program Files\\LLVM\\bin\\clang.exe"
-OBJDUMP_PATH = "C:\\Program Files\\LLVM\\bin\\llvm-objdump.exe"
-CLANG_FORMAT_PATH = "C:\\Program Files\\LLVM\\bin\\clang-format.exe"
+# Overridden by --clang and --clang-format, or $CLANG and $CLANG_FORMAT.
+if sys.platform == "win32":
+    CLANG_PATH = "C:\\Program Files\\LLVM\\bin\\clang.exe"
+    CLANG_FORMAT_PATH = "C:\\Program Files\\LLVM\\bin\\clang-format.exe"
+else:
+    CLANG_PATH = "clang"
+    CLANG_FORMAT_PATH = "clang-format"
+CLANG_PATH = os.environ.get("CLANG", CLANG_PATH)
+CLANG_FORMAT_PATH = os.environ.get("CLANG_FORMAT", CLANG_FORMAT_PATH)
+
+# What the snippets are compiled for, set with --target. The snippets are
+# ghccc either way, so the generated code and snippets.c's interface are
+# the same; what differs is the object format and how to get clang to
+# tag functions with a calling convention that's swapped for ghccc (see
+# munge_ll_file()):
+#   triple: clang's --target.
+#   cc: the C for that calling convention, as SNIPPET_CC, and...
+#   ll_cc: ...how it's spelled in LLVM IR.
+#   extern: declaration attributes for the $X and $CONT symbols.
+#   flags: extra clang flags for each -mcmodel.
+# The Windows small model addresses the holes RIP-relative, which on Linux
+# needs -fPIC with hidden visibility (or it would go via the GOT), while
+# the medium model's movabs of the full address needs -fno-pic.
+TARGETS = {
+    "windows": {
+        "triple": "x86_64-pc-windows-msvc",
+        "cc": "__vectorcall",
+        "ll_cc": "x86_vectorcallcc",
+        "extern": "",
+        "flags": {"small": [], "medium": []},
+    },
+    "linux": {
+        "triple": "x86_64-unknown-linux-gnu",
+        "cc": "__attribute__((ms_abi))",
+        "ll_cc": "win64cc",
+        "extern": '__attribute__((visibility("hidden"))) ',
+        "flags": {"small": ["-fPIC"], "medium": ["-fno-pic"]},
+    },
+}
+
+# Variants of each snippet are generated for 0..MAX_SAVED_INT_REGS-1
+# values on the virtual stack beneath the ones it operates on. Anything
+# deeper is spilled to the $stack frame by the spill_N snippets and
+# brought back by reload_N. Set with --vstack-regs.
+MAX_SAVED_INT_REGS = 4
+
+# How jit_compile() in cnp.c dispatches on the post-order Ast: for each
+# (AstKind, is lval) the snippet family that implements it, and its
+# effect on the vstack as C: the types it pops (deepest first), the type
+# it pushes (or None), and the expression or statement, where {0}, {1}
+# are the popped values and {x} is the node's $X const. The C is used for
+# the single node families of every SNIPPET_TYPES type, and to compose
+# FUSED_PATTERNS.
+AST_SNIPPETS = [
+    ("NAME", True, "load_addr", [], "uintptr_t", "{x}"),
+    ("NAME", False, "load", [], "int", "*(int*)({x})"),
+    ("CONST", False, "const", [], "int", "(int){x}"),
+    ("ADD", False, "add", ["int", "int"], "int", "{0} + {1}"),
+    ("MUL", False, "mul", ["int", "int"], "int", "{0} * {1}"),
+    ("ASSIGN", False, "assign_indirect", ["uintptr_t", "int"], None, "*(int*)({0}) = {1};"),
+]
+
+# Comparisons: AstKind -> (family, C operator, the AstKind that's its
+# negation). As values they push 0 or 1, and are only generated for ints
+# (i.e. they're not typed, see typed_snippets()). As the condition of an
+# IF they're instead fused into a jump_if_ family, which compares and
+# branches in one, and the negation lets jit_compile_nodes() in cnp.c
+# branch on either outcome so that the likely block is the one that
+# falls through.
+COMPARISONS = {
+    "LT": ("lt", "<", "GE"),
+    "LE": ("le", "<=", "GT"),
+    "GT": ("gt", ">", "LE"),
+    "GE": ("ge", ">=", "LT"),
+    "EQ": ("eq", "==", "NE"),
+    "NE": ("ne", "!=", "EQ"),
+}
+AST_SNIPPETS += [
+    (kind, False, family, ["int", "int"], "int", f"{{0}} {op} {{1}}")
+    for kind, (family, op, _) in COMPARISONS.items()
+]
+
+# Batch mode (jit_compile_batch() in cnp.c) runs the expression once per
+# row, with names referring to int columns rather than locals: {x} is the
+# column's base address and $row is the row. These replace the
+# AST_SNIPPETS entries for the same (AstKind, is lval), everything else
+# is shared. An lval NAME still pushes its {x}, here the column.
+BATCH_SNIPPETS = [
+    ("NAME", False, "load_column", [], "int", "((int*)({x}))[$row]"),
+    ("ASSIGN", False, "assign_column", ["uintptr_t", "int"], None, "((int*)({0}))[$row] = {1};"),
+]
+
+# SIMD batch mode (see jit_compile_batch() in cnp.c): each vstack entry is
+# a vector of |lanes| consecutive rows of ints, in the ymm or zmm
+# registers that ghccc passes them in (there are 6). The families are the
+# same as for batch mode, suffixed with the ISA, and |target| is the clang
+# target attribute they're compiled with.
+SIMD_ISAS = {
+    "avx2": {"lanes": 8, "target": "avx2"},
+    "avx512": {"lanes": 16, "target": "avx512f"},
+}
+
+# Vector registers saved beneath an operation's operands, as for
+# MAX_SAVED_INT_REGS. 4 plus 2 operands is all 6, and there's no spilling
+# in SIMD mode, deeper expressions use the scalar batch snippets.
+MAX_SAVED_SIMD_REGS = 4
+
+# As AST_SNIPPETS, for SIMD mode, where "simd" is the ISA's vector type.
+# The column an ASSIGN stores to is carried in $dst (after $row) rather
+# than on the vstack, so for an lval NAME {x} goes to "$dst" instead.
+SIMD_SNIPPETS = [
+    ("NAME", True, "store_to", [], "$dst", "{x}"),
+    ("NAME", False, "load", [], "simd", "*(simd_u*)((int*)({x}) + $row)"),
+    ("CONST", False, "const", [], "simd", "(simd){{}} + (int)({x})"),
+    ("ADD", False, "add", ["simd", "simd"], "simd", "{0} + {1}"),
+    ("MUL", False, "mul", ["simd", "simd"], "simd", "{0} * {1}"),
+    ("ASSIGN", False, "assign", ["simd"], None, "*(simd_u*)((int*)$dst + $row) = {0};"),
+]
+
+# Scalar types for jit_compile_typed() in cnp.c: the C type, whether it's
+# a float, and how a CONST of it is made from the bits in its {x}. Each
+# AST_SNIPPETS family is generated for each type by substituting the C
+# type for int (suffixed with the type's name, except for i32 which is
+# the plain family), and cvt_{from}_{to} converts the top of the vstack.
+# The order is that of C's usual arithmetic conversions, so a binary
+# operation is done in the larger of its operands' indices.
+SNIPPET_TYPES = {
+    "i32": ("int", False, "(int){x}"),
+    "i64": ("int64_t", False, "(int64_t){x}"),
+    "f32": ("float", True, "snippet_f32_bits({x})"),
+    "f64": ("double", True, "snippet_f64_bits({x})"),
+}
+
+# Types that a local can also be for jit_compile_typed(), narrower than an
+# int in memory but an i32 on the vstack, as C promotes them: a load zero
+# or sign extends (movzx or movsx) and an ASSIGN truncates, so they only
+# have load and assign_indirect families, and everything else is done in
+# i32 or wider. They come after SNIPPET_TYPES in SnippetType.
+NARROW_TYPES = {
+    "u8": "uint8_t",
+    "i16": "int16_t",
+}
+
+# Float vstack entries are passed in xmm registers, which ghccc assigns
+# independently of the general purpose ones, so every typed variant is
+# also generated for 0..MAX_SAVED_FLOAT_REGS-1 floats saved beneath its
+# operands, as _fN. 4 plus 2 operands is all 6 that ghccc has.
+MAX_SAVED_FLOAT_REGS = 4
+
+# CALL nodes call a host function in the platform's C ABI with up to
+# MAX_NATIVE_ARGS ints, which is as many as Win64 passes in registers.
+# With the saved ints that's all of ghccc's, see call_native below.
+MAX_NATIVE_ARGS = 4
+
+# Superinstructions: runs of families, in post-order, that get one fused
+# snippet. Because the Ast is post-order, any contiguous run of nodes is
+# just a sequence of vstack operations, so e.g. [load, load, add] is
+# "push x + y", and [mul, assign_indirect] pops the address and both
+# operands. jit_compile() tiles the Ast with the longest match at each
+# node. A const in a pattern is never pushed, it's an immediate in the
+# instruction that uses it instead (e.g. [const, add] is add_imm), with
+# _imm8 and _imm32 variants picked by its value when stitching.
+FUSED_PATTERNS = [
+    ["load", "load", "add"],
+    ["load", "load", "mul"],
+    ["load", "const", "add"],
+    ["load", "const", "mul"],
+    ["load", "load", "mul", "add"],
+    ["load", "add"],
+    ["load", "mul"],
+    ["const", "add"],
+    ["const", "mul"],
+    ["const", "assign_indirect"],
+    ["add", "assign_indirect"],
+    ["mul", "assign_indirect"],
+    ["load_addr", "load", "assign_indirect"],
+]
+
+# Pairs of values that are compiled in place of an immediate so that its
+# hole can be found by diffing the two objects. Every byte of both the 1
+# and 4 byte encodings differs between each pair, so the width of the
+# run that differs is how clang encoded it. A SHIFT is an IMM8 that's a
+# shift count, so its sentinels are ones that shifting by is defined.
+IMM_SENTINELS = {
+    "IMM8": (0x5B, -0x4B),
+    "SHIFT": (0x1B, 0x15),
+    "IMM32": (0x1234567B, -0x3579BDF),
+}
+
+# snip_name -> (number of $X consts, has a _fallthrough variant), filled
+# in as each snippet is written, along with its REL32 holes for $CONTn as
+# (offset, "$CONTn", addend).
+generated_snippets = {}
+continuation_holes = {}
+# snip_name -> the most bytes it writes, including data alignment.
+snippet_sizes = {}
+max_snippet_size = 0
+max_data_align = 1
 
 
 def clang_format_for_patch_header(src):
-    src = src.replace("__vectorcall ", "").replace("__vectorcall", "")
+    src = src.replace("SNIPPET_CC ", "").replace("SNIPPET_CC", "")
     pop = subprocess.Popen(
         [CLANG_FORMAT_PATH], stdin=subprocess.PIPE, stdout=subprocess.PIPE
     )
     return pop.communicate(src.encode("utf-8"))[0].decode("utf-8")
 
 
-def process_obj_file_to_patch_func(
-    obj_file, snip_name, snippets_file_handle, src, consts, continuations
-):
+# COFF relocation types: (name, hole kind, extra bytes between the end of
+# the field and the address it's relative to).
+COFF_RELOCS = {
+    0x1: ("IMAGE_REL_AMD64_ADDR64", "ADDR64", 0),
+    0x4: ("IMAGE_REL_AMD64_REL32", "REL32", 0),
+    0x5: ("IMAGE_REL_AMD64_REL32_1", "REL32", 1),
+    0x6: ("IMAGE_REL_AMD64_REL32_2", "REL32", 2),
+    0x7: ("IMAGE_REL_AMD64_REL32_3", "REL32", 3),
+    0x8: ("IMAGE_REL_AMD64_REL32_4", "REL32", 4),
+    0x9: ("IMAGE_REL_AMD64_REL32_5", "REL32", 5),
+}
+
+# ELF relocation types: (name, hole kind). PLT32 is what clang uses for
+# jmps to functions, and it's the same as PC32 when there's no PLT.
+ELF_RELOCS = {
+    1: ("R_X86_64_64", "ADDR64"),
+    2: ("R_X86_64_PC32", "REL32"),
+    4: ("R_X86_64_PLT32", "REL32"),
+}
+
+
+class ObjSection:
     """
-    As a quick first draft, parse the output of llvm-objdump. It wouldn't be very hard
-    and probably more reliable to just read the .obj file directly.
+    One section from an object file. |relocs| are (offset, kind, symbol,
+    addend) where kind is "ADDR64" (value is S + A) or "REL32" (value is
+    S + A - P) and symbol is ("extern", name) or ("section", index,
+    offset).
+    """
+
+    def __init__(self, name, data, align, code, alloc, writable):
+        self.name = name
+        self.data = bytearray(data)
+        self.align = align
+        self.code = code
+        self.alloc = alloc
+        self.writable = writable
+        self.relocs = []
+
 
-    Either way, with the code bits and relocs in hand, write out a C
-    function to the header that will 'assemble' into our target buffer.
+def read_coff(obj, obj_file):
     """
-    result = subprocess.run(
-        [
-            OBJDUMP_PATH,
-            "--section=.text",
-            "--reloc",
-            obj_file,
-        ],
-        stdout=subprocess.PIPE,
-    )
-    relocs = result.stdout.decode("utf-8").splitlines()
-    relocs_no_header = relocs[4:]
-    if not (
-        relocs_no_header[0].startswith("OFFSET")
-        and relocs_no_header[0].endswith("VALUE")
-    ):
-        print("llvm-objdump reloc parsing failed (no OFFSET header?)")
-        sys.exit(1)
-    relocs_body = relocs_no_header[1:]
-    all_relocs = {}
-    for line in relocs_body:
-        offset, type, name = line.split()
-        offset = int(offset, 16)
-        all_relocs[offset] = (type, name)
-    # print(all_relocs)
-
-    result = subprocess.run(
-        [
-            OBJDUMP_PATH,
-            "--section=.text",
-            "--disassemble",
-            "--disassemble-zeroes",
-            "--no-addresses",
-            "--x86-asm-syntax=intel",
-            obj_file,
-        ],
-        stdout=subprocess.PIPE,
+    Sections and the first defined function symbol's section from an
+    x64 COFF .obj. Implicit addends in the relocated fields are moved
+    into the relocs (and the fields zeroed) so that they look like ELF's.
+    """
+    machine, num_sections, _, sym_table, num_symbols, opt_size, _ = struct.unpack_from(
+        "<HHIIIHH", obj, 0
     )
-    dis = result.stdout.decode("utf-8").splitlines()
-    dis_no_header = dis[5:]
-    if not dis_no_header[0].startswith("<") or not dis_no_header[0].endswith(">:"):
-        print("llvm-objdump dis parsing failed (no func name?)")
+    if machine != 0x8664:
+        print(f"{obj_file}: not an x64 COFF object (machine {machine:#x})")
+        sys.exit(1)
+    string_table = sym_table + 18 * num_symbols
+
+    def coff_string(raw):
+        if raw[:4] == b"\0\0\0\0":
+            return c_string(obj, string_table + struct.unpack_from("<I", raw, 4)[0])
+        return raw.rstrip(b"\0").decode("utf-8")
+
+    symbols = {}
+    func_section = None
+    i = 0
+    while i < num_symbols:
+        raw = obj[sym_table + 18 * i : sym_table + 18 * (i + 1)]
+        value, section_number, type, storage_class, num_aux = struct.unpack_from(
+            "<IhHBB", raw, 8
+        )
+        if section_number > 0:
+            symbols[i] = ("section", section_number - 1, value)
+            if type == 0x20 and func_section is None:
+                func_section = (section_number - 1, value)
+        else:
+            symbols[i] = ("extern", coff_string(raw[:8]))
+        i += 1 + num_aux
+
+    sections = []
+    for i in range(num_sections):
+        header = 20 + opt_size + 40 * i
+        name = obj[header : header + 8].rstrip(b"\0").decode("utf-8")
+        if name.startswith("/"):
+            name = c_string(obj, string_table + int(name[1:]))
+        (
+            size,
+            raw_data,
+            relocs,
+            _,
+            num_relocs,
+            _,
+            characteristics,
+        ) = struct.unpack_from("<IIIIHHI", obj, header + 16)
+        if characteristics & 0x80:  # IMAGE_SCN_CNT_UNINITIALIZED_DATA
+            data = bytes(size)
+        else:
+            data = obj[raw_data : raw_data + size]
+        align_bits = (characteristics >> 20) & 0xF
+        section = ObjSection(
+            name,
+            data,
+            1 << (align_bits - 1) if align_bits else 1,
+            code=bool(characteristics & 0x20000020),  # CNT_CODE or MEM_EXECUTE
+            # Not LNK_INFO, LNK_REMOVE or MEM_DISCARDABLE.
+            alloc=not (characteristics & 0x02000A00),
+            writable=bool(characteristics & 0x80000000),
+        )
+        # Unwind info for snippets that need a frame (e.g. when there are
+        # more vstack values than ghccc has registers). The jitted code
+        # isn't registered with the unwinder, so this is dropped.
+        if name in (".pdata", ".xdata"):
+            section.alloc = False
+            num_relocs = 0
+        for r in range(num_relocs):
+            offset, sym, type = struct.unpack_from("<IIH", obj, relocs + 10 * r)
+            if type not in COFF_RELOCS:
+                print(f"{obj_file}: unhandled relocation type {type:#x} in {name}")
+                sys.exit(1)
+            _, kind, extra = COFF_RELOCS[type]
+            if kind == "ADDR64":
+                addend = struct.unpack_from("<q", section.data, offset)[0]
+                section.data[offset : offset + 8] = bytes(8)
+            else:
+                addend = struct.unpack_from("<i", section.data, offset)[0] - 4 - extra
+                section.data[offset : offset + 4] = bytes(4)
+            section.relocs.append((offset, kind, symbols[sym], addend))
+        sections.append(section)
+    return sections, func_section
+
+
+def read_elf(obj, obj_file):
+    """
+    Sections and the first defined function symbol's section from an
+    x86-64 ELF relocatable object.
+    """
+    if obj[4] != 2 or obj[5] != 1:
+        print(f"{obj_file}: not a little endian ELF64 object")
         sys.exit(1)
-    dis_body = dis_no_header[1:]
-    all_bytes = []
-    for line in dis_body:
-        bytes, _, instrs = line.partition("\t")
-        for b in bytes.split():
-            all_bytes.append(int(b, 16))
-    # print(all_bytes)
+    machine = struct.unpack_from("<H", obj, 18)[0]
+    if machine != 62:  # EM_X86_64
+        print(f"{obj_file}: not an x86-64 ELF object (machine {machine})")
+        sys.exit(1)
+    shoff = struct.unpack_from("<Q", obj, 40)[0]
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", obj, 58)
+
+    headers = []
+    for i in range(shnum):
+        headers.append(struct.unpack_from("<IIQQQQIIQQ", obj, shoff + shentsize * i))
+    shstrtab = headers[shstrndx][4]
+
+    sections = []
+    for name, type, flags, _, offset, size, _, _, align, _ in headers:
+        data = bytes(size) if type == 8 else obj[offset : offset + size]  # SHT_NOBITS
+        sections.append(
+            ObjSection(
+                c_string(obj, shstrtab + name),
+                data,
+                max(align, 1),
+                code=bool(flags & 0x4),  # SHF_EXECINSTR
+                alloc=bool(flags & 0x2),  # SHF_ALLOC
+                writable=bool(flags & 0x1),  # SHF_WRITE
+            )
+        )
+
+    symbols = {}
+    func_section = None
+    for name, type, _, _, offset, size, link, _, _, entsize in headers:
+        if type != 2:  # SHT_SYMTAB
+            continue
+        strtab = headers[link][4]
+        for i in range(size // entsize):
+            st_name, st_info, _, shndx, value, _ = struct.unpack_from(
+                "<IBBHQQ", obj, offset + entsize * i
+            )
+            if shndx == 0:  # SHN_UNDEF
+                symbols[i] = ("extern", c_string(obj, strtab + st_name))
+            elif shndx < 0xFF00:
+                symbols[i] = ("section", shndx, value)
+                if st_info & 0xF == 2 and func_section is None:  # STT_FUNC
+                    func_section = (shndx, value)
+
+    for name, type, _, _, offset, size, _, info, _, entsize in headers:
+        if type == 9:  # SHT_REL
+            print(f"{obj_file}: unexpected SHT_REL relocations")
+            sys.exit(1)
+        if type != 4:  # SHT_RELA
+            continue
+        target = sections[info]
+        for i in range(size // entsize):
+            r_offset, r_info, addend = struct.unpack_from("<QQq", obj, offset + entsize * i)
+            if r_info & 0xFFFFFFFF not in ELF_RELOCS:
+                print(
+                    f"{obj_file}: unhandled relocation type {r_info & 0xFFFFFFFF} in "
+                    f"{target.name} (GOT relocations need -fno-pic)"
+                )
+                sys.exit(1)
+            _, kind = ELF_RELOCS[r_info & 0xFFFFFFFF]
+            target.relocs.append((r_offset, kind, symbols[r_info >> 32], addend))
+    return sections, func_section
+
+
+def c_string(data, offset):
+    return data[offset : data.index(b"\0", offset)].decode("utf-8")
+
+
+def read_obj_file(obj_file):
+    """
+    Read the snippet's code and relocations straight out of the COFF or
+    ELF object file.
+
+    The section holding the function is the snippet's code. Any other
+    sections it refers to (e.g. the constant pools in .rdata/.rodata that
+    -O3 sometimes makes) are laid out one after the other in a data blob
+    that's placed after the code, aligned to the largest alignment of any
+    of them. References from the code to itself are resolved here, the
+    remaining ones become holes of (offset, kind, target, addend), where
+    target is $Xn/$CONTn, $CODE (the start of the snippet) or $DATA (the
+    start of the data blob), and the value to patch in is target + addend
+    for ADDR64 or target + addend - (address of the hole) for REL32.
+    """
+    with open(obj_file, "rb") as f:
+        obj = f.read()
+    if obj[:4] == b"\x7fELF":
+        sections, func_section = read_elf(obj, obj_file)
+    else:
+        sections, func_section = read_coff(obj, obj_file)
+
+    if func_section:
+        code_index, entry = func_section
+        if entry != 0:
+            print(f"{obj_file}: function doesn't start at the beginning of its section")
+            sys.exit(1)
+    else:
+        code_sections = [i for i, s in enumerate(sections) if s.code and s.data]
+        if len(code_sections) != 1:
+            print(f"{obj_file}: couldn't find the snippet's code")
+            sys.exit(1)
+        code_index = code_sections[0]
+    code = sections[code_index]
+
+    data_offsets = {}
+    data = bytearray()
+    data_align = 1
+    for _, _, symbol, _ in code.relocs:
+        if symbol[0] != "section" or symbol[1] == code_index or symbol[1] in data_offsets:
+            continue
+        section = sections[symbol[1]]
+        if not section.alloc or section.writable:
+            print(f"{obj_file}: snippet refers to non-constant section {section.name}")
+            sys.exit(1)
+        if section.relocs:
+            print(f"{obj_file}: relocations in data section {section.name} unsupported")
+            sys.exit(1)
+        data.extend(bytes(-len(data) % section.align))
+        data_offsets[symbol[1]] = len(data)
+        data.extend(section.data)
+        data_align = max(data_align, section.align)
+
+    code_bytes = bytearray(code.data)
+    holes = []
+    for offset, kind, symbol, addend in sorted(code.relocs):
+        if symbol[0] == "extern":
+            holes.append([offset, kind, symbol[1], addend])
+        elif symbol[1] == code_index and kind == "REL32":
+            value = symbol[2] + addend - offset
+            struct.pack_into("<i", code_bytes, offset, value)
+        elif symbol[1] == code_index:
+            holes.append([offset, kind, "$CODE", symbol[2] + addend])
+        else:
+            holes.append([offset, kind, "$DATA", data_offsets[symbol[1]] + symbol[2] + addend])
+    return {
+        "code": list(code_bytes),
+        "holes": holes,
+        "data": list(data),
+        "data_align": data_align,
+    }
+
+
+def write_patch_func(snip_name, sf, src, consts, continuations, obj):
+    """
+    With the code bits and relocs in hand, write out a C function to the
+    header that will 'assemble' into our target buffer.
+    """
+    all_bytes = obj["code"]
+    holes = obj["holes"]
+    data = obj["data"]
+    data_align = obj["data_align"]
 
     def could_fallthrough():
-        if len(continuations) != 1:
+        """
+        Whether the snippet ends in a jmp to $CONT0 that can be dropped to
+        run straight into whatever is emitted next. Any other
+        continuations are still passed to the _fallthrough variant.
+        """
+        if 0 not in continuations:
             return False
         if all_bytes[-5] != 0xe9:
             return False
-        at = len(all_bytes) - 4
-        r = all_relocs.get(at)
-        if not r:
-            return False
-        if r[0] == 'IMAGE_REL_AMD64_REL32' and r[1] == '$CONT0':
-            return True
-        return False
+        return [len(all_bytes) - 4, "REL32", "$CONT0", -4] in holes
 
     args = []
     for i, c in enumerate(consts):
         args.append(f"uintptr_t $X{i}")
-    args_str_no_continuations = ", ".join(args)
-    for i, c in enumerate(continuations):
+    fallthrough_args = list(args)
+    for i in sorted(set(continuations)):
         args.append(f"void* $CONT{i}")
+        if i != 0:
+            fallthrough_args.append(f"void* $CONT{i}")
     args_str = ", ".join(args)
+    fallthrough_args_str = ", ".join(fallthrough_args)
+
+    # With a data blob the jmp to the continuation has to stay to get past
+    # it, so the fallthrough variant instead points it at the end.
+    fallthrough_size = len(all_bytes) if data else len(all_bytes) - 5
+    shorter = [] if data else peephole_variants(all_bytes, holes)
+
+    def signed(addend):
+        if addend > 0:
+            return f" + {addend}"
+        if addend < 0:
+            return f" - {-addend}"
+        return ""
+
+    def patch(kind, target, addend, at, names):
+        value = names.get(target, target)
+        if kind == "ADDR64":
+            return f"*(uintptr_t*){at} = (uintptr_t){value}{signed(addend)};"
+        if kind == "IMM8":
+            return f"*(int8_t*){at} = (int8_t){value};"
+        if kind == "IMM32":
+            return f"*(int32_t*){at} = (int32_t){value};"
+        return f"*(int32_t*){at} = (int32_t)((intptr_t){value} - (intptr_t){at}{signed(addend)});"
+
+    def data_start(base):
+        if data_align == 1:
+            return f"  unsigned char* d = {base};\n"
+        return (
+            f"  unsigned char* d = (unsigned char*)(((uintptr_t){base} + {data_align - 1}) & "
+            f"~(uintptr_t){data_align - 1});\n"
+        )
 
-    sf = snippets_file_handle
+    def write_template():
+        """
+        The bytes are written once as a const template (with zeros in the
+        holes), which gen_snippet() copies into place and then patches each
+        hole of. The fallthrough variant uses a prefix of the same template.
+        Any shorter forms from peephole_variants() are templates of their
+        own.
+        """
+        sf.write(f"static const unsigned char {snip_name}_code[{len(all_bytes)}] = {{\n")
+        for i in range(0, len(all_bytes), 12):
+            row = ", ".join("0x%02x" % b for b in all_bytes[i : i + 12])
+            sf.write(f"    {row},\n")
+        sf.write("};\n\n")
+        if data:
+            sf.write(f"// Aligned to {data_align} after the code.\n")
+            sf.write(f"static const unsigned char {snip_name}_data[{len(data)}] = {{\n")
+            for i in range(0, len(data), 12):
+                row = ", ".join("0x%02x" % b for b in data[i : i + 12])
+                sf.write(f"    {row},\n")
+            sf.write("};\n\n")
+        for j, (cond, code, _) in enumerate(shorter):
+            sf.write(f"// For when {cond}.\n")
+            sf.write(f"static const unsigned char {snip_name}_short{j}_code[{len(code)}] = {{\n")
+            for i in range(0, len(code), 12):
+                row = ", ".join("0x%02x" % b for b in code[i : i + 12])
+                sf.write(f"    {row},\n")
+            sf.write("};\n\n")
 
     def gen_snippet(fallthrough):
         ft = "_fallthrough" if fallthrough else ""
-        arg = args_str_no_continuations if fallthrough else args_str
+        arg = fallthrough_args_str if fallthrough else args_str
         if arg:
             arg = f", {arg}"
+        size = fallthrough_size if fallthrough else len(all_bytes)
         sf.write(
             f"static inline unsigned char* {snip_name}{ft}(unsigned char* __restrict p{arg}) {{\n"
         )
+        for j, (cond, code, short_holes) in enumerate(shorter):
+            short_size = len(code) - 5 if fallthrough else len(code)
+            short_names = {"$CODE": "p"}
+            if fallthrough:
+                short_names["$CONT0"] = f"(p + {short_size})"
+            sf.write(f"  if ({cond}) {{\n")
+            sf.write(f"    memcpy(p, {snip_name}_short{j}_code, {short_size});\n")
+            for offset, kind, target, addend in short_holes:
+                if offset < short_size:
+                    sf.write(f"    {patch(kind, target, addend, f'(p + {offset})', short_names)}\n")
+            sf.write(f"    return p + {short_size};\n")
+            sf.write("  }\n")
+        names = {"$CODE": "p", "$DATA": "d"}
+        sf.write(f"  memcpy(p, {snip_name}_code, {size});\n")
+        if fallthrough:
+            names["$CONT0"] = f"(p + {size})"
+        if data:
+            sf.write(data_start(f"p + {len(all_bytes)}"))
+            sf.write(f"  memcpy(d, {snip_name}_data, {len(data)});\n")
+            if fallthrough:
+                names["$CONT0"] = f"(d + {len(data)})"
+        for offset, kind, target, addend in holes:
+            if offset >= size:
+                continue
+            sf.write(f"  {patch(kind, target, addend, f'(p + {offset})', names)}\n")
+        if data:
+            sf.write(f"  return d + {len(data)};\n")
+        else:
+            sf.write(f"  return p + {size};\n")
+        sf.write(f"}}\n\n")
+
+    def gen_snippet_bytewise(fallthrough):
+        """
+        The original one-store-per-byte form, kept for comparison with the
+        template form above (see `cnp bench`).
+        """
+        ft = "_fallthrough" if fallthrough else ""
+        arg = fallthrough_args_str if fallthrough else args_str
+        if arg:
+            arg = f", {arg}"
+        sf.write(
+            f"static inline unsigned char* {snip_name}{ft}_bytewise(unsigned char* __restrict p{arg}) {{\n"
+        )
+        names = {"$CODE": "start", "$DATA": "d"}
+        if fallthrough:
+            names["$CONT0"] = f"(d + {len(data)})" if data else f"(start + {fallthrough_size})"
+        end = fallthrough_size if fallthrough else len(all_bytes)
+        if any("start" in names.get(t, "") for offset, _, t, _ in holes if offset < end):
+            sf.write("  unsigned char* start = p;\n")
+        if data:
+            sf.write(data_start(f"p + {len(all_bytes)}"))
+        by_offset = {offset: (kind, target, addend) for offset, kind, target, addend in holes}
         i = 0
         while i < len(all_bytes):
             b = all_bytes[i]
-            r = all_relocs.get(i)
+            r = by_offset.get(i)
             if r:
-                if r[0] == "IMAGE_REL_AMD64_ADDR64":
-                    sf.write(f"  *(uintptr_t*)p = {r[1]};\n")
-                    sf.write("  p += 8; /* %s ADDR64 */\n" % r[1])
-                    i += 8
-                elif r[0] == "IMAGE_REL_AMD64_REL32":
-                    sf.write(
-                        f"  *(int32_t*)p = (intptr_t){r[1]} - (intptr_t)p - 4;\n"
-                    )
-                    sf.write("  p += 4; /* %s REL32 */\n" % r[1])
-                    i += 4
+                kind, target, addend = r
+                size = {"ADDR64": 8, "IMM8": 1}.get(kind, 4)
+                sf.write(f"  {patch(kind, target, addend, 'p', names)}\n")
+                sf.write(f"  p += {size}; /* {target} {kind} */\n")
+                i += size
             else:
-                if fallthrough and i == len(all_bytes) - 5:
+                if fallthrough and i == fallthrough_size:
                     break
                 sf.write("  *p++ = 0x%02x;\n" % b)
                 i += 1
+        if data:
+            sf.write("  p = d;\n")
+            for b in data:
+                sf.write("  *p++ = 0x%02x;\n" % b)
         sf.write("  return p;\n")
         sf.write(f"}}\n\n")
 
     sf.write("#if 0\n\n")
     sf.write(clang_format_for_patch_header(src))
     sf.write("\n#endif\n\n")
+    write_template()
     gen_snippet(False)
     if could_fallthrough():
         gen_snippet(True)
+    gen_snippet_bytewise(False)
+    if could_fallthrough():
+        gen_snippet_bytewise(True)
+    generated_snippets[snip_name] = (len(consts), could_fallthrough())
+    continuation_holes[snip_name] = [
+        (offset, target, addend)
+        for offset, kind, target, addend in holes
+        if kind == "REL32" and target.startswith("$CONT")
+    ]
+    # Upper bound on what any variant writes, including data alignment.
+    global max_snippet_size, max_data_align
+    snippet_sizes[snip_name] = len(all_bytes) + data_align - 1 + len(data)
+    max_snippet_size = max(max_snippet_size, snippet_sizes[snip_name])
+    max_data_align = max(max_data_align, data_align)
+
+
+def write_ast_dispatch(sf):
+    """
+    Write the (AstKind, lval, vstack depth) -> emitter X-macros from
+    AST_SNIPPETS, which cnp.c builds its ast_snippets table from, and the
+    tables of the other snippets that the walker picks by depth. Every
+    emitter takes the same arguments so that the walker doesn't need to
+    know which snippets take a $X0; the depth is the depth before the
+    node, so the variant chosen is the one that saves whatever is under
+    the entries the node pops.
+    """
+    depths = MAX_SAVED_INT_REGS + max_vstack_pops()
+    sf.write(
+        f"""\
+// Dispatch from the Ast to the _fallthrough variants above, by vstack
+// depth before the node. There are none for where more than
+// SNIPPET_MAX_SAVED_REGS values would be saved beneath the node's
+// operands, so some have to be spilled first, and the tables by depth
+// have NULLs there.
+#define SNIPPET_MAX_SAVED_REGS {MAX_SAVED_INT_REGS}
+#define SNIPPET_VSTACK_DEPTHS {depths}
+
+// The most bytes any one snippet writes, and the most that any aligns the
+// data after its code to.
+#define SNIPPET_MAX_SIZE {max_snippet_size}
+#define SNIPPET_MAX_DATA_ALIGN {max_data_align}
+
+typedef unsigned char* (*SnippetEmitter)(unsigned char* __restrict p, uintptr_t x0);
+
+"""
+    )
+    typed_families = [family for _, _, family, _, _, _, _ in typed_snippets()]
+    typed_families += [f"cvt_{a}_{b}" for a in SNIPPET_TYPES for b in SNIPPET_TYPES if a != b]
+    typed_families += ["spill", "spill_float", "reload", "reload_float"]
+    emitted = []
+    for _, _, family, _, _, _ in AST_SNIPPETS + BATCH_SNIPPETS:
+        emitted += [f"{family}_{ir}" for ir in range(MAX_SAVED_INT_REGS)]
+    for entry in range(MAX_SAVED_INT_REGS):
+        emitted += [f"pick{entry}_{ir}" for ir in range(entry + 1, MAX_SAVED_INT_REGS)]
+    emitted += [f"shl_{ir}" for ir in range(MAX_SAVED_INT_REGS)]
+    for nargs in range(MAX_NATIVE_ARGS + 1):
+        emitted += [f"call_native_{nargs}_{ir}" for ir in range(MAX_SAVED_INT_REGS)]
+    for family in typed_families:
+        for ir in range(MAX_SAVED_INT_REGS + 1):
+            emitted += [variant_name(family, ir, fr) for fr in range(MAX_SAVED_FLOAT_REGS + 1)]
+    for isa in SIMD_ISAS:
+        for _, _, family, _, _, _ in SIMD_SNIPPETS:
+            emitted += [f"{family}_{isa}_{ir}" for ir in range(MAX_SAVED_SIMD_REGS)]
+    # Names of the variants that got an _emit wrapper.
+    have_emit = set()
+    for name in dict.fromkeys(emitted):
+        num_consts, fallthrough = generated_snippets.get(name, (0, False))
+        if not fallthrough:
+            continue
+        have_emit.add(name)
+        sf.write(
+            f"static unsigned char* {name}_emit(unsigned char* __restrict p, uintptr_t x0) {{\n"
+        )
+        if num_consts:
+            sf.write(f"  return {name}_fallthrough(p, x0);\n")
+        else:
+            sf.write("  (void)x0;\n")
+            sf.write(f"  return {name}_fallthrough(p);\n")
+        sf.write("}\n\n")
+
+    def variants(family, pops, depths=depths):
+        entries = []
+        for depth in range(depths):
+            name = f"{family}_{depth - pops}"
+            if depth >= pops and name in have_emit:
+                entries.append(f"{name}_emit")
+            else:
+                entries.append("NULL")
+        return ", ".join(entries)
+
+    # The X-macros that cnp.c builds ast_snippets and the like from. Every
+    # variant is listed whether it was generated or not, so that one that
+    # wasn't is a missing _emit when cnp.c is built.
+    batch = {(kind, lval): row for kind, lval, *row in BATCH_SNIPPETS}
+    sf.write(
+        "// X(kind, lval, family, pops, delta) for each node's snippets: how many\n"
+        "// vstack entries it pops, and how the depth changes after it, and the\n"
+        "// same for batch mode, where BATCH_SNIPPETS replace some families.\n"
+    )
+    for macro, families in (("SNIPPET_AST_FAMILIES", {}), ("SNIPPET_BATCH_FAMILIES", batch)):
+        sf.write(f"#define {macro}(X) \\\n")
+        for kind, lval, *row in AST_SNIPPETS:
+            family, pops, push, _ = families.get((kind, lval), row)
+            delta = (1 if push else 0) - len(pops)
+            sf.write(f"  X({kind}, {int(lval)}, {family}, {len(pops)}, {delta}) \\\n")
+        sf.write("\n")
+    sf.write(
+        "// X(kind, lval, depth, variant, size, pops, delta) for each variant of\n"
+        "// those, by vstack depth before the node, with the most bytes it\n"
+        "// writes.\n"
+    )
+    for macro, families in (("SNIPPET_AST_VARIANTS", {}), ("SNIPPET_BATCH_VARIANTS", batch)):
+        sf.write(f"#define {macro}(X) \\\n")
+        for kind, lval, *row in AST_SNIPPETS:
+            family, pops, push, _ = families.get((kind, lval), row)
+            delta = (1 if push else 0) - len(pops)
+            for ir in range(MAX_SAVED_INT_REGS):
+                name = f"{family}_{ir}"
+                size = snippet_sizes.get(name, 0)
+                depth = ir + len(pops)
+                sf.write(
+                    f"  X({kind}, {int(lval)}, {depth}, {name}, {size}, {len(pops)}, {delta}) \\\n"
+                )
+        sf.write("\n")
+
+    sf.write(
+        "// Moving the oldest vstack entry in registers to or from the frame\n"
+        "// at byte offset x0 from $stack, indexed by vstack depth (in\n"
+        "// registers) before.\n"
+    )
+    for family in ("spill", "reload"):
+        sf.write(
+            f"static const SnippetEmitter snippet_{family}[SNIPPET_VSTACK_DEPTHS] = "
+            f"{{{variants(family, 0)}}};\n"
+        )
+    sf.write("\n")
+
+    sf.write(
+        "// Pushing a copy of the vstack entry in registers at [index from the\n"
+        "// bottom], indexed by vstack depth before, for the loads that a loop\n"
+        "// hoists out (see jit_emit_loop()).\n"
+        "static const SnippetEmitter "
+        "snippet_pick[SNIPPET_MAX_SAVED_REGS][SNIPPET_VSTACK_DEPTHS] = {\n"
+    )
+    for entry in range(MAX_SAVED_INT_REGS):
+        sf.write(f"    {{{variants(f'pick{entry}', 0)}}},\n")
+    sf.write("};\n\n")
+
+    sf.write(
+        "// Shifting the top of the vstack left by x0 (1 to 31), for a MUL by a\n"
+        "// power of two (see jit_fold()), indexed by vstack depth before.\n"
+        "static const SnippetEmitter snippet_shl[SNIPPET_VSTACK_DEPTHS] = "
+        f"{{{variants('shl', 1)}}};\n\n"
+    )
+
+    sf.write(
+        "// Calling the C function at x0 for a CALL, indexed by [number of\n"
+        "// arguments][vstack depth before], see call_native in clang_rip.py.\n"
+        f"#define SNIPPET_MAX_NATIVE_ARGS {MAX_NATIVE_ARGS}\n"
+        "static const SnippetEmitter "
+        "snippet_call_native[SNIPPET_MAX_NATIVE_ARGS + 1][SNIPPET_VSTACK_DEPTHS] = {\n"
+    )
+    for nargs in range(MAX_NATIVE_ARGS + 1):
+        sf.write(f"    {{{variants(f'call_native_{nargs}', nargs)}}},\n")
+    sf.write("};\n\n")
+
+    sf.write(
+        """\
+// Branches for IF and loops, see jit_compile_nodes(). A BranchEmitter writes a jump
+// whose target isn't known yet, setting |*fixup| to the hole that
+// snippet_fixup() patches once it is. The jump_if_ ones jump if their
+// condition holds and otherwise fall through: ast_branch_emitters is
+// indexed by [comparison AstKind][vstack depth before], and
+// ast_negated_compare is the comparison that jumps in the other case.
+typedef struct SnippetFixup {
+  int32_t* at;
+  int32_t addend;
+} SnippetFixup;
+
+typedef unsigned char* (*BranchEmitter)(unsigned char* __restrict p, SnippetFixup* fixup);
+
+static inline void snippet_fixup(SnippetFixup fixup, unsigned char* target) {
+  *fixup.at = (int32_t)((intptr_t)target - (intptr_t)fixup.at + fixup.addend);
+}
+
+"""
+    )
+    have_branch = set()
+    branch_families = [f"jump_if_{family}" for family, _, _ in COMPARISONS.values()]
+    branch_families += ["jump_if_nz", "jump_if_z", "jump"]
+    for family in branch_families:
+        for ir in range(MAX_SAVED_INT_REGS):
+            name = f"{family}_{ir}"
+            # The hole for the jump that's fixed up: the jcc to $CONT1 in
+            # the _fallthrough variant, or jump's jmp to $CONT0.
+            target = "$CONT0" if family == "jump" else "$CONT1"
+            holes = [h for h in continuation_holes.get(name, []) if h[1] == target]
+            fallthrough = generated_snippets.get(name, (0, False))[1]
+            if len(holes) != 1 or not (fallthrough or family == "jump"):
+                continue
+            offset, _, addend = holes[0]
+            call = f"{name}(p, NULL)" if family == "jump" else f"{name}_fallthrough(p, NULL)"
+            have_branch.add(name)
+            sf.write(
+                f"static unsigned char* {name}_branch(unsigned char* __restrict p, "
+                "SnippetFixup* fixup) {\n"
+                f"  fixup->at = (int32_t*)(p + {offset});\n"
+                f"  fixup->addend = {addend};\n"
+                f"  return {call};\n"
+                "}\n\n"
+            )
+
+    def branch_variants(family, pops):
+        entries = []
+        for depth in range(depths):
+            name = f"{family}_{depth - pops}"
+            entries.append(f"{name}_branch" if depth >= pops and name in have_branch else "NULL")
+        return ", ".join(entries)
+
+    sf.write(
+        "static const BranchEmitter ast_branch_emitters[AST_Count][SNIPPET_VSTACK_DEPTHS] = {\n"
+    )
+    for kind, (family, _, _) in COMPARISONS.items():
+        sf.write(f"    [AST_{kind}] = {{{branch_variants(f'jump_if_{family}', 2)}}},\n")
+    sf.write("};\n\n")
+    sf.write("static const uint8_t ast_negated_compare[AST_Count] = {\n")
+    for kind, (_, _, negated) in COMPARISONS.items():
+        sf.write(f"    [AST_{kind}] = AST_{negated},\n")
+    sf.write("};\n\n")
+    sf.write(
+        "// Branching on a value that isn't a comparison, and the unconditional\n"
+        "// jump, indexed by vstack depth before.\n"
+    )
+    for family, pops in (("jump_if_nz", 1), ("jump_if_z", 1), ("jump", 0)):
+        sf.write(
+            f"static const BranchEmitter snippet_{family}[SNIPPET_VSTACK_DEPTHS] = "
+            f"{{{branch_variants(family, pops)}}};\n"
+        )
+    sf.write("\n")
+
+    float_depths = MAX_SAVED_FLOAT_REGS + max(
+        float_pops(pops) for _, _, _, pops, _, _, _ in typed_snippets()
+    )
+
+    def typed_variants(family, int_pops, float_pops, indent):
+        rows = []
+        for depth in range(depths):
+            entries = []
+            for float_depth in range(float_depths):
+                name = variant_name(family, depth - int_pops, float_depth - float_pops)
+                saved = depth >= int_pops and float_depth >= float_pops
+                entries.append(f"{name}_emit" if saved and name in have_emit else "NULL")
+            rows.append(f"{{{', '.join(entries)}}}")
+        return "{\n" + "".join(f"{indent}  {row},\n" for row in rows) + f"{indent}}}"
+
+    all_types = list(SNIPPET_TYPES) + list(NARROW_TYPES)
+    types = [f"SNIPPET_{type.upper()}" for type in all_types]
+    enumerators = "".join(f"  {name},\n" for name in types)
+    is_float = ", ".join(
+        "true" if type in SNIPPET_TYPES and SNIPPET_TYPES[type][1] else "false"
+        for type in all_types
+    )
+    names = ", ".join(f'"{type}"' for type in all_types)
+    promoted = ", ".join(
+        name if type in SNIPPET_TYPES else "SNIPPET_I32" for type, name in zip(all_types, types)
+    )
+    sf.write(
+        f"""\
+// Typed snippets for jit_compile_typed(), see SNIPPET_TYPES in
+// clang_rip.py. Ints (and addresses) are passed in general purpose
+// registers and floats in xmm registers, so the variant depends on how
+// many of each are on the vstack: these are indexed by [vstack ints in
+// registers][vstack floats in registers] before the node, after
+// [AstKind][is lval][SnippetType] (the type the node is evaluated in).
+#define SNIPPET_MAX_SAVED_FLOAT_REGS {MAX_SAVED_FLOAT_REGS}
+#define SNIPPET_FLOAT_DEPTHS {float_depths}
+
+typedef enum SnippetType {{
+{enumerators}  SNIPPET_TYPE_Count
+}} SnippetType;
+
+static const bool snippet_type_is_float[SNIPPET_TYPE_Count] = {{{is_float}}};
+static const char* const snippet_type_names[SNIPPET_TYPE_Count] = {{{names}}};
+// The type that a value of each is on the vstack, which for the narrow
+// ones (see NARROW_TYPES) is i32.
+static const SnippetType snippet_type_promoted[SNIPPET_TYPE_Count] = {{{promoted}}};
+
+typedef SnippetEmitter SnippetTypedEmitters[SNIPPET_VSTACK_DEPTHS][SNIPPET_FLOAT_DEPTHS];
+
+"""
+    )
+    sf.write(
+        "static const SnippetTypedEmitters "
+        "ast_typed_emitters[AST_Count][2][SNIPPET_TYPE_Count] = {\n"
+    )
+    for kind, lval, family, pops, _, _, type in typed_snippets():
+        fp = float_pops(pops)
+        entries = typed_variants(family, len(pops) - fp, fp, "    ")
+        sf.write(f"    [AST_{kind}][{int(lval)}][SNIPPET_{type.upper()}] = {entries},\n")
+    sf.write("};\n\n")
+
+    sf.write(
+        "// Converting the top of the vstack, indexed by [from][to] and then as\n"
+        "// above, including the one converted.\n"
+        "static const SnippetTypedEmitters "
+        "snippet_convert[SNIPPET_TYPE_Count][SNIPPET_TYPE_Count] = {\n"
+    )
+    for a, (_, a_float, _) in SNIPPET_TYPES.items():
+        for b in SNIPPET_TYPES:
+            if a != b:
+                int_pops = 0 if a_float else 1
+                entries = typed_variants(f"cvt_{a}_{b}", int_pops, int(a_float), "    ")
+                sf.write(f"    [SNIPPET_{a.upper()}][SNIPPET_{b.upper()}] = {entries},\n")
+    sf.write("};\n\n")
+
+    sf.write(
+        "// As snippet_spill and snippet_reload, where the oldest entry in\n"
+        "// registers (or the next one spilled) is a float or not, indexed by\n"
+        "// [is float] and then the ints and floats in registers before.\n"
+    )
+    for family in ("spill", "reload"):
+        sf.write(f"static const SnippetTypedEmitters snippet_typed_{family}[2] = {{\n")
+        sf.write(f"    {typed_variants(family, 0, 0, '    ')},\n")
+        sf.write(f"    {typed_variants(family + '_float', 0, 0, '    ')},\n")
+        sf.write("};\n")
+    sf.write("\n")
+
+    simd_depths = MAX_SAVED_SIMD_REGS + max(len(pops) for _, _, _, pops, _, _ in SIMD_SNIPPETS)
+    isas = [f"SNIPPET_SIMD_{isa.upper()}" for isa in SIMD_ISAS]
+    enumerators = "".join(f"  {name},\n" for name in isas)
+    names = ", ".join(f'"{isa}"' for isa in SIMD_ISAS)
+    lanes = ", ".join(str(info["lanes"]) for info in SIMD_ISAS.values())
+    sf.write(
+        f"""\
+// SIMD batch mode, see SIMD_SNIPPETS in clang_rip.py: emitters indexed by
+// [SnippetSimd][AstKind][is lval][vstack depth before the node], where
+// the vstack entries are vectors of snippet_simd_lanes rows. There's no
+// spilling, so no more than SNIPPET_SIMD_DEPTHS.
+#define SNIPPET_SIMD_DEPTHS {simd_depths}
+
+typedef enum SnippetSimd {{
+{enumerators}  SNIPPET_SIMD_Count
+}} SnippetSimd;
+
+static const char* const snippet_simd_names[SNIPPET_SIMD_Count] = {{{names}}};
+static const uint8_t snippet_simd_lanes[SNIPPET_SIMD_Count] = {{{lanes}}};
+
+"""
+    )
+    sf.write(
+        "static const SnippetEmitter "
+        "ast_simd_emitters[SNIPPET_SIMD_Count][AST_Count][2][SNIPPET_SIMD_DEPTHS] = {\n"
+    )
+    for isa, name in zip(SIMD_ISAS, isas):
+        sf.write(f"    [{name}] =\n        {{\n")
+        for kind, lval, family, pops, _, _ in SIMD_SNIPPETS:
+            entries = variants(f"{family}_{isa}", len(pops), simd_depths)
+            sf.write(f"            [AST_{kind}][{int(lval)}] = {{{entries}}},\n")
+        sf.write("        },\n")
+    sf.write("};\n\n")
+
+    sf.write("// Change in SIMD vstack depth after each node, indexed by [AstKind][is lval].\n")
+    sf.write("static const int8_t ast_simd_stack_delta[AST_Count][2] = {\n")
+    for kind, lval, _, pops, push, _ in SIMD_SNIPPETS:
+        pushes = 1 if push and push != "$dst" else 0
+        sf.write(f"    [AST_{kind}][{int(lval)}] = {pushes - len(pops)},\n")
+    sf.write("};\n\n")
+
+    sf.write(
+        "// The loop_tail for each ISA, stepping $row by its lanes up to x0 and\n"
+        "// back to |body| until then.\n"
+        "typedef unsigned char* (*LoopTailEmitter)(unsigned char* __restrict p, uintptr_t x0,\n"
+        "                                          void* body);\n\n"
+    )
+    tails = []
+    for isa in SIMD_ISAS:
+        name = f"loop_tail_{isa}_0"
+        tails.append(f"{name}_fallthrough" if generated_snippets[name][1] else "NULL")
+    sf.write(
+        "static const LoopTailEmitter snippet_simd_loop_tail[SNIPPET_SIMD_Count] = "
+        f"{{{', '.join(tails)}}};\n\n"
+    )
+
+    # Grouped by first node, and longest first within each group, so the
+    # first one that matches is the longest match.
+    by_family = {family: (kind, lval) for kind, lval, family, _, _, _ in AST_SNIPPETS}
+    kind_order = [kind for kind, _, _, _, _, _ in AST_SNIPPETS]
+    patterns = sorted(
+        FUSED_PATTERNS,
+        key=lambda p: (kind_order.index(by_family[p[0]][0]), by_family[p[0]][1], -len(p)),
+    )
+    max_len = max(len(p) for p in patterns)
+    sf.write(
+        f"""\
+// Fused snippets for runs of nodes from FUSED_PATTERNS, grouped by first
+// node and longest first within a group. |nodes| is the low byte (kind |
+// lval bit) of each Ast that's replaced, |x| the $X operands of the NAME
+// and CONST nodes in the run, in order, and |emit| is indexed by vstack
+// depth before the first node. |batch| is set if the pattern has none of
+// the nodes that batch mode replaces, so it can be used there too. |name|
+// is the family of the |emit| variants.
+#define SNIPPET_PATTERN_MAX_LEN {max_len}
+
+typedef unsigned char* (*PatternEmitter)(unsigned char* __restrict p, const uintptr_t* x);
+
+typedef struct SnippetPattern {{
+  uint8_t len;
+  uint8_t nodes[SNIPPET_PATTERN_MAX_LEN];
+  uint8_t pops;
+  int8_t stack_delta;
+  bool batch;
+  PatternEmitter emit[SNIPPET_VSTACK_DEPTHS];
+  const char* name;
+}} SnippetPattern;
+
+"""
+    )
+    def call_fallthrough(name, num_consts):
+        if num_consts:
+            x = ", ".join(f"x[{i}]" for i in range(num_consts))
+            return f"{name}_fallthrough(p, {x})"
+        return f"{name}_fallthrough(p)"
+
+    for families in patterns:
+        for ir in range(MAX_SAVED_INT_REGS):
+            name = f"{'_'.join(families)}_{ir}"
+            if "const" in families:
+                # The narrowest immediate that holds the const's value.
+                index = const_operands(families).index("const")
+                imm8 = f"{'_'.join(families)}_imm8_{ir}"
+                imm32 = f"{'_'.join(families)}_imm32_{ir}"
+                num_consts, fallthrough = generated_snippets.get(imm32, (0, False))
+                if not fallthrough:
+                    continue
+                body = ""
+                if generated_snippets.get(imm8, (0, False))[1]:
+                    body += f"  if ((int8_t)x[{index}] == (int)x[{index}]) {{\n"
+                    body += f"    return {call_fallthrough(imm8, num_consts)};\n"
+                    body += "  }\n"
+                body += f"  return {call_fallthrough(imm32, num_consts)};\n"
+            else:
+                num_consts, fallthrough = generated_snippets[name]
+                if not fallthrough:
+                    continue
+                body = "" if num_consts else "  (void)x;\n"
+                body += f"  return {call_fallthrough(name, num_consts)};\n"
+            have_emit.add(name)
+            sf.write(
+                f"static unsigned char* {name}_emit(unsigned char* __restrict p, const uintptr_t* x) {{\n"
+            )
+            sf.write(body)
+            sf.write("}\n\n")
+
+    sf.write("static const SnippetPattern snippet_patterns[] = {\n")
+    for families in patterns:
+        pops, pushes = fused_stack_effect(families)
+        nodes = []
+        for family in families:
+            kind, lval = by_family[family]
+            nodes.append(f"AST_{kind} | 0x80" if lval else f"AST_{kind}")
+        in_batch = "true" if all(by_family[f] not in batch for f in families) else "false"
+        sf.write(
+            f"    {{{len(families)}, {{{', '.join(nodes)}}}, {pops}, {pushes - pops}, {in_batch},\n"
+        )
+        sf.write(f"     {{{variants('_'.join(families), pops)}}}, \"{'_'.join(families)}\"}},\n")
+    sf.write("};\n\n")
 
+    sf.write(
+        "// [begin, end) of the snippet_patterns that start with a given node,\n"
+        "// indexed by [AstKind][is lval].\n"
+    )
+    sf.write("static const uint8_t snippet_pattern_range[AST_Count][2][2] = {\n")
+    for kind, lval, _, _, _, _ in AST_SNIPPETS:
+        starts = [i for i, p in enumerate(patterns) if by_family[p[0]] == (kind, lval)]
+        if starts:
+            sf.write(f"    [AST_{kind}][{int(lval)}] = {{{starts[0]}, {starts[-1] + 1}}},\n")
+    sf.write("};\n")
 
-def munge_ll_file(infile, outfile):
+
+def compose_fused(families):
+    """
+    Symbolically run the vstack operations of |families| (see
+    AST_SNIPPETS), producing the arguments the fused snippet pops from
+    beneath itself (deepest first), the C body, the number of $X consts
+    it uses, and the values it leaves on the vstack. A const's $X is
+    written as $IMMn, see CToObj.sources().
+    """
+    semantics = {family: rest for _, _, family, *rest in AST_SNIPPETS}
+    args = []
+    stack = []
+    body = ""
+    num_consts = 0
+    num_temps = 0
+    for family in families:
+        pop_types, push_type, c = semantics[family]
+        operands = []
+        for type in reversed(pop_types):
+            if stack:
+                operands.insert(0, stack.pop())
+            else:
+                arg = f"in{len(args)}"
+                args.insert(0, f"{type} {arg}")
+                operands.insert(0, arg)
+        x = ""
+        if "{x}" in c:
+            x = f"$IMM{num_consts}" if family == "const" else f"$X{num_consts}"
+            num_consts += 1
+        c = c.format(*operands, x=x)
+        if push_type:
+            temp = f"t{num_temps}"
+            num_temps += 1
+            body += f"{push_type} {temp} = {c};"
+            stack.append(temp)
+        else:
+            body += c
+    return args, body, num_consts, stack
+
+
+def const_operands(families):
+    """
+    The families in |families| that take an $X, in the order of the x[]
+    a fused snippet's emitter is given.
+    """
+    semantics = {family: c for _, _, family, _, _, c in AST_SNIPPETS}
+    return [family for family in families if "{x}" in semantics[family]]
+
+
+def fused_stack_effect(families):
+    args, _, _, stack = compose_fused(families)
+    return len(args), len(stack)
+
+
+def variant_name(family, saved_int_regs, saved_float_regs=0):
+    name = f"{family}_{saved_int_regs}"
+    return f"{name}_f{saved_float_regs}" if saved_float_regs else name
+
+
+def typed_snippets():
+    """
+    AST_SNIPPETS for each of SNIPPET_TYPES, with the type's name appended
+    to each. load_addr pushes the same address whatever the type, so it's
+    the same family for all of them, and COMPARISONS are i32 only. Then
+    the loads and stores of NARROW_TYPES, which push and pop ints.
+    """
+    result = []
+    for type, (c_type, _, const) in SNIPPET_TYPES.items():
+        for kind, lval, family, pops, push, c in AST_SNIPPETS:
+            if kind in COMPARISONS and type != "i32":
+                continue
+            if family != "load_addr":
+                family = family if type == "i32" else f"{family}_{type}"
+                pops = [c_type if t == "int" else t for t in pops]
+                push = c_type if push == "int" else push
+                c = const if kind == "CONST" else re.sub(r"\bint\b", c_type, c)
+            result.append((kind, lval, family, pops, push, c, type))
+    for type, c_type in NARROW_TYPES.items():
+        for kind, lval, family, pops, push, c in AST_SNIPPETS:
+            if family in ("load", "assign_indirect"):
+                c = c.replace("*(int*)", f"*({c_type}*)")
+                result.append((kind, lval, f"{family}_{type}", pops, push, c, type))
+            elif family == "load_addr":
+                result.append((kind, lval, family, pops, push, c, type))
+    return result
+
+
+def float_pops(pops):
+    float_types = [c_type for c_type, is_float, _ in SNIPPET_TYPES.values() if is_float]
+    return sum(1 for t in pops if t in float_types)
+
+
+def max_vstack_pops():
+    """
+    The most values any single or fused snippet takes off the vstack.
+    """
+    max_pops = max(len(pops) for _, _, _, pops, _, _ in AST_SNIPPETS)
+    fused_pops = [fused_stack_effect(p)[0] for p in FUSED_PATTERNS]
+    return max([max_pops, MAX_NATIVE_ARGS] + fused_pops)
+
+
+def munge_ll_file(infile, outfile, ll_cc):
     """
     It doesn't seem to be possible to tell clang to make the calling
     convention of a function the GHC one, so we instead tag both
-    definitions and casts before continuation calls as __vectorcall, and
-    then manually search and replace vectorcall with ghccc. Additionally,
-    change tail calls to musttail to make sure we fail if the continuation
-    wouldn't be compiled to a jmp.
+    definitions and casts before continuation calls as SNIPPET_CC (e.g.
+    __vectorcall), and then manually search and replace |ll_cc| with
+    ghccc. Additionally, change tail calls that are followed by a ret to
+    musttail to make sure we fail if the continuation wouldn't be
+    compiled to a jmp.
     """
     with open(infile, "r") as f:
         contents = f.read()
-    contents = contents.replace("tail call x86_vectorcallcc", "musttail call ghccc")
-    contents = contents.replace("x86_vectorcallcc", "ghccc")
+    contents = re.sub(
+        rf"tail call {ll_cc}([^\n]*\n\s*ret void)", r"musttail call ghccc\1", contents
+    )
+    contents = contents.replace(ll_cc, "ghccc")
     with open(outfile, "w", newline="\n") as f:
         f.write(contents)
 
 
-def toolchain_c_to_obj(base_name, src, consts, continuations, snippets_file_handle, model):
+def snippet_c_prelude(target):
+    t = TARGETS[target]
+    prelude = f"""\
+#include <stdint.h>
+#define SNIPPET_CC {t["cc"]}
+"""
+    for hole in ["X", "CONT"]:
+        for i in range(4):
+            prelude += f"extern {t['extern']}uintptr_t ${hole}{i};\n"
+        for i in range(4):
+            prelude += f"#define ${hole}{i} ((uintptr_t)&${hole}{i})\n"
+    # A float CONST's $X is its bits, see SNIPPET_TYPES.
+    prelude += """\
+static inline float snippet_f32_bits(uintptr_t x) {
+  uint32_t bits = (uint32_t)x;
+  float f;
+  __builtin_memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+static inline double snippet_f64_bits(uintptr_t x) {
+  double f;
+  __builtin_memcpy(&f, &x, sizeof(f));
+  return f;
+}
+"""
+    return prelude
+
+
+def toolchain_c_to_obj(base_name, src, model, clang, target):
     c_file = base_name + ".c"
     first_ll_file = base_name + ".initial.ll"
     munged_ll_file = base_name + ".ghc.ll"
     obj_file = base_name + ".obj"
+    t = TARGETS[target]
+    flags = [f"--target={t['triple']}"] + t["flags"][model]
 
     with open(c_file, "w", newline="\n") as f:
-        f.write(
-            """\
-#include <stdint.h>
-extern uintptr_t $X0;
-extern uintptr_t $X1;
-extern uintptr_t $X2;
-extern uintptr_t $X3;
-#define $X0 ((uintptr_t)&$X0)
-#define $X1 ((uintptr_t)&$X1)
-#define $X2 ((uintptr_t)&$X2)
-#define $X3 ((uintptr_t)&$X3)
-extern uintptr_t $CONT0;
-extern uintptr_t $CONT1;
-extern uintptr_t $CONT2;
-extern uintptr_t $CONT3;
-#define $CONT0 ((uintptr_t)&$CONT0)
-#define $CONT1 ((uintptr_t)&$CONT1)
-#define $CONT2 ((uintptr_t)&$CONT2)
-#define $CONT3 ((uintptr_t)&$CONT3)
-"""
-        )
+        f.write(snippet_c_prelude(target))
         f.write(src)
         f.write("\n")
 
     subprocess.check_call(
-        [CLANG_PATH, "-std=c2x", "-emit-llvm", c_file, "-O3", "-S", "-o", first_ll_file]
+        [clang, "-std=c2x", "-emit-llvm", c_file, "-O3", "-S", "-o", first_ll_file] + flags
     )
-    munge_ll_file(first_ll_file, munged_ll_file)
+    munge_ll_file(first_ll_file, munged_ll_file, t["ll_cc"])
 
     # -mcmodel=medium is a useful hack to help with constants in the
     # snippets. I think medium is supposed to mean that most code and
@@ -209,7 +1331,7 @@ extern uintptr_t $CONT3;
     # model.
     subprocess.check_call(
         [
-            CLANG_PATH,
+            clang,
             "-std=c2x",
             munged_ll_file,
             f"-mcmodel={model}",
@@ -218,42 +1340,358 @@ extern uintptr_t $CONT3;
             "-o",
             obj_file,
         ]
+        + flags
     )
     # subprocess.check_call(["dumpbin", "/disasm", obj_file])
-    process_obj_file_to_patch_func(
-        obj_file, base_name, snippets_file_handle, src, consts, continuations
-    )
+    return obj_file
+
+
+CACHE_DIR = "snippet_cache"
+# Where clang's intermediate files for each snippet go.
+BUILD_DIR = os.path.join(CACHE_DIR, "build")
+
+# Everything other than the snippet's own source and the toolchain that
+# affects what gets extracted, so that editing any of these invalidates
+# the cache.
+PIPELINE_SOURCE = "".join(
+    inspect.getsource(f)
+    for f in (snippet_c_prelude, munge_ll_file, toolchain_c_to_obj, read_obj_file)
+) + repr(TARGETS)
+
+
+def build_snippet(base_name, src, model, toolchain, use_cache):
+    """
+    Compile one snippet and extract its code, holes and data (see
+    read_obj_file()), in BUILD_DIR. This is what's run in the process
+    pool. The result is cached in CACHE_DIR keyed on a hash of everything
+    that goes into it, so unchanged snippets don't run clang at all.
+    |toolchain| is (clang path, its --version, target).
+    """
+    clang, clang_version, target = toolchain
+    key = hashlib.sha256(
+        "\0".join([src, model, clang_version, target, PIPELINE_SOURCE]).encode("utf-8")
+    ).hexdigest()
+    cache_file = os.path.join(CACHE_DIR, key + ".json")
+    if use_cache and os.path.exists(cache_file):
+        with open(cache_file, "r") as f:
+            return json.load(f)
+
+    os.makedirs(BUILD_DIR, exist_ok=True)
+    obj_file = toolchain_c_to_obj(os.path.join(BUILD_DIR, base_name), src, model, clang, target)
+    obj = read_obj_file(obj_file)
+
+    os.makedirs(CACHE_DIR, exist_ok=True)
+    tmp_file = f"{cache_file}.{os.getpid()}.tmp"
+    with open(tmp_file, "w") as f:
+        json.dump(obj, f)
+    os.replace(tmp_file, cache_file)
+    return obj
+
+
+def merge_imm_hole(c, objs):
+    """
+    Turn the two objects compiled from c.sources() into one with a hole
+    for the immediate, or None if clang didn't encode it with the width
+    that was asked for, e.g. there's no imm8 form of a store.
+    """
+    a, b = objs
+    index, kind = c.imm
+    if len(a["code"]) != len(b["code"]) or a["holes"] != b["holes"] or a["data"] != b["data"]:
+        return None
+    diff = [i for i, (x, y) in enumerate(zip(a["code"], b["code"])) if x != y]
+    width = 4 if kind == "IMM32" else 1
+    if len(diff) != width or diff[-1] - diff[0] != width - 1:
+        return None
+    offset = diff[0]
+    for obj, value in zip(objs, IMM_SENTINELS[kind]):
+        encoded = value.to_bytes(width, "little", signed=True)
+        if obj["code"][offset : offset + width] != list(encoded):
+            return None
+    a["code"][offset : offset + width] = [0] * width
+    hole = "IMM32" if kind == "IMM32" else "IMM8"
+    a["holes"] = sorted(a["holes"] + [[offset, hole, f"$X{index}", 0]])
+    return a
+
+
+# Enough of x86-64 to find where each instruction in a scalar snippet
+# starts, for peephole_variants(): opcode (after any prefixes and REX) ->
+# (has a ModRM byte, bytes of immediate), where "z" is 4 bytes (2 with a
+# 66 prefix), "v" is 8 with REX.W (the movabs), and "f7" is f7's, which
+# only test has. Relative branches are in X86_BRANCHES instead, with the
+# size of their displacement.
+X86_OPCODES = {(0x0F, 0x1F): (True, 0), (0x0F, 0xAF): (True, 0)}
+for alu in range(0x00, 0x40, 8):  # add, or, adc, sbb, and, sub, xor, cmp
+    X86_OPCODES.update({(op,): (True, 0) for op in range(alu, alu + 4)})
+    X86_OPCODES.update({(alu + 4,): (False, 1), (alu + 5,): (False, "z")})
+X86_OPCODES.update({(op,): (False, 0) for op in range(0x50, 0x60)})  # push, pop
+X86_OPCODES.update({(op,): (True, 0) for op in range(0x84, 0x8C)})  # test, xchg, mov
+X86_OPCODES.update({(op,): (False, 1) for op in range(0xB0, 0xB8)})
+X86_OPCODES.update({(op,): (False, "v") for op in range(0xB8, 0xC0)})
+X86_OPCODES.update(
+    {
+        (0x63,): (True, 0),
+        (0x69,): (True, "z"),
+        (0x6B,): (True, 1),
+        (0x80,): (True, 1),
+        (0x81,): (True, "z"),
+        (0x83,): (True, 1),
+        (0x8D,): (True, 0),
+        (0x90,): (False, 0),
+        (0x98,): (False, 0),
+        (0x99,): (False, 0),
+        (0xC1,): (True, 1),
+        (0xC3,): (False, 0),
+        (0xC6,): (True, 1),
+        (0xC7,): (True, "z"),
+        (0xCC,): (False, 0),
+        (0xD1,): (True, 0),
+        (0xD3,): (True, 0),
+        (0xF7,): (True, "f7"),
+        (0xFF,): (True, 0),
+    }
+)
+# cmovcc, setcc, movzx and movsx, and the SSE moves, conversions and
+# arithmetic that the float snippets use.
+X86_OPCODES.update({(0x0F, op): (True, 0) for op in range(0x40, 0x50)})
+X86_OPCODES.update({(0x0F, op): (True, 0) for op in range(0x90, 0xA0)})
+X86_OPCODES.update({(0x0F, op): (True, 0) for op in (0xB6, 0xB7, 0xBE, 0xBF)})
+X86_OPCODES.update(
+    {(0x0F, op): (True, 0) for op in (0x10, 0x11, 0x28, 0x29, 0x2A, 0x2C, 0x2D, 0x2E, 0x2F)}
+)
+X86_OPCODES.update({(0x0F, op): (True, 0) for op in (0x51, 0x54, 0x57, 0x6E, 0x7E, 0xD6)})
+X86_OPCODES.update({(0x0F, op): (True, 0) for op in range(0x58, 0x60)})
+X86_BRANCHES = {(0xE8,): 4, (0xE9,): 4, (0xEB,): 1}
+X86_BRANCHES.update({(op,): 1 for op in range(0x70, 0x80)})
+X86_BRANCHES.update({(0x0F, op): 4 for op in range(0x80, 0x90)})
+
+# The registers that ghccc passes arguments in (see CToObj), by number,
+# i.e. those that can be live from one snippet into the next.
+GHCCC_ARG_REGS = {13, 5, 12, 3, 14, 6, 7, 8, 9, 15}
+
+
+def decode_x86(code):
+    """
+    The instructions in |code| as dicts of their offset "at", "len", "rex",
+    "op", the offset of the opcode "op_at" and of the ModRM byte "modrm"
+    (or None), and whether it's a "branch", or None if anything in it
+    isn't in X86_OPCODES or X86_BRANCHES.
+    """
+    insns = []
+    i = 0
+    try:
+        while i < len(code):
+            start, opsize, rex = i, False, 0
+            while code[i] in (0x66, 0xF2, 0xF3):
+                opsize = opsize or code[i] == 0x66
+                i += 1
+            if 0x40 <= code[i] <= 0x4F:
+                rex = code[i]
+                i += 1
+            op = (code[i],) if code[i] != 0x0F else (0x0F, code[i + 1])
+            insn = {"at": start, "rex": rex, "op": op, "op_at": i, "modrm": None}
+            insn["branch"] = op in X86_BRANCHES
+            i += len(op)
+            if insn["branch"]:
+                i += X86_BRANCHES[op]
+            elif op not in X86_OPCODES:
+                return None
+            else:
+                has_modrm, imm = X86_OPCODES[op]
+                if has_modrm:
+                    insn["modrm"] = i
+                    mod, reg, rm = code[i] >> 6, (code[i] >> 3) & 7, code[i] & 7
+                    i += 1
+                    if mod != 3 and rm == 4:
+                        i += 1
+                        if mod == 0 and code[i - 1] & 7 == 5:
+                            i += 4
+                    i += {0: 4 if rm == 5 else 0, 1: 1, 2: 4, 3: 0}[mod]
+                if imm == "f7":
+                    imm = "z" if reg < 2 else 0
+                if imm == "v" and rex & 8:
+                    imm = 8
+                if imm in ("z", "v"):
+                    imm = 2 if opsize else 4
+                i += imm
+            insn["len"] = i - start
+            insns.append(insn)
+    except IndexError:
+        return None
+    return insns if i == len(code) else None
+
+
+def names_reg(code, insn, reg):
+    """
+    Whether |insn| might read |reg|: anything but a register to register
+    instruction with neither of them |reg| (and none implicit) might.
+    """
+    if insn["modrm"] is None or insn["op"] in ((0xD3,), (0xF7,)):
+        return True
+    modrm, rex = code[insn["modrm"]], insn["rex"]
+    if modrm >> 6 != 3:
+        return True
+    return (modrm >> 3) & 7 | (rex & 4) << 1 == reg or modrm & 7 | (rex & 1) << 3 == reg
+
+
+def peephole_variants(code, holes):
+    """
+    Shorter forms of a snippet for when the $X const of a movabs in it is
+    small, as (C condition on the const, code, holes), best first:
+
+      movabs $X, %rA; op ..., 0(%rB,%rA,1)   ->  op ..., $X(%rB)
+      movabs $X, %rA                         ->  mov $X, %eA
+
+    The first is how clang addresses the frame at a medium model offset
+    (in spill and reload), and works when %rA dies there, i.e. it's not a
+    ghccc argument and nothing after the op before the jmp to $CONT0 could
+    read it.
+    Moving the code after the movabs is only safe if it's all addressed
+    by holes, which are patched in wherever they end up, so snippets with
+    data, any other continuations or branches that aren't holes have no
+    variants.
+    """
+    insns = decode_x86(code)
+    jmp_cont0 = [len(code) - 4, "REL32", "$CONT0", -4]
+    if insns is None or insns[-1]["op"] != (0xE9,) or jmp_cont0 not in holes:
+        return []
+    hole_at = {hole[0]: hole for hole in holes}
+    for hole in holes:
+        if hole[2].startswith("$CONT") and hole != jmp_cont0:
+            return []
+    for insn in insns:
+        if insn["branch"] and insn["at"] + insn["len"] - 4 not in hole_at:
+            return []
+    for k, insn in enumerate(insns):
+        op, rex, at = insn["op"], insn["rex"], insn["at"]
+        value_at = at + 2
+        if not (rex & 8 and 0xB8 <= op[0] <= 0xBF and insn["len"] == 10):
+            continue
+        hole = hole_at.get(value_at)
+        if not hole or hole[1] != "ADDR64" or hole[3] != 0 or not hole[2].startswith("$X"):
+            continue
+        reg = (op[0] - 0xB8) | (rex & 1) << 3
+        variants = []
+
+        def splice(end, new, imm_at):
+            # |new| replaces code[at:end], with an IMM32 hole at |imm_at|
+            # in it, and everything after moves up.
+            shift = len(new) - (end - at)
+            new_holes = [h for h in holes if h[0] < at]
+            new_holes.append([at + imm_at, "IMM32", hole[2], 0])
+            new_holes += [[h[0] + shift, *h[1:]] for h in holes if h[0] >= end]
+            return code[:at] + new + code[end:], sorted(new_holes)
+
+        use = insns[k + 1] if k + 2 < len(insns) else None
+        if use and use["modrm"] is not None and reg not in GHCCC_ARG_REGS and all(
+            not names_reg(code, later, reg) for later in insns[k + 2 : -1]
+        ):
+            m = use["modrm"]
+            mod, rm, sib = code[m] >> 6, code[m] & 7, code[m + 1]
+            use_rex = use["rex"]
+            index = (sib >> 3) & 7 | (use_rex & 2) << 2
+            base = sib & 7 | (use_rex & 1) << 3
+            uses_reg = (code[m] >> 3) & 7 | (use_rex & 4) << 1
+            disp = {0: 0, 1: 1}.get(mod)
+            if (
+                rm == 4
+                and disp is not None
+                and (disp == 0 or code[m + 2] == 0)
+                and sib >> 6 == 0
+                and index == reg
+                and base != reg
+                and not (mod == 0 and base & 7 == 5)
+                and uses_reg != reg
+            ):
+                head = code[use["at"] : m]
+                if use_rex:
+                    head[use["op_at"] - 1 - use["at"]] = use_rex & ~2
+                modrm = [0x80 | (code[m] & 0x38) | (base & 7)]
+                if base & 7 == 4:
+                    modrm.append(0x24)
+                end = use["at"] + use["len"]
+                new = head + modrm + [0] * 4 + code[m + 2 + disp : end]
+                if all(not (use["at"] <= h[0] < end) for h in holes):
+                    variants.append(("<= 0x7fffffff", *splice(end, new, len(head) + len(modrm))))
+
+        short = ([0x41] if rex & 1 else []) + [op[0]]
+        variants.append(("<= 0xffffffff", *splice(at + 10, short + [0] * 4, len(short))))
+        return [(f"{hole[2]} {cond}", c, h) for cond, c, h in variants]
+    return []
 
 
 class CToObj:
-    def __init__(self, base_name, saved_int_regs, snippets_file, model='small'):
+    """
+    Builds the C for one snippet, which is added to |snippets| on exit.
+    They're all compiled together afterwards by build_all().
+    """
+
+    def __init__(
+        self,
+        base_name,
+        saved_int_regs,
+        snippets,
+        model="small",
+        imm=None,
+        simd=None,
+        saved_float_regs=0,
+    ):
         self.base_name = base_name
         self.saved_int_regs = saved_int_regs
+        # Float vstack entries beneath, in xmm registers rather than general
+        # purpose ones, see SNIPPET_TYPES.
+        self.saved_float_regs = saved_float_regs
         self.code = ""
         self.consts_used = []
         self.continuations_used = []
-        self.snippets_file = snippets_file
+        self.snippets = snippets
         self.model = model
+        # (const index, an IMM_SENTINELS kind) if $IMMn in the code is patched
+        # as an immediate rather than being an extern's address.
+        self.imm = imm
+        # A SIMD_ISAS key if the vstack is vectors, see SIMD_SNIPPETS.
+        self.simd = simd
 
     def __enter__(self):
         return self
 
     def __exit__(self, type, value, traceback):
-        toolchain_c_to_obj(
-            f"{self.base_name}_{self.saved_int_regs}",
-            self.code,
-            self.consts_used,
-            self.continuations_used,
-            self.snippets_file,
-            self.model,
-        )
+        if type is None:
+            self.snippets.append(self)
 
-    def build_decl(self, args):
-        result = (
-            f"__vectorcall void {self.base_name}_{self.saved_int_regs}(uintptr_t $stack"
-        )
+    @property
+    def name(self):
+        return variant_name(self.base_name, self.saved_int_regs, self.saved_float_regs)
+
+    def sources(self):
+        """
+        The C to compile. With an immediate there are two, one for each of
+        its IMM_SENTINELS, and merge_imm_hole() finds it from the diff.
+        """
+        if not self.imm:
+            return [self.code]
+        index, kind = self.imm
+        return [self.code.replace(f"$IMM{index}", f"({v})") for v in IMM_SENTINELS[kind]]
+
+    def build_decl(self, args, attributes=""):
+        # Every snippet takes and passes on $stack (the frame) and $row
+        # (the row in batch mode, otherwise 0) ahead of the vstack, and the
+        # SIMD ones $dst after those. ghccc assigns general purpose and xmm
+        # registers separately, so the saved ints and floats can each be
+        # listed in vstack order, with the operands after both.
+        result = ""
+        if self.simd:
+            isa = SIMD_ISAS[self.simd]
+            size = isa["lanes"] * 4
+            result += f"typedef int simd __attribute__((vector_size({size})));"
+            result += f"typedef int simd_u __attribute__((vector_size({size}), aligned(4)));"
+            attributes += f'__attribute__((target("{isa["target"]}"))) '
+        result += f"{attributes}SNIPPET_CC void {self.name}(uintptr_t $stack, uintptr_t $row"
+        if self.simd:
+            result += ", uintptr_t $dst"
         for i in range(self.saved_int_regs):
-            result += f", uintptr_t $r{i}"
+            result += f", {self.value_type} $r{i}"
+        for i in range(self.saved_float_regs):
+            result += f", double $f{i}"
         for i in args:
             result += f", {i}"
         result += ")"
@@ -263,18 +1701,47 @@ class CToObj:
         self.emit(f"$X{const_index}")
         self.consts_used.append(const_index)
 
-    def build_continuation(self, cont_index, to_add):
+    @property
+    def value_type(self):
+        return "simd" if self.simd else "uintptr_t"
+
+    def build_continuation(
+        self,
+        cont_index,
+        to_add,
+        saved=None,
+        stack="$stack",
+        row="$row",
+        dst="$dst",
+        saved_floats=None,
+        types=None,
+    ):
         # 'return' is necessary because it's converted to a [[musttail]],
         # which clang specifies has to be on a return even though it's void.
-        num_args = self.saved_int_regs + len(to_add)
-        result = "return ((void (*__vectorcall)(uintptr_t"
-        for i in range(self.saved_int_regs):
+        # |saved| and |saved_floats| replace the $r and $f values passed
+        # through unchanged, for the snippets that move values between the
+        # vstack and the frame. |types| are the C types of |to_add|, which
+        # are int (or the SIMD vector) by default.
+        if saved is None:
+            saved = [f"$r{i}" for i in range(self.saved_int_regs)]
+        if saved_floats is None:
+            saved_floats = [f"$f{i}" for i in range(self.saved_float_regs)]
+        if types is None:
+            types = ["simd" if self.simd else "int"] * len(to_add)
+        result = "return ((void (*SNIPPET_CC)(uintptr_t, uintptr_t"
+        if self.simd:
             result += ", uintptr_t"
-        for i in to_add:  # TODO: assuming all 'int' right now
-            result += ", int"
-        result += f"))$CONT{cont_index})($stack"
-        for i in range(self.saved_int_regs):
-            result += f", $r{i}"
+        for i in saved:
+            result += f", {self.value_type}"
+        for i in saved_floats:
+            result += ", double"
+        for type in types:
+            result += f", {type}"
+        result += f"))$CONT{cont_index})({stack}, {row}"
+        if self.simd:
+            result += f", {dst}"
+        for i in saved + saved_floats:
+            result += f", {i}"
         for i in to_add:
             result += f", {i}"
         result += ");"
@@ -285,67 +1752,350 @@ class CToObj:
         self.code += text
 
 
-def main():
-    with open("snippets.c", "w", newline="\n") as sf:
-        sf.write("#include <stdint.h>\n\n")
+SNIPPETS_C_HEADER = """\
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
-        for ir in range(4):
-            with CToObj("load_addr", ir, sf) as c:
-                c.build_decl([])
-                c.emit("{ uintptr_t v = (")
+"""
+
+
+def declare_snippets():
+    """
+    All the snippets, in the order they're written to snippets.c.
+    """
+    snippets = []
+    # AST_SNIPPETS for every type, see typed_snippets(), and conversions
+    # between them.
+    built = set()
+    for kind, _, family, pops, push, c_expr, _ in typed_snippets():
+        if family in built:
+            continue
+        built.add(family)
+        for ir in range(MAX_SAVED_INT_REGS):
+            for fr in range(MAX_SAVED_FLOAT_REGS):
+                model = "medium" if kind == "CONST" else "small"
+                with CToObj(family, ir, snippets, model=model, saved_float_regs=fr) as c:
+                    c.build_decl([f"{type} in{i}" for i, type in enumerate(pops)])
+                    if "{x}" in c_expr:
+                        c.consts_used.append(0)
+                    body = c_expr.format(*[f"in{i}" for i in range(len(pops))], x="$X0")
+                    if push:
+                        c.emit(f"{{ {push} v = {body};")
+                        c.build_continuation(0, ["v"], types=[push])
+                    else:
+                        c.emit(f"{{ {body}")
+                        c.build_continuation(0, [])
+                    c.emit("}")
+
+    for src, (src_c_type, _, _) in SNIPPET_TYPES.items():
+        for dst, (dst_c_type, _, _) in SNIPPET_TYPES.items():
+            if src == dst:
+                continue
+            for ir in range(MAX_SAVED_INT_REGS):
+                for fr in range(MAX_SAVED_FLOAT_REGS):
+                    with CToObj(f"cvt_{src}_{dst}", ir, snippets, saved_float_regs=fr) as c:
+                        c.build_decl([f"{src_c_type} in0"])
+                        c.emit(f"{{ {dst_c_type} v = ({dst_c_type})in0;")
+                        c.build_continuation(0, ["v"], types=[dst_c_type])
+                        c.emit("}")
+
+    # Branches for IF and loops, see jit_compile_nodes() in cnp.c.
+    # jump_if_lt etc. compare two ints, and jump_if_nz and jump_if_z test
+    # one, going to $CONT1 if the condition holds and otherwise on to
+    # $CONT0, which _fallthrough drops. As for loop_tail, that's written
+    # as the negation going to $CONT0 because clang puts the if's body
+    # last, and minsize makes the other a jcc straight to $CONT1. jump is
+    # just a jmp to $CONT0, for the end of a block that's out of line and
+    # into a loop's condition. $CONT1 can just as well be behind, for the
+    # jump back to the top of a loop.
+    conditions = [
+        (f"jump_if_{family}", ["int a", "int b"], f"a {op} b")
+        for family, op, _ in COMPARISONS.values()
+    ]
+    conditions += [("jump_if_nz", ["int v"], "v != 0"), ("jump_if_z", ["int v"], "v == 0")]
+    for name, args, cond in conditions:
+        for ir in range(MAX_SAVED_INT_REGS):
+            with CToObj(name, ir, snippets) as c:
+                c.build_decl(args, attributes="__attribute__((minsize)) ")
+                c.emit(f"{{ if (__builtin_expect(!({cond}), 0)) {{")
+                c.build_continuation(0, [])
+                c.emit("}")
+                c.build_continuation(1, [])
+                c.emit("}")
+
+    for ir in range(MAX_SAVED_INT_REGS):
+        with CToObj("jump", ir, snippets) as c:
+            c.build_decl([])
+            c.emit("{")
+            c.build_continuation(0, [])
+            c.emit("}")
+
+    # call_native_A_N calls the C function at $X0 with the top A ints on
+    # the vstack, beneath which there are N, and pushes what it returns.
+    # ghccc has no callee saved registers, and the snippet is compiled
+    # for each N, so clang only has to keep the values that are actually
+    # live (the N, $stack and $row) in registers that the C ABI preserves
+    # across the call. Most of ghccc's already are, so that's just a mov
+    # or two rather than a store and a load each. The function is probably
+    # too far from the code for a call rel32 to reach it, which is what
+    # clang would make of a call to $X0 even in the medium model, so its
+    # address goes through an asm to be a movabs (medium model data) and
+    # the call is through the register.
+    for nargs in range(MAX_NATIVE_ARGS + 1):
+        for ir in range(MAX_SAVED_INT_REGS):
+            with CToObj(f"call_native_{nargs}", ir, snippets, model="medium") as c:
+                args = [f"in{i}" for i in range(nargs)]
+                c.build_decl([f"int {arg}" for arg in args])
+                params = ", ".join(["int"] * nargs) or "void"
+                c.emit("{ uintptr_t fn = ")
                 c.build_const(0)
-                c.emit(");")
+                c.emit('; __asm__("" : "+r"(fn));')
+                c.emit(f"int v = ((int (*)({params}))fn)({', '.join(args)});")
                 c.build_continuation(0, ["v"])
                 c.emit("}")
 
-        for ir in range(4):
-            with CToObj("load", ir, sf) as c:
+    # A C function that calls the jitted code at $CONT0, which returns to
+    # it with a ret. ghccc has no callee saved registers, so this saves
+    # all of the C ABI's, and it isn't a tail call because of the asm.
+    with CToObj("c_entry", 0, snippets) as c:
+        c.emit("void c_entry_0(void) {")
+        c.emit("((void (*SNIPPET_CC)(uintptr_t, uintptr_t))$CONT0)(0, 0);")
+        c.emit('__asm__ volatile("");')
+        c.emit("}")
+        c.continuations_used.append(0)
+
+    # The columns for batch mode, see BATCH_SNIPPETS.
+    for ir in range(MAX_SAVED_INT_REGS):
+        with CToObj("load_column", ir, snippets) as c:
+            c.build_decl([])
+            c.emit("{ int v = ((int*)(")
+            c.build_const(0)
+            c.emit("))[$row];")
+            c.build_continuation(0, ["v"])
+            c.emit("}")
+
+    for ir in range(MAX_SAVED_INT_REGS):
+        with CToObj("assign_column", ir, snippets) as c:
+            c.build_decl(["uintptr_t column", "int v"])
+            c.emit("{ ((int*)(column))[$row] = v;")
+            c.build_continuation(0, [])
+            c.emit("}")
+
+    # The end of a batch mode loop: back to the start of the body at
+    # $CONT1 for the next row until there are $X0, then on to $CONT0 with
+    # $row back at 0. clang puts the if's body last, so that's the exit
+    # to make the jmp to $CONT0 the one that _fallthrough drops. minsize
+    # gets the back edge as a conditional tail call, a jne straight to
+    # $CONT1 rather than a je over a jmp.
+    with CToObj("loop_tail", 0, snippets, model="medium") as c:
+        c.build_decl([], attributes="__attribute__((minsize)) ")
+        c.emit("{ uintptr_t next = $row + 1; if (__builtin_expect(next == ")
+        c.build_const(0)
+        c.emit(", 0)) {")
+        c.build_continuation(0, [], row="0")
+        c.emit("}")
+        c.build_continuation(1, [], row="next")
+        c.emit("}")
+
+    # SIMD_SNIPPETS, and the loop tail for each ISA. That's the same as
+    # loop_tail_0 except that it steps by the number of lanes and leaves
+    # $row at $X0, for the scalar loop that does any rows left over.
+    for isa, info in SIMD_ISAS.items():
+        for kind, _, family, pops, push, expr in SIMD_SNIPPETS:
+            for ir in range(MAX_SAVED_SIMD_REGS):
+                model = "medium" if kind == "CONST" else "small"
+                with CToObj(f"{family}_{isa}", ir, snippets, model=model, simd=isa) as c:
+                    c.build_decl([f"{type} in{i}" for i, type in enumerate(pops)])
+                    if "{x}" in expr:
+                        c.consts_used.append(0)
+                    body = expr.format(*[f"in{i}" for i in range(len(pops))], x="$X0")
+                    if push == "$dst":
+                        c.emit(f"{{ uintptr_t d = {body};")
+                        c.build_continuation(0, [], dst="d")
+                    elif push:
+                        c.emit(f"{{ simd v = {body};")
+                        c.build_continuation(0, ["v"])
+                    else:
+                        c.emit(f"{{ {body}")
+                        c.build_continuation(0, [])
+                    c.emit("}")
+
+        with CToObj(f"loop_tail_{isa}", 0, snippets, model="medium", simd=isa) as c:
+            c.build_decl([], attributes="__attribute__((minsize)) ")
+            c.emit(f"{{ uintptr_t next = $row + {info['lanes']}; if (__builtin_expect(next == ")
+            c.build_const(0)
+            c.emit(", 0)) {")
+            c.build_continuation(0, [], row="next")
+            c.emit("}")
+            c.build_continuation(1, [], row="next")
+            c.emit("}")
+
+    # Entry to jitted code: point $stack at the frame in $X0.
+    with CToObj("stack_frame", 0, snippets, model="medium") as c:
+        c.build_decl([])
+        c.emit("{")
+        c.build_continuation(0, [], stack="$X0")
+        c.consts_used.append(0)
+        c.emit("}")
+
+    # pickE_N has N values on the vstack and pushes a copy of the one at
+    # index E from the bottom ($rE), i.e. a mov between registers, for a
+    # load that's been hoisted out of a loop.
+    for ir in range(1, MAX_SAVED_INT_REGS):
+        for entry in range(ir):
+            with CToObj(f"pick{entry}", ir, snippets) as c:
                 c.build_decl([])
-                c.emit("{ int v = *(int*)(")
-                c.build_const(0)
-                c.emit(");")
+                c.emit(f"{{ int v = (int)$r{entry};")
                 c.build_continuation(0, ["v"])
                 c.emit("}")
 
-        for ir in range(4):
-            with CToObj("const", ir, sf, model='medium') as c:
+    # shl_N shifts the int on top of N others left by the immediate in
+    # $IMM0, for a MUL by a power of two. It's unsigned so that it wraps
+    # as the multiply would.
+    for ir in range(MAX_SAVED_INT_REGS):
+        with CToObj("shl", ir, snippets, imm=(0, "SHIFT")) as c:
+            c.build_decl(["int in0"])
+            c.emit("{ int v = (int)((unsigned)in0 << $IMM0);")
+            c.consts_used.append(0)
+            c.build_continuation(0, ["v"])
+            c.emit("}")
+
+    # spill_N has N values on the vstack and stores the oldest ($r0) to
+    # the frame at byte offset $X0, leaving N-1; reload_N has N and puts
+    # the one at $X0 back beneath them. spill_float and reload_float do
+    # the same for the oldest float ($f0), with the _fN variants having N
+    # floats in registers too.
+    for ir in range(MAX_SAVED_INT_REGS + 1):
+        for fr in range(MAX_SAVED_FLOAT_REGS + 1):
+            for family, reg, count in (("spill", "r", ir), ("spill_float", "f", fr)):
+                if count == 0:
+                    continue
+                with CToObj(family, ir, snippets, model="medium", saved_float_regs=fr) as c:
+                    c.build_decl([])
+                    c.emit(f"{{ *({c.value_type if reg == 'r' else 'double'}*)($stack + ")
+                    c.build_const(0)
+                    c.emit(f") = ${reg}0;")
+                    rest = [f"${reg}{i}" for i in range(1, count)]
+                    if reg == "r":
+                        c.build_continuation(0, [], saved=rest)
+                    else:
+                        c.build_continuation(0, [], saved_floats=rest)
+                    c.emit("}")
+
+    for ir in range(max_vstack_pops()):
+        for fr in range(max_vstack_pops() - ir):
+            saved = [f"$r{i}" for i in range(ir)]
+            saved_floats = [f"$f{i}" for i in range(fr)]
+            with CToObj("reload", ir, snippets, model="medium", saved_float_regs=fr) as c:
                 c.build_decl([])
-                c.emit("{ int v = (")
+                c.emit("{ uintptr_t v = *(uintptr_t*)($stack + ")
                 c.build_const(0)
                 c.emit(");")
-                c.build_continuation(0, ["v"])
+                c.build_continuation(0, [], saved=["v"] + saved)
                 c.emit("}")
-
-        for ir in range(4):
-            with CToObj("add", ir, sf) as c:
-                c.build_decl(["int a", "int b"])
-                c.emit("{ int v = a + b;")
-                c.build_continuation(0, ["v"])
+            with CToObj("reload_float", ir, snippets, model="medium", saved_float_regs=fr) as c:
+                c.build_decl([])
+                c.emit("{ double v = *(double*)($stack + ")
+                c.build_const(0)
+                c.emit(");")
+                c.build_continuation(0, [], saved_floats=["v"] + saved_floats)
                 c.emit("}")
 
-        for ir in range(4):
-            with CToObj("assign_indirect", ir, sf) as c:
-                c.build_decl(["uintptr_t offset", "int v"])
-                c.emit("{ *(int*)(offset) = v;")
-                c.build_continuation(0, [])
-                c.emit("}")
+    for families in FUSED_PATTERNS:
+        args, body, num_consts, results = compose_fused(families)
+        base_name = "_".join(families)
+        variants = [(base_name, None)]
+        if "const" in families:
+            index = const_operands(families).index("const")
+            variants = [
+                (f"{base_name}_imm8", (index, "IMM8")),
+                (f"{base_name}_imm32", (index, "IMM32")),
+            ]
+        for name, imm in variants:
+            for ir in range(MAX_SAVED_INT_REGS):
+                with CToObj(name, ir, snippets, imm=imm) as c:
+                    c.build_decl(args)
+                    c.emit(f"{{ {body}")
+                    c.consts_used.extend(range(num_consts))
+                    c.build_continuation(0, results)
+                    c.emit("}")
+    return snippets
 
-        for ir in range(4):
-            with CToObj("mul", ir, sf) as c:
-                c.build_decl(["int a", "int b"])
-                c.emit("{ int v = a * b;")
-                c.build_continuation(0, ["v"])
-                c.emit("}")
 
-        for ir in range(4):
-            with CToObj("if_then_else", ir, sf) as c:
-                c.build_decl(["bool cond"])
-                c.emit("{ if (cond) {")
-                c.build_continuation(0, [])
-                c.emit("} else {")
-                c.build_continuation(1, [])
-                c.emit("}")
-                c.emit("}")
+def build_all(snippets, target, jobs, use_cache):
+    """
+    Run the compile and extract pipeline for every snippet in a process
+    pool, returning what was read from their object files in the same
+    order as |snippets| (None for an immediate variant that couldn't be
+    made, see merge_imm_hole()).
+    """
+    clang_version = subprocess.run(
+        [CLANG_PATH, "--version"], stdout=subprocess.PIPE
+    ).stdout.decode("utf-8")
+    toolchain = (CLANG_PATH, clang_version, target)
+    with concurrent.futures.ProcessPoolExecutor(max_workers=jobs) as pool:
+        futures = []
+        for c in snippets:
+            sources = c.sources()
+            futures.append(
+                [
+                    pool.submit(
+                        build_snippet,
+                        c.name if len(sources) == 1 else f"{c.name}.{i}",
+                        src,
+                        c.model,
+                        toolchain,
+                        use_cache,
+                    )
+                    for i, src in enumerate(sources)
+                ]
+            )
+        results = []
+        for c, fs in zip(snippets, futures):
+            objs = [f.result() for f in fs]
+            results.append(merge_imm_hole(c, objs) if c.imm else objs[0])
+        return results
+
+
+def main():
+    global MAX_SAVED_INT_REGS, CLANG_PATH, CLANG_FORMAT_PATH
+    parser = argparse.ArgumentParser(description="Generate snippets.c")
+    parser.add_argument(
+        "-j", "--jobs", type=int, default=os.cpu_count(), help="parallel clang pipelines"
+    )
+    parser.add_argument(
+        "--no-cache", action="store_true", help=f"rebuild everything, ignoring {CACHE_DIR}/"
+    )
+    parser.add_argument(
+        "--vstack-regs",
+        type=int,
+        default=MAX_SAVED_INT_REGS,
+        help="deepest vstack kept in registers beneath an operation before spilling",
+    )
+    parser.add_argument(
+        "--target",
+        choices=sorted(TARGETS),
+        default="windows" if sys.platform == "win32" else "linux",
+        help="platform to build the snippets for",
+    )
+    parser.add_argument("--clang", default=CLANG_PATH)
+    parser.add_argument("--clang-format", default=CLANG_FORMAT_PATH)
+    args = parser.parse_args()
+    MAX_SAVED_INT_REGS = args.vstack_regs
+    CLANG_PATH = args.clang
+    CLANG_FORMAT_PATH = args.clang_format
+
+    snippets = declare_snippets()
+    results = build_all(snippets, args.target, args.jobs, not args.no_cache)
+    with open("snippets.c", "w", newline="\n") as sf:
+        sf.write(SNIPPETS_C_HEADER)
+        for c, obj in zip(snippets, results):
+            if obj is None:
+                continue
+            write_patch_func(c.name, sf, c.code, c.consts_used, c.continuations_used, obj)
+        write_ast_dispatch(sf)
 
 
 if __name__ == "__main__":
@@ -8,146 +8,3783 @@
 //
 //   (or m.bat to do both)
 //
+//   On Linux, `python3 clang_rip.py` generates ELF snippets instead and
+//   `clang -Wall -Wextra -Werror -Oz -pthread cnp.c -o cnp` builds it (or
+//   m.sh).
+//
+//   Run `cnp.exe bench` to also time the snippet emitters and jit_compile,
+//   and batch mode against C (for which, build with -O3).
+//   (`python clang_rip.py --vstack-regs 9` first to compare spilling
+//   against keeping deep expressions entirely in registers.)
+//
+//   Run `cnp.exe suite` for CSV of how random expressions compile and
+//   run, interpreted, jitted and optionally compiled ahead of time, see
+//   suite.c.
+//
 // This example calculates:
 //
 //   a = (b + c + f * g) * (d + 3)
 //
-// using a version of copy-and-patch jitting.
+// using a version of copy-and-patch jitting.
+//
+// Additionally, some pondering on smaller representations of Token and
+// Ast (nodes) that are array-packed and don't do allocation or a lot of
+// pointer chasing. It lexes and parses (see lex.c and parse.c) straight
+// into those, and the jit generation is driven by the parse tree.
+
+#define _CRT_SECURE_NO_WARNINGS 1
+
+#ifdef _WIN32
+#include <windows.h>
+#undef ERROR
+#undef CONST
+#undef MAX
+#undef MIN
+#undef min
+#undef max
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define countof(a) (sizeof(a) / sizeof(a[0]))
+#define countofi(a) ((int)(sizeof(a) / sizeof(a[0])))
+#define max(x, y) ((x) >= (y) ? (x) : (y))
+
+#include "os.c"
+#include "code_arena.c"
+
+typedef uint64_t Token;
+// 8 for kind
+// 56 for const value (inline!)
+//
+// or for a name
+//
+// 8 for kind
+// 24 for index into the Intern table it was lexed with, see intern.c
+// 32 unused (real-life might be an index into source code for error
+// reporting)
+//
+// The JIT takes a name's index as its local's, see local_address().
+#define TOKEN_KINDS \
+  X(INVALID)        \
+  X(EQ)             \
+  X(IDENT)          \
+  X(CONST)          \
+  X(PLUS)           \
+  X(TIMES)          \
+  X(LPAREN)         \
+  X(RPAREN)         \
+  X(EQEQ)           \
+  X(NE)             \
+  X(LT)             \
+  X(LE)             \
+  X(GT)             \
+  X(GE)             \
+  X(LBRACE)         \
+  X(RBRACE)         \
+  X(SEMI)           \
+  X(COMMA)          \
+  X(IF)             \
+  X(ELSE)           \
+  X(WHILE)          \
+  X(FOR)            \
+  X(EOF)
+typedef enum TokenKind {
+#define X(x) TK_##x,
+  TOKEN_KINDS
+#undef X
+      TK_Count
+} TokenKind;
+const char* token_names[] = {
+#define X(x) #x,
+    TOKEN_KINDS
+#undef X
+};
+
+#include "intern.c"
+#include "lex.c"
+
+typedef uint32_t Ast;
+// 8 for kind
+// 24 for disp 1 (assumed negative)
+// disp 2 assumed to be immediately preceding the instruction due to
+// being in post-order.
+//
+// or
+//
+// 8 for kind
+// 24 for index into tokens
+//
+// or for IF, whose children are the condition, then block and else block
+// (which is immediately preceding, and empty if there's no else)
+//
+// 8 for kind
+// 12 for disp to the last node of the then block
+// 12 for disp to the last node of the condition
+//
+// EXPECT(v) wraps a condition to hint that it's usually v (0 or 1), like
+// __builtin_expect(). It doesn't change the value.
+//
+// or for WHILE, whose children are the condition and the body
+//
+// 8 for kind
+// 12 unused
+// 12 for disp to the last node of the condition
+//
+// or for FOR, whose children are the condition, the step (run after the
+// body each time around) and the body, and which is otherwise a WHILE
+// (the init is just the statement before it)
+//
+// 8 for kind
+// 12 for disp to the last node of the step
+// 12 for disp to the last node of the condition
+//
+// Where a condition starts follows from the stack effects of its nodes,
+// see ast_expression_start().
+//
+// or for CALL, whose children are its arguments
+//
+// 8 for kind
+// 8 for number of arguments
+// 16 for index into jit_natives
+//
+// A 12 bit disp that doesn't fit is 0xfff, with the disp in an AST_DISPL
+// just before the node instead (see ast_displ()), which otherwise does
+// nothing
+//
+// 8 for kind
+// 24 for disp
+
+#define AST_KINDS \
+  X(INVALID)      \
+  X(ASSIGN)       \
+  X(ADD)          \
+  X(MUL)          \
+  X(NAME)         \
+  X(CONST)        \
+  X(LT)           \
+  X(LE)           \
+  X(GT)           \
+  X(GE)           \
+  X(EQ)           \
+  X(NE)           \
+  X(EXPECT)       \
+  X(IF)           \
+  X(WHILE)        \
+  X(FOR)          \
+  X(CALL)         \
+  X(DISPL)
+
+typedef enum AstKind {
+#define X(x) AST_##x,
+  AST_KINDS
+#undef X
+      AST_Count
+} AstKind;
+
+const char* ast_names[] = {
+#define X(x) #x,
+    AST_KINDS
+#undef X
+};
+
+#define UNARYOP(k, val) ((((uint32_t)(val & 0xffffff)) << 8) | (((uint32_t)(AST_##k))))
+#define UNARYOP_LVAL(k, val) \
+  ((((uint32_t)(val & 0xffffff)) << 8) | (0x80) | (((uint32_t)(AST_##k))))
+#define BINOP(k, lhs_displ) ((((uint32_t)(lhs_displ & 0xfff)) << 20) | (((uint32_t)(AST_##k))))
+#define IFOP(cond_displ, then_displ)                                                    \
+  ((((uint32_t)(cond_displ & 0xfff)) << 20) | (((uint32_t)(then_displ & 0xfff)) << 8) | \
+   (((uint32_t)(AST_IF))))
+#define WHILEOP(cond_displ) ((((uint32_t)(cond_displ & 0xfff)) << 20) | (((uint32_t)(AST_WHILE))))
+#define FOROP(cond_displ, step_displ)                                                   \
+  ((((uint32_t)(cond_displ & 0xfff)) << 20) | (((uint32_t)(step_displ & 0xfff)) << 8) | \
+   (((uint32_t)(AST_FOR))))
+#define CALLOP(nargs, native)                                                  \
+  ((((uint32_t)(native & 0xffff)) << 16) | (((uint32_t)(nargs & 0xff)) << 8) | \
+   (((uint32_t)(AST_CALL))))
+
+// The disp in the 12 bits from bit |shift| (20 or 8) of nodes[k], or the
+// AST_DISPL for it if it's 0xfff: the one at k - 1 for bit 20, and for
+// bit 8 the one at k - 1 or beneath bit 20's.
+static int ast_displ(const Ast* nodes, int k, int shift) {
+  int displ = (nodes[k] >> shift) & 0xfff;
+  if (displ != 0xfff) {
+    return displ;
+  }
+  int at = k - 1;
+  if (shift == 8 && ((nodes[k] >> 20) & 0xfff) == 0xfff) {
+    --at;
+  }
+  return (int)(nodes[at] >> 8);
+}
+
+#include "parse.c"
+
+// The generated dispatch X-macros at the bottom are by AstKind.
+#include "snippets.c"
+
+// How many vstack entries each node pops, and the change in depth after
+// it, by [AstKind][is lval].
+static const uint8_t ast_stack_pops[AST_Count][2] = {
+#define X(kind, lval, family, pops, delta) [AST_##kind][lval] = pops,
+    SNIPPET_AST_FAMILIES(X)
+#undef X
+};
+
+static const int8_t ast_stack_delta[AST_Count][2] = {
+#define X(kind, lval, family, pops, delta) [AST_##kind][lval] = delta,
+    SNIPPET_AST_FAMILIES(X)
+#undef X
+};
+
+// The families of the snippets for each node, e.g. "load" for load_0 up,
+// for naming them (see jit_print_snippet_counts()), by [batch mode]
+// [AstKind][is lval].
+static const char* const ast_snippet_names[2][AST_Count][2] = {
+#define X(kind, lval, family, pops, delta) [0][AST_##kind][lval] = #family,
+    SNIPPET_AST_FAMILIES(X)
+#undef X
+#define X(kind, lval, family, pops, delta) [1][AST_##kind][lval] = #family,
+    SNIPPET_BATCH_FAMILIES(X)
+#undef X
+};
+
+// Every variant was generated, and writes no more than jit_wrap() allows
+// for, or the build fails here.
+#define X(kind, lval, depth, variant, size, pops, delta) \
+  _Static_assert(size > 0 && size <= SNIPPET_MAX_SIZE, #variant " wasn't generated");
+SNIPPET_AST_VARIANTS(X)
+SNIPPET_BATCH_VARIANTS(X)
+#undef X
+
+// The snippet for a node, by [batch mode][AstKind][is lval][vstack depth
+// before it], so that picking one and what it does to the vstack is a
+// single line of the cache.
+typedef struct AstSnippet {
+  SnippetEmitter emit;  // NULL if there's no variant for the depth.
+  uint16_t size;        // The most bytes it writes.
+  uint8_t pops;
+  int8_t delta;
+} AstSnippet;
+
+static const AstSnippet ast_snippets[2][AST_Count][2][SNIPPET_VSTACK_DEPTHS] = {
+#define X(kind, lval, depth, variant, size, pops, delta) \
+  [0][AST_##kind][lval][depth] = {variant##_emit, size, pops, delta},
+    SNIPPET_AST_VARIANTS(X)
+#undef X
+#define X(kind, lval, depth, variant, size, pops, delta) \
+  [1][AST_##kind][lval][depth] = {variant##_emit, size, pops, delta},
+    SNIPPET_BATCH_VARIANTS(X)
+#undef X
+};
+
+// The frame that $stack points at while the generated code runs: the
+// locals, then slots for the vstack entries that are spilled to make
+// room in registers. Every slot is 8 bytes so that it can hold any
+// SnippetType, an int local is the low half of its slot. The locals are
+// in cache lines of FRAME_LINE_SLOTS, see frame_layout().
+#define FRAME_LOCALS 128
+#define FRAME_LINE_SLOTS 8
+#define FRAME_MAX_SPILLS 1024
+
+static uintptr_t frame_spill_offset(int slot) {
+  return FRAME_LOCALS * sizeof(uint64_t) + slot * sizeof(uint64_t);
+}
+
+// A name's local is locals[i] for the index i in its Token, which is the
+// order it was interned in (see intern.c) unless frame_layout() moved it.
+static uintptr_t local_address(uint64_t* locals, Token name) {
+  return (uintptr_t)&locals[name >> 8];
+}
+
+// Host functions that CALLs call, by index: C functions in the platform's
+// ABI that take the CALL's arguments as ints and return an int. Any
+// function pointer can be cast to and from JitNative. They mustn't assign
+// locals, whose loads are hoisted and reused across CALLs.
+#define JIT_MAX_NATIVES 256
+typedef void (*JitNative)(void);
+static JitNative jit_natives[JIT_MAX_NATIVES];
+// What a source calls them by, see parse(), or NULL.
+static const char* jit_native_names[JIT_MAX_NATIVES];
+
+// How many vstack entries |node| pops, and the change in depth after it:
+// ast_stack_pops and ast_stack_delta, except for a CALL, which pops its
+// arguments and pushes the result.
+static int ast_pops(Ast node) {
+  if ((node & 0x7f) == AST_CALL) {
+    return (node >> 8) & 0xff;
+  }
+  return ast_stack_pops[node & 0x7f][(node >> 7) & 1];
+}
+
+static int ast_delta(Ast node) {
+  if ((node & 0x7f) == AST_CALL) {
+    return 1 - ast_pops(node);
+  }
+  return ast_stack_delta[node & 0x7f][(node >> 7) & 1];
+}
+
+// The $X operand of NAME, CONST and CALL nodes, 0 for anything else. In
+// batch mode (non-NULL |columns|) names are columns, indexed the same way
+// as locals.
+static uintptr_t node_operand(Ast node,
+                              const Token* tokens,
+                              uint64_t* locals,
+                              int* const* columns) {
+  AstKind kind = node & 0x7f;
+  if (kind == AST_NAME && columns) {
+    return (uintptr_t)columns[tokens[node >> 8] >> 8];
+  } else if (kind == AST_NAME) {
+    return local_address(locals, tokens[node >> 8]);
+  } else if (kind == AST_CONST) {
+    return (uintptr_t)(tokens[node >> 8] >> 8);
+  } else if (kind == AST_CALL && (node >> 16) < JIT_MAX_NATIVES) {
+    return (uintptr_t)jit_natives[node >> 16];
+  }
+  return 0;
+}
+
+// Set to false to stitch one snippet per node (for comparison).
+static bool jit_fuse_patterns = true;
+
+// Set to false to load names every time around loops (for comparison),
+// rather than hoisting them, see jit_emit_loop().
+static bool jit_hoist_loads = true;
+
+// Set to false to load names every time (for comparison), rather than
+// copying a load that's still in a register, see jit_emit_node().
+static bool jit_reuse_loads = true;
+
+// Set to false to stitch every node as it is (for comparison), rather
+// than folding constants, copying repeated subtrees that are still in a
+// register and shifting for multiplies by powers of two, see jit_fold().
+static bool jit_fold_nodes = true;
+
+// How many vstack entries are kept in registers beneath the operands of
+// a node before the oldest are spilled to the frame, 1 up to
+// SNIPPET_MAX_SAVED_REGS (see bench_deep_expression()).
+static int jit_vstack_regs = SNIPPET_MAX_SAVED_REGS;
+
+// The SIMD snippets that jit_compile_batch() uses, or -1 for none. main()
+// picks the widest that the CPU supports.
+static int jit_simd = -1;
+
+// Where jit_emit_node() counts each snippet it stitches, when it's set by
+// jit_count_snippets(): every one is preceded by an `inc qword [rip +
+// rel32]` of its counter, indexed as the emitters are. That only changes
+// the flags, which nothing keeps between snippets. It's a REL32 like the
+// locals are, so the counts are allocated as they are, and a function
+// they're out of reach of isn't compiled (see jit_source_reaches()).
+// Threads running the same function can lose counts.
+//
+// Only what's stitched for the nodes themselves is counted, not the
+// spills, reloads and jumps between them, batch mode's loop_tail, or
+// anything jit_compile_typed() or a SIMD loop stitches, so the counts
+// are of which node snippets are worth more variants, not of everything
+// that runs.
+typedef struct JitSnippetCounts {
+  uint64_t nodes[2][AST_Count][2][SNIPPET_VSTACK_DEPTHS];  // [batch][kind][lval][depth]
+  uint64_t calls[SNIPPET_MAX_NATIVE_ARGS + 1][SNIPPET_VSTACK_DEPTHS];
+  uint64_t picks[SNIPPET_MAX_SAVED_REGS][SNIPPET_VSTACK_DEPTHS];
+  uint64_t shifts[SNIPPET_VSTACK_DEPTHS];
+  uint64_t patterns[countof(snippet_patterns)][SNIPPET_VSTACK_DEPTHS];
+} JitSnippetCounts;
+
+static JitSnippetCounts* jit_snippet_counts;
+
+// Opened by main() if CNP_PERF_MAP is set, so that perf can name the
+// functions in the arenas, see jit_perf_map_add().
+static FILE* jit_perf_map;
+static uint32_t jit_perf_map_functions;
+
+static int jit_best_simd(void) {
+  bool avx2, avx512f;
+  os_simd_support(&avx2, &avx512f);
+  return avx512f ? SNIPPET_SIMD_AVX512 : avx2 ? SNIPPET_SIMD_AVX2 : -1;
+}
+
+// The longest of the fused snippets that matches the nodes starting at
+// |nodes|, or NULL.
+static const SnippetPattern* match_pattern(const Ast* nodes, int n) {
+  const uint8_t* range = snippet_pattern_range[nodes[0] & 0x7f][(nodes[0] >> 7) & 1];
+  for (int i = range[0]; i < range[1]; ++i) {
+    const SnippetPattern* pat = &snippet_patterns[i];
+    if (pat->len > n) {
+      continue;
+    }
+    int j = 0;
+    while (j < pat->len && (uint8_t)nodes[j] == pat->nodes[j]) {
+      ++j;
+    }
+    if (j == pat->len) {
+      return pat;
+    }
+  }
+  return NULL;
+}
+
+#define JIT_MAX_NODES 4096
+#define JIT_MAX_BRANCHES 1024
+
+// Where the expression that ends at |end| starts: the run of nodes back
+// from |end| that pushes one more value than it pops (no shorter one
+// does). -1 if there isn't one.
+static int ast_expression_start(const Ast* nodes, int end) {
+  int values = 0;
+  for (int i = end; i >= 0; --i) {
+    values += ast_delta(nodes[i]);
+    if (values == 1) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// The last node of the condition of the IF, WHILE or FOR at |k|.
+static int ast_condition_end(const Ast* nodes, int k) {
+  return k - ast_displ(nodes, k, 20);
+}
+
+// The node whose value decides the branch for the condition that ends at
+// |cond_end|, i.e. the last that isn't an EXPECT. A comparison there is
+// fused with the branch, anything else is tested against 0.
+static int ast_branch_point(const Ast* nodes, int cond_end) {
+  while ((nodes[cond_end] & 0x7f) == AST_EXPECT) {
+    --cond_end;
+  }
+  return cond_end;
+}
+
+// A name's slot in frame_layout() when it doesn't have one.
+#define FRAME_NO_SLOT 0xff
+
+// How much each name that isn't in a slot yet is used in the statements
+// (the nodes up to and including each ASSIGN, IF or loop) that use the
+// names in slots [line, end).
+static void frame_together(const Ast* nodes,
+                           int n,
+                           const Token* tokens,
+                           const uint32_t* weight,
+                           const uint8_t* slots,
+                           int line,
+                           int end,
+                           uint32_t* together) {
+  int begin = 0;
+  bool in_line = false;
+  for (int i = 0; i < n; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    if (kind == AST_NAME) {
+      int slot = slots[tokens[nodes[i] >> 8] >> 8];
+      in_line |= slot >= line && slot < end;
+    }
+    if (i < n - 1 && kind != AST_ASSIGN && kind != AST_IF && kind != AST_WHILE &&
+        kind != AST_FOR) {
+      continue;
+    }
+    for (int j = begin; in_line && j <= i; ++j) {
+      if ((nodes[j] & 0x7f) == AST_NAME && slots[tokens[nodes[j] >> 8] >> 8] == FRAME_NO_SLOT) {
+        together[tokens[nodes[j] >> 8] >> 8] += weight[j];
+      }
+    }
+    begin = i + 1;
+    in_line = false;
+  }
+}
+
+// Where each name's local goes for jit_compile_text(), in cache lines of
+// FRAME_LINE_SLOTS (|locals| being line aligned, as os_alloc() makes it).
+// The hottest name, weighed by how deeply in loops it's used as for the
+// hoisting in jit_emit_loop(), starts each line, and the rest of it is
+// filled with the names that are used most in the same statements as
+// those already in it. Names that are shared with other threads (see
+// InternName) come after, each on a line of its own so that writing one
+// doesn't false share with any other local.
+//
+// Sets slots[i] for each name i in |names| that's used, and FRAME_NO_SLOT
+// for the others, and renumbers the first |num_tokens| tokens to match.
+// Returns the number of locals, or -1 if that's more than FRAME_LOCALS.
+static int frame_layout(const Ast* nodes,
+                        int n,
+                        Token* tokens,
+                        int num_tokens,
+                        const Intern* names,
+                        uint8_t* slots) {
+  if (n > JIT_MAX_NODES) {
+    return -1;
+  }
+  // The weight of each use, and each name's heat, the sum of those.
+  uint32_t weight[JIT_MAX_NODES];
+  uint32_t heat[INTERN_MAX_NAMES];
+  bool loop_at[JIT_MAX_NODES];
+  memset(heat, 0, names->count * sizeof(heat[0]));
+  memset(loop_at, 0, n);
+  for (int i = 0; i < n; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    if (kind == AST_WHILE || kind == AST_FOR) {
+      int begin = ast_expression_start(nodes, ast_condition_end(nodes, i));
+      if (begin < 0) {
+        return -1;
+      }
+      loop_at[begin] = true;
+    }
+  }
+  int loops = 0;
+  for (int i = 0; i < n; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    loops += loop_at[i];
+    weight[i] = 1u << (3 * (loops < 6 ? loops : 6));
+    if (kind == AST_NAME) {
+      Token name = tokens[nodes[i] >> 8] >> 8;
+      if (name >= (Token)names->count) {
+        return -1;
+      }
+      heat[name] += weight[i];
+    }
+    loops -= kind == AST_WHILE || kind == AST_FOR;
+  }
+
+  memset(slots, FRAME_NO_SLOT, names->count);
+  int size = 0;
+  for (;;) {
+    uint32_t together[INTERN_MAX_NAMES];
+    memset(together, 0, names->count * sizeof(together[0]));
+    int line = size / FRAME_LINE_SLOTS * FRAME_LINE_SLOTS;
+    if (size > line) {
+      frame_together(nodes, n, tokens, weight, slots, line, size, together);
+    }
+    int best = -1;
+    for (int i = 0; i < names->count; ++i) {
+      if (heat[i] && !names->names[i].shared && slots[i] == FRAME_NO_SLOT &&
+          (best < 0 || together[i] > together[best] ||
+           (together[i] == together[best] && heat[i] > heat[best]))) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    } else if (size == FRAME_LOCALS) {
+      return -1;
+    }
+    slots[best] = (uint8_t)size++;
+  }
+  size = (size + FRAME_LINE_SLOTS - 1) / FRAME_LINE_SLOTS * FRAME_LINE_SLOTS;
+  for (int i = 0; i < names->count; ++i) {
+    if (heat[i] && names->names[i].shared) {
+      if (size >= FRAME_LOCALS) {
+        return -1;
+      }
+      slots[i] = (uint8_t)size;
+      size += FRAME_LINE_SLOTS;
+    }
+  }
+
+  for (int i = 0; i < num_tokens; ++i) {
+    if ((tokens[i] & 0xff) == TK_IDENT && slots[tokens[i] >> 8] != FRAME_NO_SLOT) {
+      tokens[i] = (Token)slots[tokens[i] >> 8] << 8 | TK_IDENT;
+    }
+  }
+  return size;
+}
+
+// jit_compile_any_function() finds out how big a function is by compiling
+// it into this window first. The compile wraps round to the start of it
+// whenever it's past half way (see jit_wrap()), adding what it skipped
+// back over to jit_wrapped, so there's no limit on the size but a block's.
+// It goes back by a multiple of JIT_WINDOW_ALIGN, which the arena's blocks
+// are aligned to, so that snippets' data, which is aligned after their
+// code, takes the same padding both times. Each thread has its own, so
+// that threads can compile at the same time.
+#define JIT_WINDOW_SIZE (64 << 10)
+#define JIT_WINDOW_ALIGN (1 << CODE_ARENA_MIN_CLASS)
+#if SNIPPET_MAX_DATA_ALIGN > JIT_WINDOW_ALIGN
+#error "snippet data is aligned more than code arena blocks are"
+#endif
+static _Thread_local unsigned char jit_window[JIT_WINDOW_SIZE]
+    __attribute__((aligned(JIT_WINDOW_ALIGN)));
+static _Thread_local size_t jit_wrapped;
+// The furthest that's been written since jit_wrapped was last reset, as
+// it'll be in the arena (jit_window plus jit_wrapped), where that's past
+// where the code ends up: jit_place_label() takes back jumps it's already
+// written. jit_compile_any_function() leaves room for it in the block.
+static _Thread_local uintptr_t jit_written;
+
+// |code|, or if it's in the second half of jit_window, wrapped round to
+// the first. Each node, jump, or the like writes far less than half the
+// window, so it's enough to call this before each. Code anywhere else,
+// i.e. in the arena, is left as it is.
+static unsigned char* jit_wrap(unsigned char* code) {
+  uintptr_t offset = (uintptr_t)code - (uintptr_t)jit_window;
+  if (offset < JIT_WINDOW_SIZE / 2 || offset >= JIT_WINDOW_SIZE) {
+    return code;
+  }
+  offset &= ~(uintptr_t)(JIT_WINDOW_ALIGN - 1);
+  jit_wrapped += offset;
+  return code - offset;
+}
+
+// Count the snippet that's about to be written at |code| in |*counter|,
+// see JitSnippetCounts.
+static unsigned char* jit_count(unsigned char* code, uint64_t* counter) {
+  int32_t rel = (int32_t)((intptr_t)counter - (intptr_t)(code + 7));
+  code[0] = 0x48;  // inc qword [rip + rel]
+  code[1] = 0xff;
+  code[2] = 0x05;
+  memcpy(code + 3, &rel, sizeof(rel));
+  return code + 7;
+}
+
+// Start counting snippets in what's compiled from now on, see
+// JitSnippetCounts. Returns false if the counts couldn't be allocated.
+static bool jit_count_snippets(void) {
+  if (!jit_snippet_counts) {
+    jit_snippet_counts = os_alloc(sizeof(JitSnippetCounts));
+  }
+  return jit_snippet_counts != NULL;
+}
+
+// The name of the snippet variant that counts[index] is for, flattening
+// JitSnippetCounts, e.g. "load_2" or "load_load_add_0".
+static void jit_snippet_name(size_t index, char* name, size_t size) {
+  const size_t depths = SNIPPET_VSTACK_DEPTHS;
+  size_t calls = offsetof(JitSnippetCounts, calls) / sizeof(uint64_t);
+  size_t picks = offsetof(JitSnippetCounts, picks) / sizeof(uint64_t);
+  size_t shifts = offsetof(JitSnippetCounts, shifts) / sizeof(uint64_t);
+  size_t patterns = offsetof(JitSnippetCounts, patterns) / sizeof(uint64_t);
+  int depth = (int)(index % depths);
+  if (index < calls) {
+    int lval = (int)(index / depths % 2);
+    int kind = (int)(index / depths / 2 % AST_Count);
+    const char* family = ast_snippet_names[index / depths / 2 / AST_Count][kind][lval];
+    snprintf(name, size, "%s_%d", family, depth - ast_stack_pops[kind][lval]);
+  } else if (index < picks) {
+    int nargs = (int)((index - calls) / depths);
+    snprintf(name, size, "call_native_%d_%d", nargs, depth - nargs);
+  } else if (index < shifts) {
+    snprintf(name, size, "pick%d_%d", (int)((index - picks) / depths), depth);
+  } else if (index < patterns) {
+    snprintf(name, size, "shl_%d", depth - 1);
+  } else {
+    const SnippetPattern* pat = &snippet_patterns[(index - patterns) / depths];
+    snprintf(name, size, "%s_%d", pat->name, depth - pat->pops);
+  }
+}
+
+// Print the |top| snippet variants that have run the most times since
+// jit_count_snippets(), and how many times.
+static void jit_print_snippet_counts(int top) {
+  const uint64_t* counts = (const uint64_t*)jit_snippet_counts;
+  size_t n = sizeof(JitSnippetCounts) / sizeof(uint64_t);
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += counts[i];
+  }
+  // The next most after |below| at |below_at|, ties in index order.
+  uint64_t below = UINT64_MAX;
+  size_t below_at = 0;
+  for (int t = 0; t < top && total; ++t) {
+    size_t most = n;
+    for (size_t i = 0; i < n; ++i) {
+      bool after = counts[i] < below || (counts[i] == below && i > below_at);
+      if (after && counts[i] && (most == n || counts[i] > counts[most])) {
+        most = i;
+      }
+    }
+    if (most == n) {
+      break;
+    }
+    char name[64];
+    jit_snippet_name(most, name, sizeof(name));
+    printf("  %-32s %12llu  %5.1f%%\n", name, (unsigned long long)counts[most],
+           100.0 * (double)counts[most] / (double)total);
+    below = counts[most];
+    below_at = most;
+  }
+}
+
+// A block that jit_compile_nodes() places out of line, after everything
+// else: nodes [begin, end) at |label|, jumping back to |join| after, and
+// what the loops around it had pinned (see JitState).
+typedef struct JitColdBlock {
+  int begin;
+  int end;
+  int label;
+  int join;
+  int num_pinned;
+  uint8_t pinned[SNIPPET_MAX_SAVED_REGS];
+} JitColdBlock;
+
+typedef struct JitFixup {
+  SnippetFixup fixup;
+  int label;
+} JitFixup;
+
+// What jit_compile_nodes() is compiling, and how far it's got.
+typedef struct JitState {
+  const Ast* nodes;
+  const Token* tokens;
+  uint64_t* locals;
+  int* const* columns;
+  const uint32_t (*branch_counts)[2];
+  unsigned char* code;
+  int depth;    // vstack entries in registers
+  int spilled;  // and beneath those, in the frame
+  // The bottom |num_pinned| vstack entries are loads that the loops
+  // being compiled have hoisted out, see jit_emit_loop(). Between
+  // statements they're all that's on the vstack.
+  int num_pinned;
+  // For each vstack entry in registers, bottom up, the local that it's a
+  // load of + 1, or 0 for any other value, and the s->value of the node
+  // it's the value of, or 0.
+  uint8_t names[SNIPPET_VSTACK_DEPTHS];
+  uint16_t values[SNIPPET_VSTACK_DEPTHS];
+  // For each node, whether its value is never used, see jit_liveness().
+  bool unused[JIT_MAX_NODES];
+  // For each node, the IF whose condition branches there (see
+  // ast_branch_point()), or -1.
+  int16_t branch_at[JIT_MAX_NODES];
+  // For each node, the WHILE or FOR whose condition starts there, or -1,
+  // and how many loops it's in.
+  int16_t loop_at[JIT_MAX_NODES];
+  uint8_t loop_depth[JIT_MAX_NODES];
+  // From jit_fold(), for each node: a number for its value that's the
+  // same for nodes that compute the same thing, or 0; for a MUL by 2^n,
+  // n, or -1; and for a constant one, its value. For each node that
+  // subtrees start at, the last node of the biggest that's constant, or
+  // -1, and whether it's the 2^n, which is left out; and the last of the
+  // biggest that's a repeat of one before it, or -1.
+  uint16_t value[JIT_MAX_NODES];
+  int8_t shift[JIT_MAX_NODES];
+  int32_t fold_value[JIT_MAX_NODES];
+  int16_t fold_end[JIT_MAX_NODES];
+  bool fold_elided[JIT_MAX_NODES];
+  int16_t repeat_end[JIT_MAX_NODES];
+  // Addresses of the targets of branches, or NULL until they're placed,
+  // which are patched in from |fixups| once the code is all written, and
+  // jit_wrapped as it was when each was placed, see jit_write_jump().
+  unsigned char* labels[2 * JIT_MAX_BRANCHES + 1];
+  size_t label_wrapped[2 * JIT_MAX_BRANCHES + 1];
+  int num_labels;
+  JitFixup fixups[2 * JIT_MAX_BRANCHES + 1];
+  int num_fixups;
+  // The unconditional jumps, short or not, and where each starts, which
+  // like labels' is as it'll be in the arena, see jit_thread_label().
+  struct {
+    uintptr_t at;
+    int label;
+  } jmps[2 * JIT_MAX_BRANCHES + 1];
+  int num_jmps;
+  JitColdBlock cold[JIT_MAX_BRANCHES];
+  int num_cold;
+} JitState;
+
+static int jit_new_label(JitState* s) {
+  s->labels[s->num_labels] = NULL;
+  return s->num_labels++;
+}
+
+// Place |label| where |s| has got to. A jmp or jcc to it that's the last
+// thing written would go to the next instruction, e.g. out of an empty
+// block, so it's taken back out, along with any other labels that were
+// placed after it, and the same for the one before that. Where it had got
+// to is noted in jit_written.
+static void jit_place_label(JitState* s, int label) {
+  if ((uintptr_t)s->code + jit_wrapped > jit_written) {
+    jit_written = (uintptr_t)s->code + jit_wrapped;
+  }
+  while (s->num_fixups > 0) {
+    const JitFixup* last = &s->fixups[s->num_fixups - 1];
+    unsigned char* end = (unsigned char*)last->fixup.at + 4;
+    unsigned char* op = NULL;
+    if (last->label != label || end != s->code) {
+      break;
+    } else if (end[-5] == 0xe9) {
+      op = end - 5;
+    } else if (end[-6] == 0x0f && (end[-5] & 0xf0) == 0x80) {
+      op = end - 6;
+    } else {
+      break;
+    }
+    if (s->num_jmps > 0 && s->jmps[s->num_jmps - 1].at == (uintptr_t)op + jit_wrapped) {
+      --s->num_jmps;
+    }
+    for (int i = 0; i < s->num_labels; ++i) {
+      if (s->labels[i] == end && s->label_wrapped[i] == jit_wrapped) {
+        s->labels[i] = op;
+      }
+    }
+    s->code = op;
+    --s->num_fixups;
+  }
+  s->labels[label] = s->code;
+  s->label_wrapped[label] = jit_wrapped;
+}
+
+// Where a jump to |label| can go instead: if it's placed at a jmp, e.g.
+// the one at the end of a cold block, or the one over them all, then
+// where that goes, and so on, for a few. That's by where they are in the
+// arena, i.e. in jit_window plus what jit_wrap() had skipped by then, so
+// that it's the same both times.
+static int jit_thread_label(const JitState* s, int label) {
+  for (int hops = 0; hops < 8 && s->labels[label]; ++hops) {
+    uintptr_t at = (uintptr_t)s->labels[label] + s->label_wrapped[label];
+    int i = 0;
+    while (i < s->num_jmps && s->jmps[i].at != at) {
+      ++i;
+    }
+    if (i == s->num_jmps) {
+      break;
+    }
+    label = s->jmps[i].label;
+  }
+  return label;
+}
+
+// Write the jmp or jcc rel32 that's been emitted to |jump|, up to |end|,
+// to s->code, moving |fixup| (its hole) with it. If it goes back to
+// |label|, which is placed already, and that's near enough, it's written
+// as a jmp or jcc rel8 instead, and there's nothing to fix up. How near
+// is how near it'll be in the arena, which in jit_window is further by
+// however much jit_wrap() has skipped since, so that it's the same size
+// both times. Only what stays is written, so nothing past where the code
+// ends is, see jit_compile_any_function().
+static bool jit_write_jump(JitState* s,
+                           const unsigned char* jump,
+                           const unsigned char* end,
+                           SnippetFixup* fixup,
+                           int label) {
+  const unsigned char* op = NULL;
+  if (s->labels[label] && (const unsigned char*)fixup->at + 4 == end) {
+    if (end[-5] == 0xe9) {
+      op = end - 5;
+    } else if (end[-6] == 0x0f && (end[-5] & 0xf0) == 0x80) {
+      op = end - 6;
+    }
+  }
+  if (op) {
+    unsigned char* at = s->code + (op - jump);
+    intptr_t rel = (intptr_t)(s->labels[label] - (at + 2)) -
+                   (intptr_t)(jit_wrapped - s->label_wrapped[label]);
+    if (rel >= INT8_MIN) {
+      memcpy(s->code, jump, (size_t)(op - jump));
+      at[0] = op[0] == 0xe9 ? 0xeb : (unsigned char)(0x70 | (op[1] & 0x0f));
+      at[1] = (unsigned char)(int8_t)rel;
+      s->code = at + 2;
+      return true;
+    }
+  }
+  memcpy(s->code, jump, (size_t)(end - jump));
+  fixup->at = (int32_t*)(s->code + ((const unsigned char*)fixup->at - jump));
+  s->code += end - jump;
+  return false;
+}
+
+static void jit_jump(JitState* s, BranchEmitter emit, int label) {
+  JitFixup* fixup = &s->fixups[s->num_fixups];
+  s->code = jit_wrap(s->code);
+  uintptr_t at = (uintptr_t)s->code + jit_wrapped;
+  // Emitted aside first, for jit_write_jump() to write what's kept of it.
+  unsigned char jump[SNIPPET_MAX_SIZE];
+  unsigned char* end = emit(jump, &fixup->fixup);
+  if (((unsigned char*)fixup->fixup.at)[-1] == 0xe9) {
+    s->jmps[s->num_jmps].at = at;
+    s->jmps[s->num_jmps++].label = label;
+  }
+  label = jit_thread_label(s, label);
+  if (!jit_write_jump(s, jump, end, &fixup->fixup, label)) {
+    fixup->label = label;
+    ++s->num_fixups;
+  }
+}
+
+// Get the |pops| entries a node takes into registers, with no more than
+// jit_vstack_regs beneath.
+static bool jit_make_room(JitState* s, int pops) {
+  while (s->depth < pops && s->spilled > 0) {
+    s->code = snippet_reload[s->depth](s->code, frame_spill_offset(--s->spilled));
+    memmove(&s->names[1], &s->names[0], s->depth);
+    memmove(&s->values[1], &s->values[0], s->depth++ * sizeof(s->values[0]));
+    s->names[0] = 0;
+    s->values[0] = 0;
+  }
+  while (s->depth - pops >= jit_vstack_regs) {
+    // The oldest entries are the pinned ones, which have to stay put, but
+    // jit_emit_loop() only pins as many as leave room.
+    if (s->spilled == FRAME_MAX_SPILLS || s->num_pinned > 0) {
+      return false;
+    }
+    s->code = snippet_spill[s->depth](s->code, frame_spill_offset(s->spilled++));
+    memmove(&s->names[0], &s->names[1], --s->depth);
+    memmove(&s->values[0], &s->values[1], s->depth * sizeof(s->values[0]));
+  }
+  assert(s->depth >= pops);
+  return true;
+}
+
+// Pop |pops| vstack entries, and push |pushes| (0 or 1) that's a load of
+// local |name| - 1, or 0 for any other value, and is numbered |value|
+// (see jit_fold()).
+static void jit_push(JitState* s, int pops, int pushes, uint8_t name, uint16_t value) {
+  s->depth += pushes - pops;
+  if (pushes) {
+    s->names[s->depth - 1] = name;
+    s->values[s->depth - 1] = value;
+  }
+}
+
+// Push a copy of vstack entry |entry|, if there's a snippet_pick for it.
+static bool jit_pick(JitState* s, int entry) {
+  if (!snippet_pick[entry][s->depth]) {
+    return false;
+  }
+  if (jit_snippet_counts) {
+    s->code = jit_count(s->code, &jit_snippet_counts->picks[entry][s->depth]);
+  }
+  s->code = snippet_pick[entry][s->depth](s->code, 0);
+  jit_push(s, 0, 1, s->names[entry], s->values[entry]);
+  return true;
+}
+
+// Which vstack entry in registers is numbered |value| (see jit_fold()),
+// or -1.
+static int jit_valued(const JitState* s, uint16_t value) {
+  for (int i = 0; value && i < s->depth; ++i) {
+    if (s->values[i] == value) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Which of the bottom |entries| vstack entries is a load of the same name
+// as |node|, or -1. The pinned ones are the bottom s->num_pinned.
+static int jit_loaded(const JitState* s, Ast node, int entries) {
+  if ((node & 0xff) != AST_NAME) {  // An lval is the address.
+    return -1;
+  }
+  uint8_t name = (uint8_t)((s->tokens[node >> 8] >> 8) + 1);
+  for (int i = 0; i < entries; ++i) {
+    if (s->names[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Whether jit_emit_node() does something other than stitch the node at
+// |i| as it is, see jit_fold(), so that fused snippets stop before it.
+static bool jit_folds(const JitState* s, int i) {
+  return s->fold_end[i] >= 0 || s->shift[i] >= 0 ||
+         (s->repeat_end[i] >= 0 && jit_valued(s, s->value[s->repeat_end[i]]) >= 0);
+}
+
+// The constant subtree from |i| to |last| (before |end|), see jit_fold():
+// nothing if it's what a MUL shifts by, and otherwise its value, which
+// is an operand of a fused snippet with the node after if there's one,
+// as a CONST would be. Returns the index of the next node, or -1.
+static int jit_emit_folded(JitState* s, int i, int last, int end) {
+  if (s->fold_elided[i]) {
+    return last + 1;
+  }
+  int next = last + 1;
+  uintptr_t x = (uintptr_t)(uint32_t)s->fold_value[last];
+  const SnippetPattern* pat = NULL;
+  if (jit_fuse_patterns && next < end && s->branch_at[next] < 0 && s->loop_at[next] < 0 &&
+      !s->unused[next] && !jit_folds(s, next)) {
+    Ast run[2] = {AST_CONST, s->nodes[next]};
+    pat = match_pattern(run, 2);
+    if (pat && s->columns && !pat->batch) {
+      pat = NULL;
+    }
+  }
+  JitSnippetCounts* counts = jit_snippet_counts;
+  if (pat) {
+    if (!jit_make_room(s, pat->pops) || !pat->emit[s->depth]) {
+      return -1;
+    }
+    if (counts) {
+      s->code = jit_count(s->code, &counts->patterns[pat - snippet_patterns][s->depth]);
+    }
+    s->code = pat->emit[s->depth](s->code, &x);
+    jit_push(s, pat->pops, pat->pops + pat->stack_delta, 0, s->value[next]);
+    return next + 1;
+  }
+  int batch = s->columns != NULL;
+  if (!jit_make_room(s, 0) || !ast_snippets[batch][AST_CONST][0][s->depth].emit) {
+    return -1;
+  }
+  if (counts) {
+    s->code = jit_count(s->code, &counts->nodes[batch][AST_CONST][0][s->depth]);
+  }
+  s->code = ast_snippets[batch][AST_CONST][0][s->depth].emit(s->code, x);
+  jit_push(s, 0, 1, 0, s->value[last]);
+  return next;
+}
+
+// Emit the node at |i|, or the run of nodes from there (up to |end|) that
+// has a fused snippet. Returns the index of the next node, or -1.
+//
+// A load of a name that's pinned is a snippet_pick from its register,
+// and so is one of a name that an entry still on the vstack is a load of
+// (it can't have been assigned since, that ends the statement), unless
+// the load is fused. A fused snippet does it as an operand, which is as
+// cheap as the pick alone. The same goes for a subtree that jit_fold()
+// found is a repeat of one still on the vstack, and then a constant one
+// is stitched as its value.
+static int jit_emit_node(JitState* s, int i, int end) {
+  const Ast* nodes = s->nodes;
+  AstKind kind = nodes[i] & 0x7f;
+  int lval = (nodes[i] >> 7) & 1;
+  if (kind == AST_EXPECT || kind == AST_DISPL || (s->unused[i] && kind != AST_CALL)) {
+    return i + 1;
+  }
+  s->code = jit_wrap(s->code);
+
+  int last = s->repeat_end[i];
+  if (last >= 0 && last < end) {
+    if (!jit_make_room(s, 0)) {
+      return -1;
+    }
+    int entry = jit_valued(s, s->value[last]);
+    if (entry >= 0 && jit_pick(s, entry)) {
+      return last + 1;
+    }
+  }
+  last = s->fold_end[i];
+  if (last >= 0 && last < end) {
+    return jit_emit_folded(s, i, last, end);
+  }
+  JitSnippetCounts* counts = jit_snippet_counts;
+  if (s->shift[i] == 0) {
+    return i + 1;
+  } else if (s->shift[i] > 0) {
+    if (!jit_make_room(s, 1) || !snippet_shl[s->depth]) {
+      return -1;
+    }
+    if (counts) {
+      s->code = jit_count(s->code, &counts->shifts[s->depth]);
+    }
+    s->code = snippet_shl[s->depth](s->code, (uintptr_t)s->shift[i]);
+    jit_push(s, 1, 1, 0, s->value[i]);
+    return i + 1;
+  }
+
+  // Fused snippets can't span where an IF branches or a loop starts, or
+  // load what's pinned, or have nodes that are skipped or folded.
+  const SnippetPattern* pat = NULL;
+  if (jit_loaded(s, nodes[i], s->num_pinned) < 0) {
+    int limit = 1;
+    while (i + limit < end && limit < SNIPPET_PATTERN_MAX_LEN && s->branch_at[i + limit] < 0 &&
+           s->loop_at[i + limit] < 0 && jit_loaded(s, nodes[i + limit], s->num_pinned) < 0 &&
+           !s->unused[i + limit] && !jit_folds(s, i + limit)) {
+      ++limit;
+    }
+    pat = jit_fuse_patterns ? match_pattern(&nodes[i], limit) : NULL;
+    if (pat && s->columns && !pat->batch) {
+      pat = NULL;
+    }
+  }
+  if (!jit_make_room(s, pat ? pat->pops : ast_pops(nodes[i]))) {
+    return -1;
+  }
+
+  int entry = jit_loaded(s, nodes[i], s->num_pinned);
+  if (entry < 0 && !pat && jit_reuse_loads) {
+    entry = jit_loaded(s, nodes[i], s->depth);
+  }
+  if (entry >= 0 && jit_pick(s, entry)) {
+    return i + 1;
+  }
+
+  if (pat) {
+    uintptr_t x[SNIPPET_PATTERN_MAX_LEN];
+    int num_x = 0;
+    for (int j = 0; j < pat->len; ++j) {
+      AstKind k = nodes[i + j] & 0x7f;
+      if (k == AST_NAME || k == AST_CONST) {
+        x[num_x++] = node_operand(nodes[i + j], s->tokens, s->locals, s->columns);
+      }
+    }
+    if (!pat->emit[s->depth]) {
+      return -1;
+    }
+    if (counts) {
+      s->code = jit_count(s->code, &counts->patterns[pat - snippet_patterns][s->depth]);
+    }
+    s->code = pat->emit[s->depth](s->code, x);
+    jit_push(s, pat->pops, pat->pops + pat->stack_delta, 0, s->value[i + pat->len - 1]);
+    return i + pat->len;
+  }
+
+  const AstSnippet* snippet = &ast_snippets[s->columns != NULL][kind][lval][s->depth];
+  SnippetEmitter emit = snippet->emit;
+  uint64_t* counter = counts ? &counts->nodes[s->columns != NULL][kind][lval][s->depth] : NULL;
+  uintptr_t x = node_operand(nodes[i], s->tokens, s->locals, s->columns);
+  if (kind == AST_CALL) {
+    int nargs = ast_pops(nodes[i]);
+    emit = x && nargs <= SNIPPET_MAX_NATIVE_ARGS ? snippet_call_native[nargs][s->depth] : NULL;
+    counter = counts && emit ? &counts->calls[nargs][s->depth] : NULL;
+  }
+  if (!emit) {
+    return -1;
+  }
+  if (counter) {
+    s->code = jit_count(s->code, counter);
+  }
+  unsigned char* start = s->code;
+  s->code = emit(s->code, x);
+  assert(kind == AST_CALL || s->code - start <= snippet->size);
+  int pops = kind == AST_CALL ? ast_pops(nodes[i]) : snippet->pops;
+  int delta = kind == AST_CALL ? ast_delta(nodes[i]) : snippet->delta;
+  jit_push(s, pops, pops + delta,
+           kind == AST_NAME && !lval ? (uint8_t)((s->tokens[nodes[i] >> 8] >> 8) + 1) : 0,
+           s->value[i]);
+  // Dropping an unused result is free, the snippets after just take one
+  // register fewer.
+  if (s->unused[i]) {
+    --s->depth;
+  }
+  return i + 1;
+}
+
+static bool jit_emit_nodes(JitState* s, int begin, int end);
+
+// The end of the condition that ends at |cond_end|, from its branch point
+// |at|: a jump to |label| if the condition is |when|, falling through if
+// not.
+static bool jit_branch(JitState* s, int at, int cond_end, bool when, int label) {
+  AstKind compare = s->nodes[at] & 0x7f;
+  bool is_compare = ast_negated_compare[compare] != AST_INVALID;
+  if (!is_compare && jit_emit_node(s, at, cond_end + 1) < 0) {
+    return false;
+  }
+  int pops = is_compare ? 2 : 1;
+  if (!jit_make_room(s, pops)) {
+    return false;
+  }
+  BranchEmitter emit;
+  if (is_compare) {
+    emit = ast_branch_emitters[when ? compare : ast_negated_compare[compare]][s->depth];
+  } else {
+    emit = (when ? snippet_jump_if_nz : snippet_jump_if_z)[s->depth];
+  }
+  s->depth -= pops;
+  // IFs and loops are statements, so there's nothing else on the vstack
+  // that the code either side of the jump would have to agree on.
+  if (!emit || s->depth != s->num_pinned || s->spilled != 0) {
+    return false;
+  }
+  jit_jump(s, emit, label);
+  return true;
+}
+
+// The IF at |k|, whose condition has been emitted up to its branch point
+// |at|. Its likely block (from the profile, or an EXPECT, or else the then
+// block) falls through from the branch, and the other one is out of line
+// so that the likely path doesn't take any jumps. A comparison right at
+// the end of the condition is fused with the branch.
+static bool jit_emit_if(JitState* s, int at, int k) {
+  int cond_end = ast_condition_end(s->nodes, k);
+  int then_end = k - ast_displ(s->nodes, k, 8);
+  bool then_likely = true;
+  if ((s->nodes[cond_end] & 0x7f) == AST_EXPECT) {
+    then_likely = (s->nodes[cond_end] >> 8) != 0;
+  }
+  if (s->branch_counts && (s->branch_counts[k][0] || s->branch_counts[k][1])) {
+    then_likely = s->branch_counts[k][0] >= s->branch_counts[k][1];
+  }
+  int hot_begin = cond_end + 1, hot_end = then_end + 1;
+  int cold_begin = then_end + 1, cold_end = k;
+  if (!then_likely) {
+    hot_begin = then_end + 1, hot_end = k;
+    cold_begin = cond_end + 1, cold_end = then_end + 1;
+  }
+
+  int join = jit_new_label(s);
+  int cold = join;
+  if (cold_begin < cold_end) {
+    cold = jit_new_label(s);
+    JitColdBlock* block = &s->cold[s->num_cold++];
+    *block = (JitColdBlock){cold_begin, cold_end, cold, join, s->num_pinned, {0}};
+    memcpy(block->pinned, s->names, s->num_pinned);
+  }
+  // Jump to the cold block when the condition says it's the one to run.
+  if (!jit_branch(s, at, cond_end, !then_likely, cold) ||
+      !jit_emit_nodes(s, hot_begin, hot_end)) {
+    return false;
+  }
+  jit_place_label(s, join);
+  return true;
+}
+
+// The WHILE or FOR at |k|, whose condition starts at |begin|. The
+// condition goes at the bottom, after the body (and step), which is
+// entered by jumping to it, so that each time around there's only the
+// one jump, back to the top.
+//
+// Names that are read but never assigned in the loop are loaded once
+// before it, and those entries are pinned at the bottom of the vstack
+// until it's done, with each NAME of them a snippet_pick from its
+// register rather than a load. Names in nested loops count for more in
+// choosing which, and it's only as many as leave room for the deepest
+// the loop's own nodes take the vstack (going by their stack effects
+// without fusing, which only makes it shallower), so that nothing pinned
+// ever has to be spilled.
+static bool jit_emit_loop(JitState* s, int begin, int k) {
+  const Ast* nodes = s->nodes;
+  int cond_end = ast_condition_end(nodes, k);
+  int body_begin = cond_end + 1, step_begin = k, step_end = k;
+  if ((nodes[k] & 0x7f) == AST_FOR) {
+    step_begin = cond_end + 1;
+    step_end = k - ast_displ(nodes, k, 8) + 1;
+    body_begin = step_end;
+  }
+  if (s->depth != s->num_pinned || s->spilled != 0) {
+    return false;
+  }
+
+  // How much each local is read in the loop, and whether it's assigned.
+  uint32_t weight[FRAME_LOCALS] = {0};
+  bool assigned[FRAME_LOCALS] = {false};
+  int first_load[FRAME_LOCALS];
+  int values = 0, need = 0;
+  int loop_branch = -1;  // where the condition of a nested loop branches
+  for (int i = begin; i < k; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    int lval = (nodes[i] >> 7) & 1;
+    if (s->loop_at[i] >= 0) {
+      loop_branch = ast_branch_point(nodes, ast_condition_end(nodes, s->loop_at[i]));
+    }
+    if (s->unused[i] && kind != AST_CALL) {
+      continue;
+    }
+    need = max(need, values - ast_pops(nodes[i]));
+    values += ast_delta(nodes[i]);
+    // The branch takes the condition's value, and an unused CALL result
+    // is dropped.
+    values -= i == loop_branch || s->branch_at[i] >= 0 || s->unused[i];
+    if (kind != AST_NAME) {
+      continue;
+    }
+    int local = (int)(s->tokens[nodes[i] >> 8] >> 8);
+    if (lval) {
+      assigned[local] = true;
+    } else {
+      if (!weight[local]) {
+        first_load[local] = i;
+      }
+      int nested = s->loop_depth[i] - s->loop_depth[begin];
+      weight[local] += 1u << (3 * (nested < 6 ? nested : 6));
+    }
+  }
+
+  int old_pinned = s->num_pinned;
+  for (int room = jit_vstack_regs - 1 - s->num_pinned - need; jit_hoist_loads && room > 0;
+       --room) {
+    int best = -1;
+    for (int local = 0; local < FRAME_LOCALS; ++local) {
+      if (weight[local] && !assigned[local] &&
+          jit_loaded(s, nodes[first_load[local]], s->num_pinned) < 0 &&
+          (best < 0 || weight[local] > weight[best])) {
+        best = local;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    weight[best] = 0;
+    s->code = jit_wrap(s->code);
+    if (!jit_make_room(s, 0)) {
+      return false;
+    }
+    SnippetEmitter emit = ast_snippets[s->columns != NULL][AST_NAME][0][s->depth].emit;
+    if (!emit) {
+      return false;
+    }
+    s->code = emit(s->code,
+                   node_operand(nodes[first_load[best]], s->tokens, s->locals, s->columns));
+    ++s->num_pinned;
+    jit_push(s, 0, 1, (uint8_t)(best + 1), 0);
+  }
+
+  int top = jit_new_label(s);
+  int cond = jit_new_label(s);
+  jit_jump(s, snippet_jump[s->depth], cond);
+  jit_place_label(s, top);
+  if (!jit_emit_nodes(s, body_begin, k) || !jit_emit_nodes(s, step_begin, step_end)) {
+    return false;
+  }
+  jit_place_label(s, cond);
+  int at = ast_branch_point(nodes, cond_end);
+  for (int i = begin; i < at;) {
+    i = jit_emit_node(s, i, at);
+    if (i < 0) {
+      return false;
+    }
+  }
+  if (!jit_branch(s, at, cond_end, true, top)) {
+    return false;
+  }
+  // Nothing has to be done to drop the pinned entries, the snippets after
+  // just take fewer registers.
+  s->depth = s->num_pinned = old_pinned;
+  return true;
+}
+
+// Emit nodes [begin, end) in order, starting any IFs and loops that are
+// reached.
+static bool jit_emit_nodes(JitState* s, int begin, int end) {
+  for (int i = begin; i < end;) {
+    if (s->branch_at[i] >= 0) {
+      int k = s->branch_at[i];
+      if (!jit_emit_if(s, i, k)) {
+        return false;
+      }
+      i = k + 1;
+    } else if (s->loop_at[i] >= 0) {
+      int k = s->loop_at[i];
+      if (!jit_emit_loop(s, i, k)) {
+        return false;
+      }
+      i = k + 1;
+    } else {
+      i = jit_emit_node(s, i, end);
+      if (i < 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Work out which nodes' values are never used, for s->unused: those that
+// nothing pops (an expression statement), or that only unused nodes pop.
+// jit_emit_node() skips them, apart from CALLs, which are there for what
+// the function does and have their result dropped. False if |nodes|
+// aren't well formed.
+static bool jit_liveness(JitState* s, int n) {
+  const Ast* nodes = s->nodes;
+  // Which node pops each one's value (itself if it doesn't push one, or
+  // it's taken by a branch), or -1.
+  int16_t user[JIT_MAX_NODES];
+  int16_t stack[JIT_MAX_NODES];
+  int depth = 0;
+  int loop_branch = -1;
+  for (int i = 0; i < n; ++i) {
+    if (s->loop_at[i] >= 0) {
+      loop_branch = ast_branch_point(nodes, ast_condition_end(nodes, s->loop_at[i]));
+    }
+    int pops = ast_pops(nodes[i]);
+    if (pops > depth) {
+      return false;
+    }
+    for (int j = 0; j < pops; ++j) {
+      user[stack[--depth]] = (int16_t)i;
+    }
+    user[i] = (int16_t)i;
+    if (pops + ast_delta(nodes[i]) > 0 && i != loop_branch && s->branch_at[i] < 0) {
+      user[i] = -1;
+      stack[depth++] = (int16_t)i;
+    }
+  }
+  for (int i = n - 1; i >= 0; --i) {
+    int u = user[i];
+    s->unused[i] = u < 0 || (u != i && s->unused[u] && (nodes[u] & 0x7f) != AST_CALL);
+  }
+  return true;
+}
+
+// |a| |kind| |b| as the snippets do it, in 32 bits.
+static int32_t jit_fold_binop(AstKind kind, int32_t a, int32_t b) {
+  switch (kind) {
+    case AST_ADD:
+      return (int32_t)((uint32_t)a + (uint32_t)b);
+    case AST_MUL:
+      return (int32_t)((uint32_t)a * (uint32_t)b);
+    case AST_LT:
+      return a < b;
+    case AST_LE:
+      return a <= b;
+    case AST_GT:
+      return a > b;
+    case AST_GE:
+      return a >= b;
+    case AST_EQ:
+      return a == b;
+    default:
+      return a != b;
+  }
+}
+
+#define JIT_FOLD_TABLE (2 * JIT_MAX_NODES)
+
+// Work out what jit_emit_node() can stitch other than node by node, for
+// the s->value, shift, fold_ and repeat_end of each: in one pass, with a
+// stack of the values pushed as jit_liveness()'s, and no more than a
+// lookup in a hash table for each node.
+//
+// A name's value is numbered by its local, and anything else's by its
+// kind and its operands' numbers (a const's by its value), in order for
+// compares but not for ADD and MUL, which commute, which are looked up in
+// table[] so that nodes of the same thing get the same number. CALLs and
+// lvals are each their own, 0. Only subtrees that don't cross where an
+// IF branches or a loop starts, and whose value is used, are marked.
+static void jit_fold(JitState* s, int n) {
+  const Ast* nodes = s->nodes;
+  struct {
+    int16_t node;
+    int16_t first;  // of its subtree
+    uint16_t value;
+    bool is_const;
+  } stack[JIT_MAX_NODES];
+  // For each number past the names', what it's of, and whether a subtree
+  // before has it.
+  uint64_t keys[FRAME_LOCALS + JIT_MAX_NODES + 1];
+  bool seen[FRAME_LOCALS + JIT_MAX_NODES + 1];
+  uint16_t table[JIT_FOLD_TABLE];  // Numbers, or 0 for none.
+  int bits = 4;
+  while ((1 << bits) < 2 * n) {
+    ++bits;
+  }
+  uint32_t mask = (1u << bits) - 1;
+  if (jit_fold_nodes) {
+    memset(table, 0, sizeof(table[0]) << bits);
+  }
+  int numbers = FRAME_LOCALS, depth = 0, loop_branch = -1, barrier = -1;
+  for (int i = 0; i < n; ++i) {
+    s->value[i] = 0;
+    s->shift[i] = -1;
+    s->fold_end[i] = s->repeat_end[i] = -1;
+    if (!jit_fold_nodes) {
+      continue;
+    }
+    if (s->loop_at[i] >= 0) {
+      loop_branch = ast_branch_point(nodes, ast_condition_end(nodes, s->loop_at[i]));
+    }
+    if (s->loop_at[i] >= 0 || s->branch_at[i] >= 0 || i == loop_branch) {
+      barrier = i;
+    }
+    AstKind kind = nodes[i] & 0x7f;
+    int pops = ast_pops(nodes[i]);
+    depth -= pops;
+    int first = pops ? stack[depth].first : i;
+    if (pops + ast_delta(nodes[i]) <= 0 || i == loop_branch || s->branch_at[i] >= 0) {
+      continue;
+    }
+    bool is_const = false;
+    uint16_t value = 0;
+    uint64_t key = 0;
+    if (kind == AST_CONST) {
+      is_const = true;
+      s->fold_value[i] = (int32_t)(uint32_t)(s->tokens[nodes[i] >> 8] >> 8);
+      key = kind | (uint64_t)(uint32_t)s->fold_value[i] << 8;
+    } else if (kind == AST_NAME && !((nodes[i] >> 7) & 1)) {
+      value = (uint16_t)((s->tokens[nodes[i] >> 8] >> 8) + 1);
+    } else if (pops == 2 && (kind == AST_ADD || kind == AST_MUL ||
+                             ast_negated_compare[kind] != AST_INVALID)) {
+      int a = stack[depth].node, b = stack[depth + 1].node;
+      if (stack[depth].is_const && stack[depth + 1].is_const) {
+        is_const = true;
+        s->fold_value[i] = jit_fold_binop(kind, s->fold_value[a], s->fold_value[b]);
+      }
+      uint64_t va = stack[depth].value, vb = stack[depth + 1].value;
+      if ((kind == AST_ADD || kind == AST_MUL) && va > vb) {
+        uint64_t v = va;
+        va = vb;
+        vb = v;
+      }
+      if (va && vb) {
+        key = kind | va << 8 | vb << 24;
+      }
+    }
+    if (key) {
+      uint32_t at = (uint32_t)((key * 0x9e3779b97f4a7c15u) >> (64 - bits));
+      while (table[at] && keys[table[at]] != key) {
+        at = (at + 1) & mask;
+      }
+      if (!table[at]) {
+        table[at] = (uint16_t)++numbers;
+        keys[numbers] = key;
+        seen[numbers] = false;
+      }
+      value = table[at];
+    }
+    s->value[i] = value;
+
+    bool repeat = false;
+    if (i > first && value) {
+      repeat = seen[value];
+      seen[value] = true;
+    }
+    int c = -1, c_first = -1;  // A const operand of a MUL, and its first node.
+    if (kind == AST_MUL && !is_const) {
+      int at = stack[depth + 1].is_const ? depth + 1 : stack[depth].is_const ? depth : -1;
+      if (at >= 0) {
+        c = stack[at].node;
+        c_first = stack[at].first;
+      }
+    }
+    stack[depth].node = (int16_t)i;
+    stack[depth].first = (int16_t)first;
+    stack[depth].value = value;
+    stack[depth].is_const = is_const;
+    ++depth;
+    if (s->unused[i] || barrier > first) {
+      continue;
+    }
+    if (is_const) {
+      if (i > first) {
+        s->fold_end[first] = (int16_t)i;
+        s->fold_elided[first] = false;
+      }
+      continue;
+    }
+    if (repeat) {
+      s->repeat_end[first] = (int16_t)i;
+    }
+    // By 2^n, either way round, and n = 0 is neither shift nor operand.
+    uint32_t v = c >= 0 ? (uint32_t)s->fold_value[c] : 0;
+    if (v && !(v & (v - 1))) {
+      s->shift[i] = (int8_t)__builtin_ctz(v);
+      s->fold_end[c_first] = (int16_t)c;
+      s->fold_elided[c_first] = true;
+    }
+  }
+}
+
+// Set up |s| to compile |nodes| to |code|, see jit_compile_nodes().
+static bool jit_begin(JitState* s,
+                      const Ast* nodes,
+                      int n,
+                      const Token* tokens,
+                      uint64_t* locals,
+                      int* const* columns,
+                      const uint32_t (*branch_counts)[2],
+                      unsigned char* code) {
+  if (n > JIT_MAX_NODES) {
+    return false;
+  }
+  s->nodes = nodes;
+  s->tokens = tokens;
+  s->locals = locals;
+  s->columns = columns;
+  s->branch_counts = branch_counts;
+  s->code = code;
+  s->depth = s->spilled = s->num_pinned = 0;
+  s->num_labels = s->num_fixups = s->num_jmps = s->num_cold = 0;
+  for (int i = 0; i < n; ++i) {
+    s->branch_at[i] = s->loop_at[i] = -1;
+    // Past FRAME_LOCALS are the spills.
+    if ((nodes[i] & 0x7f) == AST_NAME && tokens[nodes[i] >> 8] >> 8 >= FRAME_LOCALS) {
+      return false;
+    }
+  }
+  int branches = 0;
+  for (int i = 0; i < n; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    if (kind != AST_IF && kind != AST_WHILE && kind != AST_FOR) {
+      continue;
+    }
+    if (++branches > JIT_MAX_BRANCHES) {
+      return false;
+    }
+    int cond_end = ast_condition_end(nodes, i);
+    if (kind == AST_IF) {
+      s->branch_at[ast_branch_point(nodes, cond_end)] = (int16_t)i;
+      continue;
+    }
+    int begin = ast_expression_start(nodes, cond_end);
+    if (begin < 0) {
+      return false;
+    }
+    s->loop_at[begin] = (int16_t)i;
+  }
+  int loops = 0;
+  for (int i = 0; i < n; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    loops += s->loop_at[i] >= 0;
+    s->loop_depth[i] = (uint8_t)(loops < 255 ? loops : 255);
+    loops -= kind == AST_WHILE || kind == AST_FOR;
+  }
+  if (!jit_liveness(s, n)) {
+    return false;
+  }
+  jit_fold(s, n);
+  return true;
+}
+
+// Place the cold blocks, after a jump over them from wherever |s| has got
+// to, and patch in all the jumps, each threaded through any jmps where it
+// lands (see jit_thread_label()), e.g. an IF at the very end joins at the
+// jump to the exit, so goes straight there instead. Returns the end of
+// the code, or NULL.
+static unsigned char* jit_finish(JitState* s) {
+  assert(s->depth == 0 && s->spilled == 0);
+  if (s->num_cold) {
+    int exit = jit_new_label(s);
+    jit_jump(s, snippet_jump[0], exit);
+    // Cold blocks can have IFs with cold blocks of their own, which are
+    // added to the end as this goes.
+    for (int i = 0; i < s->num_cold; ++i) {
+      JitColdBlock block = s->cold[i];
+      jit_place_label(s, block.label);
+      s->depth = s->num_pinned = block.num_pinned;
+      memcpy(s->names, block.pinned, block.num_pinned);
+      memset(s->values, 0, sizeof(s->values));
+      if (!jit_emit_nodes(s, block.begin, block.end)) {
+        return NULL;
+      }
+      jit_jump(s, snippet_jump[s->depth], block.join);
+    }
+    jit_place_label(s, exit);
+    s->depth = s->num_pinned = 0;
+  }
+  for (int i = 0; i < s->num_fixups; ++i) {
+    snippet_fixup(s->fixups[i].fixup, s->labels[jit_thread_label(s, s->fixups[i].label)]);
+  }
+  return s->code;
+}
+
+// Walk |nodes| (post-order, as below) once, emitting the snippet for each
+// node, or for each run of nodes that has a fused snippet, to |code| and
+// tracking the depth of the virtual stack to pick which variant is
+// needed. Past jit_vstack_regs the oldest entries are spilled to the
+// frame at |locals| and reloaded when they're needed again. With
+// |columns| it's the body of a batch mode loop, see jit_compile_batch().
+//
+// IFs are laid out as in jit_emit_if(), with the out of line blocks at
+// the end (see jit_finish()), and the branches to them are patched in
+// when that's all written. |branch_counts|, if not NULL, is a profile of
+// how many times each IF (indexed by node) ran its then and else blocks,
+// which decides which is likely over any EXPECT. WHILE and FOR loops are
+// as in jit_emit_loop(), with loads hoisted out of them. Nodes whose
+// values are never used are skipped, see jit_liveness().
+//
+// Returns the end of the generated code, or NULL if the expression needs
+// more than FRAME_MAX_SPILLS spill slots, or a variant that couldn't be
+// generated (one that clang didn't compile to a tail jmp), or there are
+// more than JIT_MAX_NODES nodes or JIT_MAX_BRANCHES IFs and loops, or a
+// name's local is past FRAME_LOCALS.
+static unsigned char* jit_compile_nodes(const Ast* nodes,
+                                        int n,
+                                        const Token* tokens,
+                                        uint64_t* locals,
+                                        int* const* columns,
+                                        const uint32_t (*branch_counts)[2],
+                                        unsigned char* code) {
+  JitState s;
+  if (!jit_begin(&s, nodes, n, tokens, locals, columns, branch_counts, code) ||
+      !jit_emit_nodes(&s, 0, n)) {
+    return NULL;
+  }
+  return jit_finish(&s);
+}
+
+// The body of a SIMD batch mode loop: jit_compile_nodes() for
+// jit_simd's vector snippets, without fusing or spilling. NULL if the
+// expression is too deep to keep in vector registers.
+static unsigned char* jit_compile_simd_nodes(const Ast* nodes,
+                                             int n,
+                                             const Token* tokens,
+                                             int* const* columns,
+                                             unsigned char* code) {
+  int depth = 0;
+  for (int i = 0; i < n; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    int lval = (nodes[i] >> 7) & 1;
+    SnippetEmitter emit =
+        depth < SNIPPET_SIMD_DEPTHS ? ast_simd_emitters[jit_simd][kind][lval][depth] : NULL;
+    if (!emit) {
+      return NULL;
+    }
+    code = emit(jit_wrap(code), node_operand(nodes[i], tokens, NULL, columns));
+    depth += ast_simd_stack_delta[kind][lval];
+  }
+  // Unused values are left to the scalar loop, which drops them.
+  return depth == 0 ? code : NULL;
+}
+
+// jit_compile_nodes() after pointing $stack at the frame at |locals|.
+static unsigned char* jit_compile(const Ast* nodes,
+                                  int n,
+                                  const Token* tokens,
+                                  uint64_t* locals,
+                                  const uint32_t (*branch_counts)[2],
+                                  unsigned char* code) {
+  code = stack_frame_0_fallthrough(code, (uintptr_t)locals);
+  return jit_compile_nodes(nodes, n, tokens, locals, NULL, branch_counts, code);
+}
+
+// Batch mode: compile |nodes| as the body of a loop over |rows| rows, with
+// each name referring to the int column at columns[i] (for the index i
+// in its Token, as for locals, which has to be less than |num_columns|)
+// rather than a local, so e.g. `a = b + 1`
+// does a[row] = b[row] + 1 for every row. The row is a register that's
+// carried along with $stack, and the loop's back edge is a jne in the
+// loop_tail snippet, so the whole batch runs without returning to C.
+// |frame| only holds spills.
+//
+// With jit_simd, as many rows as possible are done snippet_simd_lanes at
+// a time by a loop of vector snippets first, and the rest by the scalar
+// loop, starting from where that left $row. IFs and loops are only in
+// the scalar loop, so an expression with them runs entirely in that.
+static unsigned char* jit_compile_batch(const Ast* nodes,
+                                        int n,
+                                        const Token* tokens,
+                                        int* const* columns,
+                                        int num_columns,
+                                        size_t rows,
+                                        uint64_t* frame,
+                                        const uint32_t (*branch_counts)[2],
+                                        unsigned char* code) {
+  for (int i = 0; i < n; ++i) {
+    if ((nodes[i] & 0x7f) == AST_NAME && tokens[nodes[i] >> 8] >> 8 >= (Token)num_columns) {
+      return NULL;
+    }
+  }
+  code = stack_frame_0_fallthrough(code, (uintptr_t)frame);
+  size_t row = 0;
+  if (jit_simd >= 0 && rows >= snippet_simd_lanes[jit_simd]) {
+    size_t vector_rows = rows - rows % snippet_simd_lanes[jit_simd];
+    unsigned char* end = jit_compile_simd_nodes(nodes, n, tokens, columns, code);
+    if (end && snippet_simd_loop_tail[jit_simd]) {
+      code = snippet_simd_loop_tail[jit_simd](end, vector_rows, code);
+      row = vector_rows;
+    }
+  }
+  if (row == rows) {
+    return code;
+  }
+  // The scalar loop's cold blocks go after its loop_tail, so that the
+  // jump over them is only taken once rather than for every row.
+  JitState s;
+  if (!jit_begin(&s, nodes, n, tokens, frame, columns, branch_counts, code) ||
+      !jit_emit_nodes(&s, 0, n)) {
+    return NULL;
+  }
+  s.code = loop_tail_0_fallthrough(s.code, rows, code);
+  return jit_finish(&s);
+}
+
+// -------------------------------------------------------------------------
+// Typed expressions: locals of any SnippetType, with floats kept in xmm
+// registers on the vstack alongside the ints in general purpose ones.
+// -------------------------------------------------------------------------
+
+// The vstack for jit_compile_typed(): whether each entry is a float, from
+// the bottom, and where they are. The bottom |spilled| are in the frame,
+// each in the spill slot of its index, and the rest in registers.
+typedef struct TypedVstack {
+  bool is_float[JIT_MAX_NODES];
+  int depth;
+  int spilled;
+  int ints;
+  int floats;
+} TypedVstack;
+
+static void typed_push(TypedVstack* vs, bool is_float) {
+  vs->is_float[vs->depth++] = is_float;
+  if (is_float) {
+    ++vs->floats;
+  } else {
+    ++vs->ints;
+  }
+}
+
+static void typed_pop(TypedVstack* vs, int pops) {
+  for (int i = 0; i < pops; ++i) {
+    if (vs->is_float[--vs->depth]) {
+      --vs->floats;
+    } else {
+      --vs->ints;
+    }
+  }
+}
+
+// Get the top |pops| entries of |vs| into registers, with no more than
+// jit_vstack_regs ints or SNIPPET_MAX_SAVED_FLOAT_REGS floats beneath
+// them, by reloading or spilling the oldest. NULL if that needs more than
+// FRAME_MAX_SPILLS.
+static unsigned char* typed_make_room(TypedVstack* vs, int pops, unsigned char* code) {
+  int float_pops = 0;
+  for (int i = vs->depth - pops; i < vs->depth; ++i) {
+    float_pops += vs->is_float[i];
+  }
+  while (vs->ints + vs->floats < pops && vs->spilled > 0) {
+    bool is_float = vs->is_float[--vs->spilled];
+    code = snippet_typed_reload[is_float][vs->ints][vs->floats](
+        code, frame_spill_offset(vs->spilled));
+    if (is_float) {
+      ++vs->floats;
+    } else {
+      ++vs->ints;
+    }
+  }
+  while (vs->ints - (pops - float_pops) >= jit_vstack_regs ||
+         vs->floats - float_pops >= SNIPPET_MAX_SAVED_FLOAT_REGS) {
+    if (vs->spilled == FRAME_MAX_SPILLS) {
+      return NULL;
+    }
+    bool is_float = vs->is_float[vs->spilled];
+    code = snippet_typed_spill[is_float][vs->ints][vs->floats](
+        code, frame_spill_offset(vs->spilled++));
+    if (is_float) {
+      --vs->floats;
+    } else {
+      --vs->ints;
+    }
+  }
+  return code;
+}
+
+// A CONST's $X, the bits of |value| as |type|.
+static uintptr_t typed_const_bits(int64_t value, SnippetType type) {
+  if (type == SNIPPET_F32) {
+    float f = (float)value;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+  } else if (type == SNIPPET_F64) {
+    double f = (double)value;
+    uint64_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return (uintptr_t)bits;
+  }
+  return (uintptr_t)value;
+}
+
+// jit_compile() where each local is the SnippetType in |local_types|
+// (FRAME_LOCALS of them, indexed the same way as locals) rather than an
+// int. An ADD or MUL is done in the larger of its operands' types, as C
+// would, and an ASSIGN converts to the type of the local; an operand
+// that isn't already of that type is converted by a cvt snippet straight
+// after it, and a CONST is just emitted in that type. A u8 or i16 local
+// is loaded as an i32, extending it in the load, so it's only the load
+// and the ASSIGN to it that are in its type. It still has a whole 8-byte
+// slot in the frame, as every local does, so that's no less memory or
+// bandwidth than an int. There are no fused snippets. IFs, loops and
+// CALLs aren't supported yet. Returns NULL as jit_compile_nodes() does.
+static unsigned char* jit_compile_typed(const Ast* nodes,
+                                        int n,
+                                        const Token* tokens,
+                                        uint64_t* locals,
+                                        const uint8_t* local_types,
+                                        unsigned char* code) {
+  if (n > JIT_MAX_NODES) {
+    return NULL;
+  }
+  // First the type each node is evaluated in, and the one its parent
+  // wants it in.
+  uint8_t type[JIT_MAX_NODES];
+  uint8_t want[JIT_MAX_NODES];
+  int operands[JIT_MAX_NODES];
+  int num_operands = 0;
+  for (int i = 0; i < n; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    if (kind == AST_IF || kind == AST_EXPECT || kind == AST_WHILE || kind == AST_FOR ||
+        kind == AST_CALL) {
+      return NULL;  // Branches and natives are only for ints so far.
+    } else if (kind == AST_NAME && tokens[nodes[i] >> 8] >> 8 >= FRAME_LOCALS) {
+      return NULL;
+    } else if (kind == AST_NAME) {
+      type[i] = local_types[tokens[nodes[i] >> 8] >> 8];
+    } else if (kind == AST_CONST) {
+      type[i] = SNIPPET_I32;
+    } else {
+      int rhs = operands[--num_operands];
+      int lhs = operands[--num_operands];
+      type[i] = kind == AST_ASSIGN ? type[lhs]
+                                   : max(snippet_type_promoted[type[lhs]],
+                                         snippet_type_promoted[type[rhs]]);
+      want[lhs] = type[i];
+      want[rhs] = snippet_type_promoted[type[i]];
+    }
+    want[i] = snippet_type_promoted[type[i]];
+    if (kind != AST_ASSIGN) {
+      operands[num_operands++] = i;
+    }
+  }
+
+  TypedVstack vs;
+  vs.depth = vs.spilled = vs.ints = vs.floats = 0;
+  code = stack_frame_0_fallthrough(code, (uintptr_t)locals);
+  for (int i = 0; i < n; ++i) {
+    AstKind kind = nodes[i] & 0x7f;
+    int lval = (nodes[i] >> 7) & 1;
+    int pops = ast_stack_pops[kind][lval];
+    SnippetType t = kind == AST_CONST ? want[i] : type[i];
+    code = typed_make_room(&vs, pops, jit_wrap(code));
+    if (!code) {
+      return NULL;
+    }
+    SnippetEmitter emit = ast_typed_emitters[kind][lval][t][vs.ints][vs.floats];
+    if (!emit) {
+      return NULL;
+    }
+    uintptr_t x = kind == AST_CONST ? typed_const_bits(tokens[nodes[i] >> 8] >> 8, t)
+                                    : node_operand(nodes[i], tokens, locals, NULL);
+    code = emit(code, x);
+    typed_pop(&vs, pops);
+    if (pops + ast_stack_delta[kind][lval] == 0) {
+      continue;
+    }
+    // An lval is an address.
+    typed_push(&vs, !lval && snippet_type_is_float[t]);
+    if (!lval && want[i] != snippet_type_promoted[t]) {
+      code = typed_make_room(&vs, 1, code);
+      if (!code) {
+        return NULL;
+      }
+      emit = snippet_convert[snippet_type_promoted[t]][want[i]][vs.ints][vs.floats];
+      if (!emit) {
+        return NULL;
+      }
+      code = emit(code, 0);
+      typed_pop(&vs, 1);
+      typed_push(&vs, snippet_type_is_float[want[i]]);
+    }
+  }
+  assert(vs.depth == 0 && vs.spilled == 0);
+  return code;
+}
+
+// The arguments of whichever of the jit_compile functions a function is
+// being compiled with.
+typedef struct JitSource {
+  const Ast* nodes;
+  int n;
+  const Token* tokens;
+  uint64_t* locals;  // The frame, which in batch mode only holds spills.
+  // jit_compile_batch() over |rows| if set,
+  int* const* columns;
+  int num_columns;
+  size_t rows;
+  // otherwise jit_compile_typed() if set, and jit_compile() if not.
+  const uint8_t* local_types;
+  // For jit_compile() and jit_compile_batch(), see jit_compile_nodes().
+  const uint32_t (*branch_counts)[2];
+} JitSource;
+
+static unsigned char* jit_compile_source(const JitSource* src, unsigned char* code) {
+  if (src->columns) {
+    return jit_compile_batch(src->nodes, src->n, src->tokens, src->columns, src->num_columns,
+                             src->rows, src->locals, src->branch_counts, code);
+  } else if (src->local_types) {
+    return jit_compile_typed(src->nodes, src->n, src->tokens, src->locals, src->local_types,
+                             code);
+  }
+  return jit_compile(src->nodes, src->n, src->tokens, src->locals, src->branch_counts, code);
+}
+
+// A line for |block| in the perf map, if it's open. perf takes the last
+// line for an address, so a block that's reused is named for what's in
+// it now.
+static void jit_perf_map_add(CodeBlock block, const char* kind) {
+  if (!jit_perf_map) {
+    return;
+  }
+  uint32_t id = __atomic_fetch_add(&jit_perf_map_functions, 1, __ATOMIC_RELAXED);
+  // One call, so that threads' lines don't interleave.
+  fprintf(jit_perf_map, "%llx %x cnp_%s_%u\n", (unsigned long long)(uintptr_t)block.code,
+          block.size, kind, id);
+  fflush(jit_perf_map);
+}
+
+// Whether a REL32 from anywhere in |block| reaches all |size| bytes at
+// |p|. The snippets reach data that way (see AST_SNIPPETS in clang_rip.py)
+// and nothing places it near the arena, so it's checked for each block.
+static bool jit_reaches(CodeBlock block, const void* p, size_t size) {
+  int64_t lo = (int64_t)((uintptr_t)p - (uintptr_t)(block.code + block.size));
+  int64_t hi = (int64_t)((uintptr_t)p + size - (uintptr_t)block.code);
+  return lo > INT32_MIN && hi < INT32_MAX;
+}
+
+// Whether |block| is in reach of everything that what's compiled from
+// |src| has a REL32 to: the locals, or in batch mode the columns it uses
+// instead, and the counts if snippets are being counted. The spills are
+// reached through $stack, so they needn't be.
+static bool jit_source_reaches(const JitSource* src, CodeBlock block) {
+  if (jit_snippet_counts && !jit_reaches(block, jit_snippet_counts, sizeof(JitSnippetCounts))) {
+    return false;
+  }
+  if (!src->columns && !jit_reaches(block, src->locals, FRAME_LOCALS * sizeof(uint64_t))) {
+    return false;
+  }
+  for (int i = 0; src->columns && i < src->n; ++i) {
+    if ((src->nodes[i] & 0x7f) == AST_NAME &&
+        !jit_reaches(block, src->columns[src->tokens[src->nodes[i] >> 8] >> 8],
+                     src->rows * sizeof(int))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// |src| compiled into a new block in |arena| as a function that can be
+// called from C, as void (*)(void). The block's .code is NULL if it
+// couldn't be compiled, or the arena is full.
+static CodeBlock jit_compile_any_function(CodeArena* arena, const JitSource* src) {
+  CodeBlock block = {NULL, 0};
+  // The size of the body, compiled into jit_window where it'll have the
+  // same alignment as after the entry in the block.
+  size_t entry_size = sizeof(c_entry_0_code);
+  unsigned char* start = jit_window + entry_size % JIT_WINDOW_ALIGN;
+  jit_wrapped = jit_written = 0;
+  unsigned char* end = jit_compile_source(src, start);
+  if (!end) {
+    return block;
+  }
+  size_t body_size = jit_wrapped + (size_t)(end - jit_window) - (size_t)(start - jit_window);
+  // The block is only as big as the body and what was written past it,
+  // which the ret goes at the start of. That's all that's ever written to
+  // it, as long as everything that writes code either writes only what
+  // stays (the snippets' emitters, and jit_write_jump()), or notes in
+  // jit_written how far it got before it takes any back (as
+  // jit_place_label() does). Anything else would write past the block
+  // into whatever's after it, so the second compile checks it did that.
+  size_t past = 1;
+  if (jit_written > (uintptr_t)end + jit_wrapped + past) {
+    past = jit_written - ((uintptr_t)end + jit_wrapped);
+  }
+  block = code_arena_alloc(arena, entry_size + body_size + past);
+  if (!block.code) {
+    return block;
+  }
+  if (!jit_source_reaches(src, block)) {
+    code_arena_free(arena, block);
+    return (CodeBlock){NULL, 0};
+  }
+  // c_entry_0 saves all the registers that the ghccc snippets might
+  // clobber but the platform's C ABI says are callee-saved, and calls the
+  // body that follows it. The body then `ret`s back to it.
+  unsigned char* body = block.code + entry_size;
+  c_entry_0(block.code, body);
+  jit_written = 0;
+  end = jit_compile_source(src, body);
+  assert(end == body + body_size);
+  assert(jit_written <= (uintptr_t)end + jit_wrapped + past);
+
+  // Just for testing, the body just returns. Normally this would be
+  // inside of a large setup that could provide a top-level continuation
+  // that would receive the result.
+  *end++ = 0xc3;  // ret
+
+  code_arena_seal(arena, block);
+  jit_perf_map_add(block, src->columns ? "batch" : src->local_types ? "typed" : "function");
+  return block;
+}
+
+static CodeBlock jit_compile_function(CodeArena* arena,
+                                      const Ast* nodes,
+                                      int n,
+                                      const Token* tokens,
+                                      uint64_t* locals) {
+  JitSource src = {nodes, n, tokens, locals, NULL, 0, 0, NULL, NULL};
+  return jit_compile_any_function(arena, &src);
+}
+
+// The function runs the whole batch. |frame| is for spills, as for
+// jit_compile_batch(), and has to outlive the function. The columns are
+// reached with REL32s, so .code is also NULL if one is 2 GiB or more from
+// where the function would go, e.g. one that's malloc()ed from the heap.
+static CodeBlock jit_compile_batch_function(CodeArena* arena,
+                                            const Ast* nodes,
+                                            int n,
+                                            const Token* tokens,
+                                            int* const* columns,
+                                            int num_columns,
+                                            size_t rows,
+                                            uint64_t* frame) {
+  JitSource src = {nodes, n, tokens, frame, columns, num_columns, rows, NULL, NULL};
+  return jit_compile_any_function(arena, &src);
+}
+
+static CodeBlock jit_compile_typed_function(CodeArena* arena,
+                                            const Ast* nodes,
+                                            int n,
+                                            const Token* tokens,
+                                            uint64_t* locals,
+                                            const uint8_t* local_types) {
+  JitSource src = {nodes, n, tokens, locals, NULL, 0, 0, local_types, NULL};
+  return jit_compile_any_function(arena, &src);
+}
+
+// Tokens that jit_compile_text() has room for, at least as many as there'd
+// be for JIT_MAX_NODES nodes of most sources.
+#define JIT_MAX_TOKENS (2 * JIT_MAX_NODES)
+
+// Lex and parse |src| into |tokens| (JIT_MAX_TOKENS) and |nodes|
+// (JIT_MAX_NODES), with CALLs by jit_native_names and the locals laid
+// out by frame_layout(), for jit_compile_text(). Returns the number of
+// nodes, or -1.
+static int jit_parse_text(const char* src,
+                          Token* tokens,
+                          Ast* nodes,
+                          Intern* names,
+                          uint8_t* slots) {
+  int num_tokens = lex(src, tokens, JIT_MAX_TOKENS, names);
+  if (num_tokens < 0) {
+    return -1;
+  }
+  int n = parse(tokens, names, nodes, JIT_MAX_NODES, jit_native_names, JIT_MAX_NATIVES);
+  if (n < 0 || frame_layout(nodes, n, tokens, num_tokens, names, slots) < 0) {
+    return -1;
+  }
+  return n;
+}
+
+// Lex, parse and compile |src| as jit_compile_function() does, see
+// jit_parse_text(). The source's names are added to |names|, which can
+// already have some, e.g. to mark them shared, and slots[i] is set to
+// where name i's local is in |locals|. Nothing is allocated but the
+// block. Its .code is NULL if |src| doesn't lex or parse, or couldn't be
+// compiled.
+static CodeBlock jit_compile_text(CodeArena* arena,
+                                  const char* src,
+                                  uint64_t* locals,
+                                  Intern* names,
+                                  uint8_t* slots) {
+  Token tokens[JIT_MAX_TOKENS];
+  Ast nodes[JIT_MAX_NODES];
+  int n = jit_parse_text(src, tokens, nodes, names, slots);
+  if (n < 0) {
+    return (CodeBlock){NULL, 0};
+  }
+  return jit_compile_function(arena, nodes, n, tokens, locals);
+}
+
+#include "code_cache.c"
+#include "interp.c"
+
+// -------------------------------------------------------------------------
+// `cnp bench`: compare how quickly the memcpy+patch snippet functions and
+// the one-store-per-byte `_bytewise` ones can stitch the example below.
+// Only emission is timed, nothing is executed.
+// -------------------------------------------------------------------------
+
+#define EXAMPLE_NODES 13
+#define STITCH_EXAMPLE(name, style)                                       \
+  static unsigned char* name(unsigned char* p, uint64_t* locals) {        \
+    p = load_addr_0_fallthrough##style(p, (uintptr_t)&locals['a' - 'a']); \
+    p = load_1_fallthrough##style(p, (uintptr_t)&locals['b' - 'a']);      \
+    p = load_2_fallthrough##style(p, (uintptr_t)&locals['c' - 'a']);      \
+    p = add_1_fallthrough##style(p);                                      \
+    p = load_2_fallthrough##style(p, (uintptr_t)&locals['f' - 'a']);      \
+    p = load_3_fallthrough##style(p, (uintptr_t)&locals['g' - 'a']);      \
+    p = mul_2_fallthrough##style(p);                                      \
+    p = add_1_fallthrough##style(p);                                      \
+    p = load_2_fallthrough##style(p, (uintptr_t)&locals['d' - 'a']);      \
+    p = const_3_fallthrough##style(p, 3);                                 \
+    p = add_2_fallthrough##style(p);                                      \
+    p = mul_1_fallthrough##style(p);                                      \
+    p = assign_indirect_0_fallthrough##style(p);                          \
+    return p;                                                             \
+  }
+STITCH_EXAMPLE(stitch_example_template, )
+STITCH_EXAMPLE(stitch_example_bytewise, _bytewise)
+#undef STITCH_EXAMPLE
+
+static void bench_snippet_styles(void) {
+  const int buf_size = 1 << 20;
+  const int iters = 1 << 22;
+  unsigned char* buf = os_alloc(buf_size + (64 << 10));
+  uint64_t* locals = (uint64_t*)(buf + buf_size);
+
+  struct {
+    const char* name;
+    unsigned char* (*stitch)(unsigned char* p, uint64_t* locals);
+  } styles[] = {
+      {"template", stitch_example_template},
+      {"bytewise", stitch_example_bytewise},
+  };
+
+  for (int i = 0; i < countofi(styles); ++i) {
+    // Keep writing forward through the buffer so it's not just the same
+    // few cache lines being rewritten.
+    unsigned char* p = buf;
+    double start = os_seconds();
+    for (int j = 0; j < iters; ++j) {
+      if (p - buf > buf_size - 4096) {
+        p = buf;
+      }
+      p = styles[i].stitch(p, locals);
+    }
+    double secs = os_seconds() - start;
+    printf("%s: %.1f M nodes/sec (%zu bytes per stitch)\n", styles[i].name,
+           (double)iters * EXAMPLE_NODES / secs / 1e6, styles[i].stitch(buf, locals) - buf);
+  }
+  os_release(buf, buf_size + (64 << 10));
+}
+
+// JIT throughput, including the walk over the Ast and dispatch, with and
+// without the fused snippets.
+static void bench_jit_compile(const Ast* nodes, int n, const Token* tokens) {
+  const int buf_size = 1 << 20;
+  const int iters = 1 << 20;
+  unsigned char* buf = os_alloc(buf_size + (64 << 10));
+  uint64_t* locals = (uint64_t*)(buf + buf_size);
+
+  for (int fuse = 1; fuse >= 0; --fuse) {
+    jit_fuse_patterns = fuse;
+    unsigned char* p = buf;
+    double start = os_seconds();
+    for (int i = 0; i < iters; ++i) {
+      if (p - buf > buf_size - 4096) {
+        p = buf;
+      }
+      p = jit_compile(nodes, n, tokens, locals, NULL, p);
+    }
+    double usecs = (os_seconds() - start) * 1e6;
+    printf("jit_compile%s: %.1f nodes/us (%zu bytes)\n", fuse ? "" : " (unfused)",
+           (double)iters * n / usecs, jit_compile(nodes, n, tokens, locals, NULL, buf) - buf);
+  }
+  jit_fuse_patterns = true;
+  os_release(buf, buf_size + (64 << 10));
+}
+
+// -------------------------------------------------------------------------
+// Deep expressions: a = b + (c + (d + ...)) keeps every leaf on the vstack
+// until the end. Compare compiling and running it with all of them passed
+// along as ghccc arguments (when snippets.c was generated with
+// `clang_rip.py --vstack-regs 9` or more) against spilling past fewer.
+// -------------------------------------------------------------------------
+
+#define DEEP_LEAVES 8
+
+// Fill in the tokens and nodes for the expression with |leaves| leaves,
+// returning the number of nodes, and the value it assigns to 'a' in
+// |*expected| when locals 'b' to 'g' are 1 to 6.
+static int deep_expression(int leaves, Token* tokens, Ast* nodes, int* expected) {
+  int n = 0;
+  *expected = 0;
+  tokens[0] = (Token)0 << 8 | TK_IDENT;  // The letters, as main() interns them.
+  nodes[n++] = UNARYOP_LVAL(NAME, 0);
+  for (int i = 1; i <= leaves; ++i) {
+    tokens[i] = (Token)(1 + (i - 1) % 6) << 8 | TK_IDENT;
+    nodes[n++] = UNARYOP(NAME, i);
+    *expected += (i - 1) % 6 + 1;
+  }
+  for (int i = 0; i < leaves - 1; ++i) {
+    nodes[n++] = BINOP(ADD, (2 + 2 * i));
+  }
+  nodes[n++] = BINOP(ASSIGN, 2 * leaves);
+  return n;
+}
+
+static void bench_deep_expression(void) {
+  Token tokens[1 + DEEP_LEAVES];
+  Ast nodes[2 * DEEP_LEAVES + 1];
+  int expected;
+  int n = deep_expression(DEEP_LEAVES, tokens, nodes, &expected);
+
+  const int code_size = 64 << 10;
+  const int compile_iters = 1 << 16;
+  const int run_iters = 1 << 22;
+  unsigned char* buf = os_alloc(code_size + (64 << 10));
+  uint64_t* locals = (uint64_t*)(buf + code_size);
+  for (int i = 1; i <= 6; ++i) {
+    locals[i] = i;
+  }
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+
+  for (int regs = SNIPPET_MAX_SAVED_REGS; regs >= 1; regs /= 2) {
+    jit_vstack_regs = regs;
+    char label[32];
+    if (regs > DEEP_LEAVES) {
+      snprintf(label, sizeof(label), "all args");
+    } else {
+      snprintf(label, sizeof(label), "spill past %d", regs);
+    }
+    double start = os_seconds();
+    for (int i = 0; i < compile_iters; ++i) {
+      jit_compile(nodes, n, tokens, locals, NULL, buf);
+    }
+    double compile_usecs = (os_seconds() - start) * 1e6;
+
+    CodeBlock fn = jit_compile_function(&arena, nodes, n, tokens, locals);
+    if (!fn.code) {
+      printf("deep %-14s couldn't compile\n", label);
+      continue;
+    }
+    start = os_seconds();
+    for (int i = 0; i < run_iters; ++i) {
+      ((void (*)(void))fn.code)();
+    }
+    double run_nsecs = (os_seconds() - start) * 1e9;
+
+    printf("deep %-14s %.1f nodes/us, %u bytes, %.2f ns/eval%s\n", label,
+           (double)compile_iters * n / compile_usecs, fn.size, run_nsecs / run_iters,
+           (int)locals[0] == expected ? "" : " (WRONG)");
+    code_arena_free(&arena, fn);
+  }
+  jit_vstack_regs = SNIPPET_MAX_SAVED_REGS;
+  code_arena_destroy(&arena);
+  os_release(buf, code_size + (64 << 10));
+}
+
+// -------------------------------------------------------------------------
+// Lots of short-lived functions in a CodeArena: keep the most recent
+// ARENA_BENCH_LIVE of them, freeing the oldest as each new one (a deep
+// expression of 1 to DEEP_LEAVES leaves) is compiled and run once. Then
+// again asking for huge pages, which only matter on Linux.
+// -------------------------------------------------------------------------
+
+#define ARENA_BENCH_LIVE 256
+
+static void bench_code_arena(bool huge_pages) {
+  const int iters = 1 << 18;
+  uint64_t* locals = os_alloc(64 << 10);
+  for (int i = 1; i <= 6; ++i) {
+    locals[i] = i;
+  }
+  CodeArena arena;
+  if (!code_arena_init(&arena, 64 << 20, huge_pages)) {
+    printf("arena: couldn't reserve%s\n", huge_pages ? " huge pages" : "");
+    os_release(locals, 64 << 10);
+    return;
+  }
+  CodeBlock live[ARENA_BENCH_LIVE] = {0};
+
+  Token tokens[1 + DEEP_LEAVES];
+  Ast nodes[2 * DEEP_LEAVES + 1];
+  bool ok = true;
+  double start = os_seconds();
+  for (int i = 0; i < iters; ++i) {
+    int expected;
+    int n = deep_expression(1 + i % DEEP_LEAVES, tokens, nodes, &expected);
+    CodeBlock* slot = &live[i % ARENA_BENCH_LIVE];
+    if (slot->code) {
+      code_arena_free(&arena, *slot);
+    }
+    *slot = jit_compile_function(&arena, nodes, n, tokens, locals);
+    ((void (*)(void))slot->code)();
+    ok &= (int)locals[0] == expected;
+  }
+  double secs = os_seconds() - start;
+
+  CodeArenaStats stats = code_arena_stats(&arena);
+  printf("arena (%zu KiB pages): %.0f compiles/sec, %.0f W^X flips/sec, %zu KiB committed, "
+         "%.1f%% fragmented%s\n",
+         stats.page_size >> 10, iters / secs, stats.protections / secs, stats.committed >> 10,
+         stats.fragmentation * 100.0, ok ? "" : " (WRONG)");
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
+
+// -------------------------------------------------------------------------
+// Block bounds: functions that are exactly the size of a class, each
+// compiled into a freed block that's just before a live one, which has to
+// be unchanged after, i.e. nothing was written past the end of the block.
+// -------------------------------------------------------------------------
+
+static void bench_block_bounds(void) {
+  static const struct {
+    const char* name;
+    const char* src;  // What ends the function.
+  } ends[] = {
+      // The back edge is the last jump, and it's shortened to a rel8.
+      {"loop", "for (i = 0; i < 3; i = i + 1) b = b + i;"},
+      // The jmp at the end of the cold block goes to the next instruction,
+      // so it's taken back out.
+      {"if else", "if (a) { b = 1; } else { c = 2; }"},
+  };
+  uint64_t* locals = os_alloc(64 << 10);
+  static Intern names;
+  uint8_t slots[INTERN_MAX_NAMES];
+  CodeArena arena;
+  code_arena_init(&arena, 1 << 20, false);
+  for (int e = 0; e < countofi(ends); ++e) {
+    // Padded with statements of two sizes until it's exactly a class, 256
+    // or 512 bytes.
+    char src[1024];
+    bool found = false;
+    uint32_t size = 0;
+    for (int k = 0; !found && k < 32; ++k) {
+      for (int m = 0; !found && m < 32; ++m) {
+        int len = 0;
+        for (int j = 0; j < k; ++j) {
+          len += snprintf(src + len, sizeof(src) - len, "b = 1; ");
+        }
+        for (int j = 0; j < m; ++j) {
+          len += snprintf(src + len, sizeof(src) - len, "c = d + e; ");
+        }
+        snprintf(src + len, sizeof(src) - len, "%s", ends[e].src);
+        intern_init(&names);
+        CodeBlock fn = jit_compile_text(&arena, src, locals, &names, slots);
+        size = fn.size;
+        found = fn.code && (size == 256 || size == 512);
+        if (fn.code) {
+          code_arena_free(&arena, fn);
+        }
+      }
+    }
+    CodeArena fresh;
+    code_arena_init(&fresh, 1 << 20, false);
+    intern_init(&names);
+    CodeBlock fn = found ? jit_compile_text(&fresh, src, locals, &names, slots)
+                         : (CodeBlock){NULL, 0};
+    CodeBlock next = {NULL, 0};
+    if (fn.code) {
+      code_arena_free(&fresh, fn);
+      intern_init(&names);
+      next = jit_compile_text(&fresh, "a = 1;", locals, &names, slots);
+    }
+    unsigned char before[1 << CODE_ARENA_MIN_CLASS];
+    if (!next.code || next.code != fn.code + size || next.size > sizeof(before)) {
+      printf("block bounds %s: couldn't lay out\n", ends[e].name);
+      code_arena_destroy(&fresh);
+      continue;
+    }
+    memcpy(before, next.code, next.size);
+    intern_init(&names);
+    CodeBlock again = jit_compile_text(&fresh, src, locals, &names, slots);
+    bool ok = again.code == fn.code && memcmp(before, next.code, next.size) == 0;
+    printf("block bounds %s: %u bytes, next block %s\n", ends[e].name, size,
+           ok ? "unchanged" : "overwritten (WRONG)");
+    code_arena_destroy(&fresh);
+  }
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
+
+// -------------------------------------------------------------------------
+// Batch mode: the example over BATCH_ROWS rows of columns, compiled once
+// with jit_compile_batch_function() for scalar snippets and then each of
+// the SIMD ones the CPU supports, against the same loop in C. Build with
+// -O3 rather than -Oz for a fair comparison with the C. The odd number of
+// rows means the SIMD versions also run the scalar loop for the last few.
+// -------------------------------------------------------------------------
+
+#define BATCH_ROWS ((1 << 20) + 5)
+
+static void batch_example_c(int* __restrict out, int* const* columns, size_t rows) {
+  const int* __restrict b = columns['b' - 'a'];
+  const int* __restrict c = columns['c' - 'a'];
+  const int* __restrict d = columns['d' - 'a'];
+  const int* __restrict f = columns['f' - 'a'];
+  const int* __restrict g = columns['g' - 'a'];
+  for (size_t i = 0; i < rows; ++i) {
+    out[i] = (b[i] + c[i] + f[i] * g[i]) * (d[i] + 3);
+  }
+}
+
+static void bench_batch(const Ast* nodes, int n, const Token* tokens) {
+  const int iters = 64;
+  const size_t column_size = BATCH_ROWS * sizeof(int);
+  int* columns[26] = {0};
+  const char* names = "abcdfg";
+  for (const char* name = names; *name; ++name) {
+    int* column = os_alloc(column_size);
+    for (int row = 0; row < BATCH_ROWS; ++row) {
+      column[row] = (row * (*name - 'a' + 1)) % 1000;
+    }
+    columns[*name - 'a'] = column;
+  }
+  int* expected = os_alloc(column_size);
+  uint64_t* frame = os_alloc(64 << 10);
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+
+  double start = os_seconds();
+  for (int i = 0; i < iters; ++i) {
+    batch_example_c(expected, columns, BATCH_ROWS);
+  }
+  printf("batch C: %.1f M rows/sec\n", (double)iters * BATCH_ROWS / (os_seconds() - start) / 1e6);
+
+  int best_simd = jit_best_simd();
+  for (int simd = -1; simd <= best_simd; ++simd) {
+    jit_simd = simd;
+    const char* label = simd < 0 ? "scalar" : snippet_simd_names[simd];
+    memset(columns['a' - 'a'], 0, column_size);
+    CodeBlock fn =
+        jit_compile_batch_function(&arena, nodes, n, tokens, columns, countofi(columns),
+                                   BATCH_ROWS, frame);
+    if (!fn.code) {
+      printf("batch %s: couldn't compile\n", label);
+      continue;
+    }
+    start = os_seconds();
+    for (int i = 0; i < iters; ++i) {
+      ((void (*)(void))fn.code)();
+    }
+    double secs = os_seconds() - start;
+    bool ok = memcmp(columns['a' - 'a'], expected, column_size) == 0;
+    printf("batch %s: %.1f M rows/sec (%u bytes)%s\n", label,
+           (double)iters * BATCH_ROWS / secs / 1e6, fn.size, ok ? "" : " (WRONG)");
+    code_arena_free(&arena, fn);
+  }
+  jit_simd = best_simd;
+
+  code_arena_destroy(&arena);
+  os_release(frame, 64 << 10);
+  os_release(expected, column_size);
+  for (const char* name = names; *name; ++name) {
+    os_release(columns[*name - 'a'], column_size);
+  }
+}
+
+// -------------------------------------------------------------------------
+// Branches: a filter over BATCH_ROWS rows in batch mode,
+//
+//   if (b < c) a = b + c else a = c * d
+//
+// where the else block runs for 90% of rows. It's compiled with an
+// EXPECT hinting the wrong way (so the then block falls through and the
+// else block is out of line), the right way, and the wrong way but with
+// a profile that overrides it.
+// -------------------------------------------------------------------------
+
+#define BRANCH_NODES 15
+
+static void bench_branches(void) {
+  const int iters = 64;
+  const size_t column_size = BATCH_ROWS * sizeof(int);
+  Token tokens[4];
+  for (int i = 0; i < 4; ++i) {
+    tokens[i] = (Token)i << 8 | TK_IDENT;  // The letters, as main() interns them.
+  }
+  Ast nodes[BRANCH_NODES] = {
+      UNARYOP(NAME, 1),       // b
+      UNARYOP(NAME, 2),       // c
+      BINOP(LT, 2),           // <
+      UNARYOP(EXPECT, 1),     // (hint)
+      UNARYOP_LVAL(NAME, 0),  // a
+      UNARYOP(NAME, 1),       // b
+      UNARYOP(NAME, 2),       // c
+      BINOP(ADD, 2),          // +
+      BINOP(ASSIGN, 4),       // =
+      UNARYOP_LVAL(NAME, 0),  // a
+      UNARYOP(NAME, 2),       // c
+      UNARYOP(NAME, 3),       // d
+      BINOP(MUL, 2),          // *
+      BINOP(ASSIGN, 4),       // =
+      IFOP(11, 6),            // if
+  };
+  int* columns[26] = {0};
+  for (int i = 0; i < 4; ++i) {
+    columns[i] = os_alloc(column_size);
+  }
+  int* expected = os_alloc(column_size);
+  uint32_t branch_counts[BRANCH_NODES][2] = {{0}};
+  for (int row = 0; row < BATCH_ROWS; ++row) {
+    int b = columns[1][row] = row % 1000;
+    int c = columns[2][row] = 100;
+    int d = columns[3][row] = row % 7;
+    expected[row] = b < c ? b + c : c * d;
+    ++branch_counts[BRANCH_NODES - 1][b < c ? 0 : 1];
+  }
+  uint64_t* frame = os_alloc(64 << 10);
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+
+  struct {
+    const char* name;
+    int expect;
+    bool profile;
+  } layouts[] = {
+      {"hint then", 1, false},
+      {"hint else", 0, false},
+      {"profile", 1, true},
+  };
+  for (int i = 0; i < countofi(layouts); ++i) {
+    nodes[3] = UNARYOP(EXPECT, layouts[i].expect);
+    JitSource src = {nodes,      BRANCH_NODES, tokens, frame, columns, countofi(columns),
+                     BATCH_ROWS, NULL,
+                     layouts[i].profile ? (const uint32_t(*)[2])branch_counts : NULL};
+    memset(columns[0], 0, column_size);
+    CodeBlock fn = jit_compile_any_function(&arena, &src);
+    if (!fn.code) {
+      printf("branch %s: couldn't compile\n", layouts[i].name);
+      continue;
+    }
+    double start = os_seconds();
+    for (int j = 0; j < iters; ++j) {
+      ((void (*)(void))fn.code)();
+    }
+    double secs = os_seconds() - start;
+    bool ok = memcmp(columns[0], expected, column_size) == 0;
+    printf("branch %s: %.1f M rows/sec (%u bytes)%s\n", layouts[i].name,
+           (double)iters * BATCH_ROWS / secs / 1e6, fn.size, ok ? "" : " (WRONG)");
+    code_arena_free(&arena, fn);
+  }
+
+  code_arena_destroy(&arena);
+  os_release(frame, 64 << 10);
+  os_release(expected, column_size);
+  for (int i = 0; i < 4; ++i) {
+    os_release(columns[i], column_size);
+  }
+}
+
+// -------------------------------------------------------------------------
+// Loops: a nested loop in locals,
+//
+//   s = 0
+//   j = 0
+//   for (; j < m; j = j + 1) {
+//     i = 0
+//     while (i < n) {
+//       s = s + k
+//       i = i + 1
+//     }
+//   }
+//
+// compiled with loads hoisted out of the loops and without.
+// -------------------------------------------------------------------------
+
+#define LOOP_NODES 32
+
+static void bench_loops(void) {
+  const int iters = 16;
+  const int m = 1000, n = 1000, k = 3;
+  Token tokens[28];
+  for (int i = 0; i < 26; ++i) {
+    tokens[i] = (Token)i << 8 | TK_IDENT;  // The letters, as main() interns them.
+  }
+  tokens[26] = (Token)0 << 8 | TK_CONST;
+  tokens[27] = (Token)1 << 8 | TK_CONST;
+  const Ast nodes[LOOP_NODES] = {
+      UNARYOP_LVAL(NAME, 18),  // s
+      UNARYOP(CONST, 26),      // 0
+      BINOP(ASSIGN, 2),        // =
+      UNARYOP_LVAL(NAME, 9),   // j
+      UNARYOP(CONST, 26),      // 0
+      BINOP(ASSIGN, 2),        // =
+      UNARYOP(NAME, 9),        // j
+      UNARYOP(NAME, 12),       // m
+      BINOP(LT, 2),            // <
+      UNARYOP_LVAL(NAME, 9),   // j
+      UNARYOP(NAME, 9),        // j
+      UNARYOP(CONST, 27),      // 1
+      BINOP(ADD, 2),           // +
+      BINOP(ASSIGN, 4),        // =
+      UNARYOP_LVAL(NAME, 8),   // i
+      UNARYOP(CONST, 26),      // 0
+      BINOP(ASSIGN, 2),        // =
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(NAME, 13),       // n
+      BINOP(LT, 2),            // <
+      UNARYOP_LVAL(NAME, 18),  // s
+      UNARYOP(NAME, 18),       // s
+      UNARYOP(NAME, 10),       // k
+      BINOP(ADD, 2),           // +
+      BINOP(ASSIGN, 4),        // =
+      UNARYOP_LVAL(NAME, 8),   // i
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(CONST, 27),      // 1
+      BINOP(ADD, 2),           // +
+      BINOP(ASSIGN, 4),        // =
+      WHILEOP(11),             // while
+      FOROP(23, 18),           // for
+  };
+  uint64_t* locals = os_alloc(64 << 10);
+  locals['m' - 'a'] = m;
+  locals['n' - 'a'] = n;
+  locals['k' - 'a'] = k;
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+
+  for (int hoist = 1; hoist >= 0; --hoist) {
+    jit_hoist_loads = hoist;
+    CodeBlock fn = jit_compile_function(&arena, nodes, LOOP_NODES, tokens, locals);
+    const char* name = hoist ? "hoisted" : "loaded";
+    if (!fn.code) {
+      printf("loop %s: couldn't compile\n", name);
+      continue;
+    }
+    double start = os_seconds();
+    for (int j = 0; j < iters; ++j) {
+      ((void (*)(void))fn.code)();
+    }
+    double secs = os_seconds() - start;
+    bool ok = (int)locals['s' - 'a'] == m * n * k;
+    printf("loop %s: %.1f M iterations/sec (%u bytes)%s\n", name,
+           (double)iters * m * n / secs / 1e6, fn.size, ok ? "" : " (WRONG)");
+    code_arena_free(&arena, fn);
+  }
+  jit_hoist_loads = true;
+
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
+
+// -------------------------------------------------------------------------
+// Native calls: the loop
+//
+//   s = 0
+//   i = 0
+//   while (i < n) {
+//     s = s + add(i, k)
+//     i = i + 1
+//   }
+//
+// where add() is a C function, against the same with add(i, k) inline as
+// i + k, and the call in a C loop. The difference over the inline loop is
+// what a call costs the jitted code, i.e. the call_native snippet and
+// add() itself.
+// -------------------------------------------------------------------------
+
+#define NATIVE_NODES 22
+
+__attribute__((noinline)) static int native_add(int a, int b) {
+  return a + b;
+}
+
+static void bench_natives(void) {
+  const int iters = 16;
+  const int n = 1000000, k = 3;
+  Token tokens[28];
+  for (int i = 0; i < 26; ++i) {
+    tokens[i] = (Token)i << 8 | TK_IDENT;  // The letters, as main() interns them.
+  }
+  tokens[26] = (Token)0 << 8 | TK_CONST;
+  tokens[27] = (Token)1 << 8 | TK_CONST;
+  Ast nodes[NATIVE_NODES] = {
+      UNARYOP_LVAL(NAME, 18),  // s
+      UNARYOP(CONST, 26),      // 0
+      BINOP(ASSIGN, 2),        // =
+      UNARYOP_LVAL(NAME, 8),   // i
+      UNARYOP(CONST, 26),      // 0
+      BINOP(ASSIGN, 2),        // =
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(NAME, 13),       // n
+      BINOP(LT, 2),            // <
+      UNARYOP_LVAL(NAME, 18),  // s
+      UNARYOP(NAME, 18),       // s
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(NAME, 10),       // k
+      CALLOP(2, 0),            // add()
+      BINOP(ADD, 4),           // +
+      BINOP(ASSIGN, 6),        // =
+      UNARYOP_LVAL(NAME, 8),   // i
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(CONST, 27),      // 1
+      BINOP(ADD, 2),           // +
+      BINOP(ASSIGN, 4),        // =
+      WHILEOP(13),             // while
+  };
+  jit_natives[0] = (JitNative)native_add;
+  uint64_t* locals = os_alloc(64 << 10);
+  locals['n' - 'a'] = n;
+  locals['k' - 'a'] = k;
+  // Unsigned, since it wraps around.
+  uint32_t expected = 0;
+  for (int i = 0; i < n; ++i) {
+    expected += (uint32_t)(i + k);
+  }
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+
+  double inline_ns = 0;
+  for (int call = 0; call < 2; ++call) {
+    nodes[13] = call ? CALLOP(2, 0) : BINOP(ADD, 2);
+    CodeBlock fn = jit_compile_function(&arena, nodes, NATIVE_NODES, tokens, locals);
+    const char* name = call ? "call" : "inline";
+    if (!fn.code) {
+      printf("native %s: couldn't compile\n", name);
+      continue;
+    }
+    double start = os_seconds();
+    for (int j = 0; j < iters; ++j) {
+      ((void (*)(void))fn.code)();
+    }
+    double ns = (os_seconds() - start) / ((double)iters * n) * 1e9;
+    bool ok = (uint32_t)locals['s' - 'a'] == expected;
+    printf("native %s: %.2f ns/iteration (%u bytes)%s", name, ns, fn.size, ok ? "" : " (WRONG)");
+    if (call) {
+      printf(", %.2f ns/call", ns - inline_ns);
+    }
+    printf("\n");
+    inline_ns = ns;
+    code_arena_free(&arena, fn);
+  }
+
+  uint32_t s = 0;
+  double start = os_seconds();
+  for (int j = 0; j < iters; ++j) {
+    s = 0;
+    for (int i = 0; i < n; ++i) {
+      s += (uint32_t)native_add(i, k);
+    }
+  }
+  double ns = (os_seconds() - start) / ((double)iters * n) * 1e9;
+  printf("native C call: %.2f ns/iteration%s\n", ns, s == expected ? "" : " (WRONG)");
+
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
+
+// -------------------------------------------------------------------------
+// Liveness: the loop
+//
+//   i = 0
+//   while (i < n) {
+//     s = s + mix(i, i, k)
+//     note(s)
+//     i = i + 1
+//   }
 //
-// Additionally, some pondering on smaller representations of Token and
-// Ast (nodes) that are array-packed and don't do allocation or a lot of
-// pointer chasing. It doesn't actually lex or parse, or even use the
-// parse tree to dispatch to the jit generation, just for expository
-// purposes.
+// with and without jit_reuse_loads, where the second i is a copy of the
+// first from its register, and note() is a CALL whose result is unused
+// and just dropped.
+// -------------------------------------------------------------------------
 
-#define _CRT_SECURE_NO_WARNINGS 1
+#define LIVENESS_NODES 25
 
-#include "snippets.c"
+static int native_notes;
 
-#include <windows.h>
-#undef ERROR
-#undef CONST
-#undef MAX
-#undef MIN
-#undef min
-#undef max
+__attribute__((noinline)) static int native_mix(int a, int b, int c) {
+  return a * b + c;
+}
 
-#include <assert.h>
-#include <stdbool.h>
-#include <stdint.h>
-#include <stdio.h>
+__attribute__((noinline)) static int native_note(int v) {
+  ++native_notes;
+  return v;
+}
 
-#define countof(a) (sizeof(a) / sizeof(a[0]))
-#define countofi(a) ((int)(sizeof(a) / sizeof(a[0])))
-#define max(x, y) ((x) >= (y) ? (x) : (y))
+static void bench_liveness(void) {
+  const int iters = 256;
+  const int n = 40000, k = 3;
+  Token tokens[28];
+  for (int i = 0; i < 26; ++i) {
+    tokens[i] = (Token)i << 8 | TK_IDENT;  // The letters, as main() interns them.
+  }
+  tokens[26] = (Token)0 << 8 | TK_CONST;
+  tokens[27] = (Token)1 << 8 | TK_CONST;
+  const Ast nodes[LIVENESS_NODES] = {
+      UNARYOP_LVAL(NAME, 18),  // s
+      UNARYOP(CONST, 26),      // 0
+      BINOP(ASSIGN, 2),        // =
+      UNARYOP_LVAL(NAME, 8),   // i
+      UNARYOP(CONST, 26),      // 0
+      BINOP(ASSIGN, 2),        // =
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(NAME, 13),       // n
+      BINOP(LT, 2),            // <
+      UNARYOP_LVAL(NAME, 18),  // s
+      UNARYOP(NAME, 18),       // s
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(NAME, 10),       // k
+      CALLOP(3, 0),            // mix()
+      BINOP(ADD, 4),           // +
+      BINOP(ASSIGN, 6),        // =
+      UNARYOP(NAME, 18),       // s
+      CALLOP(1, 1),            // note()
+      UNARYOP_LVAL(NAME, 8),   // i
+      UNARYOP(NAME, 8),        // i
+      UNARYOP(CONST, 27),      // 1
+      BINOP(ADD, 2),           // +
+      BINOP(ASSIGN, 4),        // =
+      WHILEOP(16),             // while
+  };
+  jit_natives[0] = (JitNative)native_mix;
+  jit_natives[1] = (JitNative)native_note;
+  uint64_t* locals = os_alloc(64 << 10);
+  locals['n' - 'a'] = n;
+  locals['k' - 'a'] = k;
+  // Unsigned, since it wraps around.
+  uint32_t expected = 0;
+  for (int i = 0; i < n; ++i) {
+    expected += (uint32_t)(i * i + k);
+  }
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
 
-typedef uint64_t Token;
-// 8 for kind
-// 56 for name/const value (inline! i.e. max ident length 7 bytes)
-// (real-life might be something like 24 bit index into intern'd string
-// table, and 32 bit index into source code for error reporting.)
-#define TOKEN_KINDS \
-  X(INVALID)        \
-  X(EQ)             \
-  X(IDENT)          \
-  X(CONST)          \
-  X(PLUS)           \
-  X(TIMES)          \
-  X(LPAREN)         \
-  X(RPAREN)         \
-  X(EOF)
-typedef enum TokenKind {
-#define X(x) TK_##x,
-  TOKEN_KINDS
-#undef X
-      TK_Count
-} TokenKind;
-const char* token_names[] = {
-#define X(x) #x,
-    TOKEN_KINDS
-#undef X
-};
-#define VAR(name)                          \
-  (Token) {                                \
-    (((uintptr_t)name[0]) << 8) | TK_IDENT \
+  for (int reuse = 1; reuse >= 0; --reuse) {
+    jit_reuse_loads = reuse;
+    CodeBlock fn = jit_compile_function(&arena, nodes, LIVENESS_NODES, tokens, locals);
+    const char* name = reuse ? "reused" : "loaded";
+    if (!fn.code) {
+      printf("liveness %s: couldn't compile\n", name);
+      continue;
+    }
+    native_notes = 0;
+    double start = os_seconds();
+    for (int j = 0; j < iters; ++j) {
+      ((void (*)(void))fn.code)();
+    }
+    double ns = (os_seconds() - start) / ((double)iters * n) * 1e9;
+    bool ok = (uint32_t)locals['s' - 'a'] == expected && native_notes == iters * n;
+    printf("liveness %s: %.2f ns/iteration (%u bytes)%s\n", name, ns, fn.size,
+           ok ? "" : " (WRONG)");
+    code_arena_free(&arena, fn);
   }
-#define TOK(t) ((Token){TK_##t})
-#define CONST(v) ((Token){v << 8 | TK_CONST})
+  jit_reuse_loads = true;
 
-typedef uint32_t Ast;
-// 8 for kind
-// 24 for disp 1 (assumed negative)
-// disp 2 assumed to be immediately preceding the instruction due to
-// being in post-order.
-//
-// or
-//
-// 8 for kind
-// 24 for index into tokens
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
 
-#define AST_KINDS \
-  X(INVALID)      \
-  X(ASSIGN)       \
-  X(ADD)          \
-  X(MUL)          \
-  X(NAME)         \
-  X(CONST)
+// -------------------------------------------------------------------------
+// Typed expressions: the example with jit_compile_typed(), once with every
+// local an i32 as in main(), once with b and c f64, d f32 and g i64 (so
+// a = (b + c + f * g) * (d + 3) converts f * g from i64 and d + 3 from
+// f32, both to f64), and once with a and c i16, b and d u8 and g i64,
+// which has only the loads and the store narrow, checking the result
+// against the same in C.
+// -------------------------------------------------------------------------
 
-typedef enum AstKind {
-#define X(x) AST_##x,
-  AST_KINDS
-#undef X
-      AST_Count
-} AstKind;
+static void typed_store(uint64_t* slot, SnippetType type, double value) {
+  switch (type) {
+    case SNIPPET_I32:
+      *(int*)slot = (int)value;
+      break;
+    case SNIPPET_I64:
+      *(int64_t*)slot = (int64_t)value;
+      break;
+    case SNIPPET_F32:
+      *(float*)slot = (float)value;
+      break;
+    case SNIPPET_U8:
+      *(uint8_t*)slot = (uint8_t)value;
+      break;
+    case SNIPPET_I16:
+      *(int16_t*)slot = (int16_t)value;
+      break;
+    default:
+      *(double*)slot = value;
+      break;
+  }
+}
 
-const char* ast_names[] = {
-#define X(x) #x,
-    AST_KINDS
-#undef X
-};
+static double typed_load(const uint64_t* slot, SnippetType type) {
+  switch (type) {
+    case SNIPPET_I32:
+      return *(const int*)slot;
+    case SNIPPET_I64:
+      return (double)*(const int64_t*)slot;
+    case SNIPPET_F32:
+      return *(const float*)slot;
+    case SNIPPET_U8:
+      return *(const uint8_t*)slot;
+    case SNIPPET_I16:
+      return *(const int16_t*)slot;
+    default:
+      return *(const double*)slot;
+  }
+}
 
-#define UNARYOP(k, val) ((((uint32_t)(val & 0xffffff)) << 8) | (((uint32_t)(AST_##k))))
-#define UNARYOP_LVAL(k, val) \
-  ((((uint32_t)(val & 0xffffff)) << 8) | (0x80) | (((uint32_t)(AST_##k))))
-#define BINOP(k, lhs_displ) ((((uint32_t)(lhs_displ & 0xfff)) << 20) | (((uint32_t)(AST_##k))))
+static void bench_typed(const Ast* nodes, int n, const Token* tokens) {
+  const int iters = 1 << 22;
+  static const struct {
+    const char* name;
+    uint8_t types[FRAME_LOCALS];
+    double expected;
+  } cases[] = {
+      {"i32", {SNIPPET_I32}, (2 + 3 + 6 * 7) * (4 + 3)},
+      {"mixed",
+       {['a' - 'a'] = SNIPPET_F64, ['b' - 'a'] = SNIPPET_F64, ['c' - 'a'] = SNIPPET_F64,
+        ['d' - 'a'] = SNIPPET_F32, ['g' - 'a'] = SNIPPET_I64},
+       (2.25 + 3.5 + 6 * (int64_t)7) * (4.75f + 3)},
+      {"narrow",
+       {['a' - 'a'] = SNIPPET_I16, ['b' - 'a'] = SNIPPET_U8, ['c' - 'a'] = SNIPPET_I16,
+        ['d' - 'a'] = SNIPPET_U8, ['g' - 'a'] = SNIPPET_I64},
+       (int16_t)(((uint8_t)2 + (int16_t)3 + 6 * (int64_t)7) * ((uint8_t)4 + 3))},
+  };
+  uint64_t* locals = os_alloc(64 << 10);
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+
+  for (int i = 0; i < countofi(cases); ++i) {
+    const uint8_t* types = cases[i].types;
+    const double values[] = {['b' - 'a'] = 2.25, 3.5, 4.75, 0, 6, 7};
+    for (int j = 0; j < countofi(values); ++j) {
+      typed_store(&locals[j], types[j], values[j]);
+    }
+    CodeBlock fn = jit_compile_typed_function(&arena, nodes, n, tokens, locals, types);
+    if (!fn.code) {
+      printf("typed %s: couldn't compile\n", cases[i].name);
+      continue;
+    }
+    double start = os_seconds();
+    for (int j = 0; j < iters; ++j) {
+      ((void (*)(void))fn.code)();
+    }
+    double nsecs = (os_seconds() - start) * 1e9;
+    bool ok = typed_load(&locals[0], types[0]) == cases[i].expected;
+    printf("typed %s: %.2f ns/eval, %u bytes%s\n", cases[i].name, nsecs / iters, fn.size,
+           ok ? "" : " (WRONG)");
+    code_arena_free(&arena, fn);
+  }
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
+
+// -------------------------------------------------------------------------
+// Lexing: a MiB of statements like a config file's, a byte at a time and
+// with each of SSE2 and AVX2 (if the CPU has it), checking that all of
+// them come out with the same tokens.
+// -------------------------------------------------------------------------
+
+static void bench_lex(void) {
+  static const char* const lines[] = {
+      "a = (b + c + f * g) * (d + 3);\n",
+      "total_count = total_count + row_weight * 1000;\n",
+      "if (b < c) { a = b + c; } else { a = c * d; }\n",
+      "    while (i != 100) { i = i + step; }\n",
+      "for (i = 0; i <= limit; i = i + 1) { sum_of_squares = sum_of_squares + i * i; }\n",
+  };
+  const size_t src_size = 1 << 20;
+  const int iters = 16;
+  char* src = os_alloc(src_size);
+  size_t len = 0;
+  for (int i = 0;; ++i) {
+    const char* line = lines[i % countofi(lines)];
+    if (len + strlen(line) >= src_size) {
+      break;
+    }
+    memcpy(src + len, line, strlen(line));
+    len += strlen(line);
+  }
+  src[len] = '\0';
+  const int max_tokens = (int)(src_size / 2);
+  Token* tokens = os_alloc(2 * max_tokens * sizeof(Token));
+  Token* expected = tokens + max_tokens;
+  static Intern names_table;
+  int num_expected = -1;
+
+  static const char* const names[] = {"scalar", "sse2", "avx2"};
+  LexSimd best = lex_best_simd();
+  for (LexSimd simd = LEX_SCALAR; simd <= best; ++simd) {
+    lex_simd = simd;
+    int n = 0;
+    double start = os_seconds();
+    for (int i = 0; i < iters; ++i) {
+      intern_init(&names_table);
+      n = lex(src, tokens, max_tokens, &names_table);
+    }
+    double secs = os_seconds() - start;
+    if (num_expected < 0) {
+      num_expected = n;
+      memcpy(expected, tokens, n * sizeof(Token));
+    }
+    if (n < 0 || n != num_expected || memcmp(tokens, expected, n * sizeof(Token)) != 0) {
+      printf("lex %s: wrong tokens\n", names[simd]);
+      continue;
+    }
+    printf("lex %s: %.0f MB/s, %.1f M tokens/sec (%d names)\n", names[simd],
+           (double)iters * len / secs / 1e6, (double)iters * n / secs / 1e6, names_table.count);
+  }
+  lex_simd = best;
+  os_release(tokens, 2 * max_tokens * sizeof(Token));
+  os_release(src, src_size);
+}
+
+// -------------------------------------------------------------------------
+// Text to code: a few sources lexed, parsed, laid out and compiled in turn
+// with timings for each step, and then compiled with jit_compile_text()
+// and run to check the result.
+// -------------------------------------------------------------------------
+
+// Where |name|'s local is, as laid out in |slots|, or NULL if the source
+// doesn't use it.
+static uint64_t* text_local(uint64_t* locals,
+                            const Intern* names,
+                            const uint8_t* slots,
+                            const char* name) {
+  int index = intern_find(names, name, (uint32_t)strlen(name));
+  return index < 0 || slots[index] == FRAME_NO_SLOT ? NULL : &locals[slots[index]];
+}
+
+// The inputs that the benches' sources can use, b..h.
+#define BENCH_INPUTS 7
+
+// Set each of the inputs that the source uses to 2 for b, 3 for c and so
+// on, as main() has them.
+static void bench_set_inputs(uint64_t* locals, const Intern* names, const uint8_t* slots) {
+  for (int i = 1; i <= BENCH_INPUTS; ++i) {
+    char name[2] = {(char)('a' + i), '\0'};
+    uint64_t* local = text_local(locals, names, slots, name);
+    if (local) {
+      *local = (uint64_t)(i + 1);
+    }
+  }
+}
+
+// Source |i| of those that a bench compiles many different ones of: an IF
+// with a few constants from |i|, or for every fourth, a loop calling mix().
+static void bench_source(char* src, size_t size, int i) {
+  if (i % 4 == 3) {
+    snprintf(src, size, "a = 0; for (i = 0; i < %d; i = i + 1) { a = a + mix(i, b, %d); }",
+             i % 9 + 1, i);
+  } else {
+    snprintf(src, size, "a = b * %d + c; if (a > %d) { a = a + d * %d; } else { a = a * c; }",
+             i, i % 100, i % 7);
+  }
+}
+
+static void bench_text(void) {
+  static const struct {
+    const char* name;
+    const char* src;
+    const char* shared;  // A name that's marked shared, or NULL.
+    int expected;        // 'a' after running it, with b..g as in main().
+  } sources[] = {
+      {"example", "a = (b + c + f * g) * (d + 3);", NULL, 329},
+      {"if", "if (b < c) { a = b + c; } else { a = c * d; } if (a == 5) a = a + 100;", NULL,
+       105},
+      {"for", "a = 0; for (i = 0; i < 10; i = i + 1) { a = a + i * b; }", NULL, 90},
+      {"calls", "a = 0; i = 0; while (i != g) { a = a + mix(i, f, note(d)); i = i + 1; }",
+       NULL, 154},
+      {"shared", "sum_of_all_the_rows = 0; for (i = 0; i < 8; i = i + 1) "
+       "sum_of_all_the_rows = sum_of_all_the_rows + c; a = sum_of_all_the_rows;",
+       "sum_of_all_the_rows", 24},
+  };
+  const int iters = 2000;
+  jit_natives[0] = (JitNative)native_mix;
+  jit_natives[1] = (JitNative)native_note;
+  jit_native_names[0] = "mix";
+  jit_native_names[1] = "note";
+  uint64_t* locals = os_alloc(64 << 10);
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+  static Intern names;
+  uint8_t slots[INTERN_MAX_NAMES];
+  Token tokens[256];
+  Ast nodes[256];
+
+  for (int s = 0; s < countofi(sources); ++s) {
+    const char* shared = sources[s].shared;
+    double lex_secs = 0, parse_secs = 0, layout_secs = 0, jit_secs = 0;
+    int n = -1, size = -1;
+    for (int i = 0; i < iters; ++i) {
+      intern_init(&names);
+      if (shared) {
+        names.names[intern(&names, shared, (uint32_t)strlen(shared))].shared = true;
+      }
+      double start = os_seconds();
+      int num_tokens = lex(sources[s].src, tokens, countofi(tokens), &names);
+      double lexed = os_seconds();
+      n = num_tokens < 0 ? -1
+                         : parse(tokens, &names, nodes, countofi(nodes), jit_native_names,
+                                 JIT_MAX_NATIVES);
+      double parsed = os_seconds();
+      size = n < 0 ? -1 : frame_layout(nodes, n, tokens, num_tokens, &names, slots);
+      double laid_out = os_seconds();
+      CodeBlock fn = size >= 0 ? jit_compile_function(&arena, nodes, n, tokens, locals)
+                               : (CodeBlock){NULL, 0};
+      jit_secs += os_seconds() - laid_out;
+      lex_secs += lexed - start;
+      parse_secs += parsed - lexed;
+      layout_secs += laid_out - parsed;
+      if (!fn.code) {
+        n = -1;
+        break;
+      }
+      code_arena_free(&arena, fn);
+    }
+    intern_init(&names);
+    if (shared) {
+      names.names[intern(&names, shared, (uint32_t)strlen(shared))].shared = true;
+    }
+    CodeBlock fn = jit_compile_text(&arena, sources[s].src, locals, &names, slots);
+    if (n < 0 || !fn.code) {
+      printf("text %s: couldn't compile\n", sources[s].name);
+      continue;
+    }
+    memset(locals, 0, 64 << 10);
+    bench_set_inputs(locals, &names, slots);
+    ((void (*)(void))fn.code)();
+    uint64_t* a = text_local(locals, &names, slots, "a");
+    bool ok = a && (int)*a == sources[s].expected;
+    code_arena_free(&arena, fn);
+    double us = 1e6 / iters;
+    printf("text %s: %.2f us for %d nodes, %d locals (lex %.2f, parse %.2f, layout %.2f, "
+           "jit %.2f)%s\n",
+           sources[s].name, (lex_secs + parse_secs + layout_secs + jit_secs) * us, n, size,
+           lex_secs * us, parse_secs * us, layout_secs * us, jit_secs * us,
+           ok ? "" : " (WRONG)");
+  }
+
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
+
+// -------------------------------------------------------------------------
+// Folding: loops with repeated and constant subtrees and MULs by powers of
+// two, compiled without jit_fold_nodes and then with it, which has to
+// leave the same 'a'.
+// -------------------------------------------------------------------------
+
+static void bench_fold(void) {
+  static const struct {
+    const char* name;
+    const char* src;
+  } sources[] = {
+      {"repeats", "a = 0; for (i = 0; i < 1000; i = i + 1) { a = a + (i * 3 + b) * (i * 3 + b); }"},
+      {"consts", "a = 0; for (i = 0; i < 1000; i = i + 1) { a = a + i * ((2 + 3) * (4 + 5)); }"},
+      {"shifts", "a = 0; for (i = 0; i < 1000; i = i + 1) { a = a + i * 16 + 8 * (c + i); }"},
+  };
+  const int iters = 2000;
+  uint64_t* locals = os_alloc(64 << 10);
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+  static Intern names;
+  uint8_t slots[INTERN_MAX_NAMES];
+
+  for (int s = 0; s < countofi(sources); ++s) {
+    uint64_t expected = 0;
+    for (int fold = 0; fold <= 1; ++fold) {
+      jit_fold_nodes = fold;
+      intern_init(&names);
+      CodeBlock fn = jit_compile_text(&arena, sources[s].src, locals, &names, slots);
+      const char* name = fold ? "folded" : "unfolded";
+      if (!fn.code) {
+        printf("fold %s %s: couldn't compile\n", sources[s].name, name);
+        continue;
+      }
+      memset(locals, 0, 64 << 10);
+      bench_set_inputs(locals, &names, slots);
+      double start = os_seconds();
+      for (int j = 0; j < iters; ++j) {
+        ((void (*)(void))fn.code)();
+      }
+      double ns = (os_seconds() - start) / ((double)iters * 1000) * 1e9;
+      uint64_t a = *text_local(locals, &names, slots, "a");
+      expected = fold ? expected : a;
+      printf("fold %s %s: %.2f ns/iteration (%u bytes)%s\n", sources[s].name, name, ns,
+             fn.size, a == expected ? "" : " (WRONG)");
+      code_arena_free(&arena, fn);
+    }
+  }
+  jit_fold_nodes = true;
+
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
+
+// -------------------------------------------------------------------------
+// The code cache: a few thousand sources compiled with
+// code_cache_compile_text() into a new cache, which is saved, as the
+// first run of a process would, and then loaded from it, to another
+// |locals| so that the relocs matter, as the next run would.
+// -------------------------------------------------------------------------
+
+#define BENCH_CACHE_SOURCES 2000
+#define BENCH_CACHE_SOURCE_SIZE 128
+
+// Compile all of |srcs| with |cache| (and each run, to check it against
+// |results| if |check|, or set that otherwise), returning the seconds
+// that compiling took, or -1 if one didn't compile or was wrong.
+static double bench_cache_run(CodeCache* cache,
+                              CodeArena* arena,
+                              const char* srcs,
+                              uint64_t* locals,
+                              uint64_t* results,
+                              bool check) {
+  static Intern names;
+  uint8_t slots[INTERN_MAX_NAMES];
+  double secs = 0;
+  for (int i = 0; i < BENCH_CACHE_SOURCES; ++i) {
+    const char* src = srcs + i * BENCH_CACHE_SOURCE_SIZE;
+    intern_init(&names);
+    double start = os_seconds();
+    CodeBlock fn = code_cache_compile_text(cache, arena, src, locals, &names, slots);
+    secs += os_seconds() - start;
+    if (!fn.code) {
+      return -1;
+    }
+    bench_set_inputs(locals, &names, slots);
+    ((void (*)(void))fn.code)();
+    code_arena_free(arena, fn);
+    uint64_t a = *text_local(locals, &names, slots, "a");
+    if (check && results[i] != a) {
+      return -1;
+    }
+    results[i] = a;
+  }
+  return secs;
+}
+
+static void bench_code_cache(void) {
+  static const char path[] = "cnp_bench.cache";
+  jit_natives[0] = (JitNative)native_mix;
+  jit_native_names[0] = "mix";
+  char* srcs = os_alloc(BENCH_CACHE_SOURCES * BENCH_CACHE_SOURCE_SIZE);
+  uint64_t* results = os_alloc(BENCH_CACHE_SOURCES * sizeof(uint64_t));
+  uint64_t* cold_locals = os_alloc(64 << 10);
+  uint64_t* warm_locals = os_alloc(64 << 10);
+  for (int i = 0; i < BENCH_CACHE_SOURCES; ++i) {
+    bench_source(srcs + i * BENCH_CACHE_SOURCE_SIZE, BENCH_CACHE_SOURCE_SIZE, i);
+  }
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+  remove(path);
+
+  // The runs aren't timed, just opening the cache and compiling.
+  CodeCache cache;
+  double start = os_seconds();
+  bool opened = code_cache_open(&cache, path);
+  double cold = os_seconds() - start;
+  double compiled = opened ? bench_cache_run(&cache, &arena, srcs, cold_locals, results, false)
+                           : -1;
+  cold += compiled;
+  int uncached = cache.uncached;
+  start = os_seconds();
+  bool saved = opened && code_cache_close(&cache, path) && compiled >= 0;
+  double save = os_seconds() - start;
+
+  start = os_seconds();
+  opened = saved && code_cache_open(&cache, path);
+  double warm = os_seconds() - start;
+  double loaded = opened ? bench_cache_run(&cache, &arena, srcs, warm_locals, results, true)
+                         : -1;
+  warm += loaded;
+  size_t file_size = cache.file_size;
+  int hits = cache.hits;
+  if (opened) {
+    code_cache_close(&cache, path);
+  }
+  remove(path);
+
+  if (!saved || loaded < 0) {
+    printf("code cache: %s\n", saved ? "WRONG after loading" : "couldn't compile or save");
+  } else {
+    printf("code cache cold: %.2f ms for %d sources (%.2f us each), %.2f ms to save %zu KiB "
+           "(%d uncached)\n",
+           cold * 1e3, BENCH_CACHE_SOURCES, cold * 1e6 / BENCH_CACHE_SOURCES, save * 1e3,
+           file_size >> 10, uncached);
+    printf("code cache warm: %.2f ms (%.2f us each, %d hits), %.1fx\n", warm * 1e3,
+           warm * 1e6 / BENCH_CACHE_SOURCES, hits, cold / warm);
+  }
+
+  code_arena_destroy(&arena);
+  os_release(warm_locals, 64 << 10);
+  os_release(cold_locals, 64 << 10);
+  os_release(results, BENCH_CACHE_SOURCES * sizeof(uint64_t));
+  os_release(srcs, BENCH_CACHE_SOURCES * BENCH_CACHE_SOURCE_SIZE);
+}
+
+// -------------------------------------------------------------------------
+// Tiers: how long a few sources take to the first result and then per
+// call, interpreted and compiled, and a TieredFunction, which is the one
+// and then the other, against only compiling, for a few numbers of calls.
+// -------------------------------------------------------------------------
+
+static void bench_tiers(void) {
+  static const struct {
+    const char* name;
+    const char* src;
+    int expected;  // 'a' after running it, with b..g as in main().
+  } sources[] = {
+      {"example", "a = (b + c + f * g) * (d + 3);", 329},
+      {"if", "if (b < c) { a = b + c; } else { a = c * d; } if (a == 5) a = a + 100;", 105},
+      {"for", "a = 0; for (i = 0; i < 10; i = i + 1) { a = a + i * b; }", 90},
+      {"calls", "a = 0; i = 0; while (i != g) { a = a + mix(i, f, note(d)); i = i + 1; }", 154},
+  };
+  static const int tiered_calls[] = {1, 16, 1024};
+  const int first_iters = 1000, steady_iters = 100000;
+  jit_natives[0] = (JitNative)native_mix;
+  jit_natives[1] = (JitNative)native_note;
+  jit_native_names[0] = "mix";
+  jit_native_names[1] = "note";
+  uint64_t* locals = os_alloc(64 << 10);
+  InterpStep* steps = os_alloc(INTERP_MAX_STEPS * sizeof(InterpStep));
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+  static Intern names;
+  uint8_t slots[INTERN_MAX_NAMES];
+  Token tokens[JIT_MAX_TOKENS];
+  Ast nodes[JIT_MAX_NODES];
+
+  for (int s = 0; s < countofi(sources); ++s) {
+    intern_init(&names);
+    int n = jit_parse_text(sources[s].src, tokens, nodes, &names, slots);
+    if (n < 0 || interp_prepare(nodes, n, tokens, locals, steps, INTERP_MAX_STEPS) < 0) {
+      printf("tiers %s: couldn't interpret\n", sources[s].name);
+      continue;
+    }
+    memset(locals, 0, 64 << 10);
+    bench_set_inputs(locals, &names, slots);
+    uint64_t* a = text_local(locals, &names, slots, "a");
+    bool ok = true;
+
+    double start = os_seconds();
+    for (int i = 0; i < first_iters; ++i) {
+      interp_prepare(nodes, n, tokens, locals, steps, INTERP_MAX_STEPS);
+      interp_run(steps);
+    }
+    double interp_first = (os_seconds() - start) / first_iters;
+    ok = ok && (int)*a == sources[s].expected;
+    start = os_seconds();
+    for (int i = 0; i < steady_iters; ++i) {
+      interp_run(steps);
+    }
+    double interp_steady = (os_seconds() - start) / steady_iters;
+    ok = ok && (int)*a == sources[s].expected;
+
+    CodeBlock fn = {NULL, 0};
+    start = os_seconds();
+    for (int i = 0; i < first_iters; ++i) {
+      fn = jit_compile_function(&arena, nodes, n, tokens, locals);
+      if (!fn.code) {
+        break;
+      }
+      ((void (*)(void))fn.code)();
+      code_arena_free(&arena, fn);
+    }
+    double jit_first = (os_seconds() - start) / first_iters;
+    fn = jit_compile_function(&arena, nodes, n, tokens, locals);
+    if (!fn.code) {
+      printf("tiers %s: couldn't compile\n", sources[s].name);
+      continue;
+    }
+    start = os_seconds();
+    for (int i = 0; i < steady_iters; ++i) {
+      ((void (*)(void))fn.code)();
+    }
+    double jit_steady = (os_seconds() - start) / steady_iters;
+    code_arena_free(&arena, fn);
+    ok = ok && (int)*a == sources[s].expected;
+
+    printf("tiers %s: first result interp %.2f us, jit %.2f us; then interp %.1f ns, "
+           "jit %.1f ns\n",
+           sources[s].name, interp_first * 1e6, jit_first * 1e6, interp_steady * 1e9,
+           jit_steady * 1e9);
+    for (int c = 0; c < countofi(tiered_calls); ++c) {
+      double jit_only = 0, tiered = 0;
+      for (int i = 0; i < 100; ++i) {
+        start = os_seconds();
+        fn = jit_compile_function(&arena, nodes, n, tokens, locals);
+        for (int j = 0; j < tiered_calls[c]; ++j) {
+          ((void (*)(void))fn.code)();
+        }
+        code_arena_free(&arena, fn);
+        double compiled = os_seconds();
+        TieredFunction f;
+        tiered_init(&f, &arena, nodes, n, tokens, locals, steps, INTERP_MAX_STEPS);
+        for (int j = 0; j < tiered_calls[c]; ++j) {
+          tiered_call(&f);
+        }
+        tiered_destroy(&f);
+        tiered += os_seconds() - compiled;
+        jit_only += compiled - start;
+        ok = ok && (int)*a == sources[s].expected;
+      }
+      printf("tiers %s: %d calls in %.2f us tiered (after %u), %.2f us only compiled%s\n",
+             sources[s].name, tiered_calls[c], tiered * 1e4, tier_jit_threshold,
+             jit_only * 1e4, ok ? "" : " (WRONG)");
+    }
+  }
+
+  code_arena_destroy(&arena);
+  os_release(steps, INTERP_MAX_STEPS * sizeof(InterpStep));
+  os_release(locals, 64 << 10);
+}
+
+// -------------------------------------------------------------------------
+// Concurrent compiles: the same few thousand compiles of a few sources,
+// split between 1 to 32 threads, each with its own arena in one shared
+// CodeRegion, compiling in batches and publishing each function as the
+// batch it's in is sealed. They're all run after, to check them, and in
+// one more run, also by a reader as soon as each is published, which is
+// what checks that the publishing is right.
+// -------------------------------------------------------------------------
+
+#define BENCH_CONCURRENT_SOURCES 64
+#define BENCH_CONCURRENT_COMPILES 4096
+#define BENCH_CONCURRENT_BATCH 32
+#define BENCH_CONCURRENT_REGION (256 << 20)
+
+typedef struct BenchConcurrentSource {
+  Token tokens[JIT_MAX_TOKENS];
+  Ast nodes[JIT_MAX_NODES];
+  int n;
+  uint64_t* locals;  // Its own, so the functions can all be run.
+  uint64_t* a;
+  uint64_t expected;
+} BenchConcurrentSource;
+
+typedef struct BenchCompiler {
+  CodeRegion* region;
+  const BenchConcurrentSource* sources;
+  void (**entries)(void);  // Compile i's function, published.
+  int begin, end;          // Its compiles.
+  bool batched;
+  size_t protections;
+  OsThread thread;
+} BenchCompiler;
+
+static void bench_compiler_main(void* arg) {
+  BenchCompiler* c = arg;
+  CodeArena arena;
+  code_arena_init_shared(&arena, c->region);
+  for (int i = c->begin; i < c->end; i += BENCH_CONCURRENT_BATCH) {
+    int m = c->end - i < BENCH_CONCURRENT_BATCH ? c->end - i : BENCH_CONCURRENT_BATCH;
+    CodeBlock blocks[BENCH_CONCURRENT_BATCH];
+    if (c->batched) {
+      code_arena_begin_batch(&arena);
+    }
+    for (int j = 0; j < m; ++j) {
+      const BenchConcurrentSource* s = &c->sources[(i + j) % BENCH_CONCURRENT_SOURCES];
+      blocks[j] = jit_compile_function(&arena, s->nodes, s->n, s->tokens, s->locals);
+    }
+    if (c->batched) {
+      code_arena_end_batch(&arena);
+    }
+    for (int j = 0; j < m; ++j) {
+      __atomic_store_n(&c->entries[i + j], (void (*)(void))blocks[j].code, __ATOMIC_RELEASE);
+    }
+  }
+  c->protections = arena.protections;
+  // The blocks stay in the region.
+  code_arena_destroy(&arena);
+}
+
+typedef struct BenchReader {
+  BenchConcurrentSource* sources;
+  void (**entries)(void);
+  bool done;  // Set once the compilers have all finished.
+  int run;    // How many it ran before that.
+  bool ok;
+  OsThread thread;
+} BenchReader;
+
+// Run each function as soon as it's published, while the other threads
+// are still compiling and writing to the region, and check its result.
+// It's the only one running them until the compilers are done, so the
+// sources' locals are its own.
+static void bench_reader_main(void* arg) {
+  BenchReader* r = arg;
+  static bool ran[BENCH_CONCURRENT_COMPILES];
+  memset(ran, 0, sizeof(ran));
+  while (r->run < BENCH_CONCURRENT_COMPILES && !__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+    for (int i = 0; i < BENCH_CONCURRENT_COMPILES; ++i) {
+      void (*fn)(void) = ran[i] ? NULL : __atomic_load_n(&r->entries[i], __ATOMIC_ACQUIRE);
+      if (fn) {
+        BenchConcurrentSource* s = &r->sources[i % BENCH_CONCURRENT_SOURCES];
+        *s->a = 0;
+        fn();
+        r->ok &= *s->a == s->expected;
+        ran[i] = true;
+        ++r->run;
+      }
+    }
+  }
+}
+
+// Compile everything in |sources| with |threads| threads, returning the
+// seconds it took, or -1 if one couldn't be compiled or was wrong. With
+// |reader|, that also runs them as they're published, and sets .run.
+static double bench_concurrent_run(BenchConcurrentSource* sources,
+                                   void (**entries)(void),
+                                   int threads,
+                                   bool batched,
+                                   size_t* protections,
+                                   BenchReader* reader) {
+  CodeRegion region;
+  if (!code_region_init(&region, BENCH_CONCURRENT_REGION, false)) {
+    return -1;
+  }
+  memset(entries, 0, BENCH_CONCURRENT_COMPILES * sizeof(*entries));
+  BenchCompiler compilers[32];
+  int started = 0;
+  bool reading = false;
+  if (reader) {
+    *reader = (BenchReader){sources, entries, false, 0, true, {0}};
+    reading = os_start_thread(&reader->thread, bench_reader_main, reader);
+  }
+  double start = os_seconds();
+  for (int t = 0; t < threads; ++t) {
+    BenchCompiler* c = &compilers[t];
+    *c = (BenchCompiler){&region, sources, entries, BENCH_CONCURRENT_COMPILES * t / threads,
+                         BENCH_CONCURRENT_COMPILES * (t + 1) / threads, batched, 0, {0}};
+    started += os_start_thread(&c->thread, bench_compiler_main, c);
+  }
+  *protections = 0;
+  for (int t = 0; t < started; ++t) {
+    os_join_thread(&compilers[t].thread);
+    *protections += compilers[t].protections;
+  }
+  double secs = os_seconds() - start;
+  bool ok = started == threads && (!reader || reading);
+  if (reading) {
+    __atomic_store_n(&reader->done, true, __ATOMIC_RELEASE);
+    os_join_thread(&reader->thread);
+    ok = ok && reader->ok;
+  }
+  for (int i = 0; ok && i < BENCH_CONCURRENT_COMPILES; ++i) {
+    void (*fn)(void) = __atomic_load_n(&entries[i], __ATOMIC_ACQUIRE);
+    BenchConcurrentSource* s = &sources[i % BENCH_CONCURRENT_SOURCES];
+    *s->a = 0;
+    if (fn) {
+      fn();
+    }
+    ok = fn && *s->a == s->expected;
+  }
+  code_region_destroy(&region);
+  return ok ? secs : -1;
+}
+
+static void bench_concurrent_jit(void) {
+  static const int thread_counts[] = {1, 2, 4, 8, 16, 32};
+  jit_natives[0] = (JitNative)native_mix;
+  jit_native_names[0] = "mix";
+  BenchConcurrentSource* sources =
+      os_alloc(BENCH_CONCURRENT_SOURCES * sizeof(BenchConcurrentSource));
+  uint64_t* locals = os_alloc(BENCH_CONCURRENT_SOURCES * (4 << 10));
+  void (**entries)(void) = os_alloc(BENCH_CONCURRENT_COMPILES * sizeof(*entries));
+  InterpStep* steps = os_alloc(INTERP_MAX_STEPS * sizeof(InterpStep));
+  static Intern names;
+  uint8_t slots[INTERN_MAX_NAMES];
+  bool ok = true;
+  for (int i = 0; ok && i < BENCH_CONCURRENT_SOURCES; ++i) {
+    char src[128];
+    bench_source(src, sizeof(src), i);
+    BenchConcurrentSource* s = &sources[i];
+    s->locals = locals + i * (4 << 10) / sizeof(uint64_t);
+    intern_init(&names);
+    s->n = jit_parse_text(src, s->tokens, s->nodes, &names, slots);
+    ok = s->n >= 0 &&
+         interp_prepare(s->nodes, s->n, s->tokens, s->locals, steps, INTERP_MAX_STEPS) >= 0;
+    if (!ok) {
+      break;
+    }
+    bench_set_inputs(s->locals, &names, slots);
+    s->a = text_local(s->locals, &names, slots, "a");
+    interp_run(steps);
+    s->expected = *s->a;
+  }
+
+  size_t protections;
+  double serial =
+      ok ? bench_concurrent_run(sources, entries, 1, false, &protections, NULL) : -1;
+  if (serial < 0) {
+    printf("concurrent jit: WRONG unbatched\n");
+  } else {
+    printf("concurrent jit: %d cpus, 1 thread unbatched %.0f exprs/s, %zu protections\n",
+           os_cpus(), BENCH_CONCURRENT_COMPILES / serial, protections);
+  }
+  double one = 0;
+  for (int t = 0; ok && t < countofi(thread_counts); ++t) {
+    double secs =
+        bench_concurrent_run(sources, entries, thread_counts[t], true, &protections, NULL);
+    if (secs < 0) {
+      printf("concurrent jit %d threads: WRONG\n", thread_counts[t]);
+      continue;
+    }
+    one = t == 0 ? secs : one;
+    printf("concurrent jit %d threads: %.0f exprs/s, %.2fx, %zu protections\n",
+           thread_counts[t], BENCH_CONCURRENT_COMPILES / secs, one / secs, protections);
+  }
+  if (ok) {
+    BenchReader reader;
+    if (bench_concurrent_run(sources, entries, 8, true, &protections, &reader) < 0) {
+      printf("concurrent jit 8 threads and a reader: WRONG\n");
+    } else {
+      printf("concurrent jit 8 threads and a reader: %d of %d run while compiling\n", reader.run,
+             BENCH_CONCURRENT_COMPILES);
+    }
+  }
 
-int main() {
-  // char* code = "a = (b + c + f * g) * (d + 3)";
+  os_release(steps, INTERP_MAX_STEPS * sizeof(InterpStep));
+  os_release(entries, BENCH_CONCURRENT_COMPILES * sizeof(*entries));
+  os_release(locals, BENCH_CONCURRENT_SOURCES * (4 << 10));
+  os_release(sources, BENCH_CONCURRENT_SOURCES * sizeof(BenchConcurrentSource));
+}
+
+// -------------------------------------------------------------------------
+// Snippet counts: a few sources compiled with jit_count_snippets() and run
+// a while, for which snippet variants run most, and what counting costs.
+// -------------------------------------------------------------------------
+
+static void bench_snippet_counts(void) {
+  static const char* const sources[] = {
+      "a = (b + c + f * g) * (d + 3);",
+      "a = 0; for (i = 0; i < 10; i = i + 1) { a = a + i * b; }",
+      "a = 0; i = 0; while (i != g) { a = a + mix(i, f, c); i = i + 1; }",
+      "if (b < c) { a = b + c; } else { a = c * d; } if (a == 5) a = a + 100;",
+  };
+  const int iters = 100000;
+  jit_natives[0] = (JitNative)native_mix;
+  jit_native_names[0] = "mix";
+  uint64_t* locals = os_alloc(64 << 10);
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+  static Intern names;
+  uint8_t slots[INTERN_MAX_NAMES];
+  double secs[2] = {0, 0};
+  uint64_t results[2][countof(sources)];
+  bool ok = true;
+  // Without counting, then with.
+  for (int counted = 0; ok && counted < 2; ++counted) {
+    ok = !counted || jit_count_snippets();
+    for (int s = 0; ok && s < countofi(sources); ++s) {
+      intern_init(&names);
+      memset(locals, 0, 64 << 10);
+      CodeBlock fn = jit_compile_text(&arena, sources[s], locals, &names, slots);
+      if (!fn.code) {
+        ok = false;
+        break;
+      }
+      bench_set_inputs(locals, &names, slots);
+      double start = os_seconds();
+      for (int i = 0; i < iters; ++i) {
+        ((void (*)(void))fn.code)();
+      }
+      secs[counted] += os_seconds() - start;
+      results[counted][s] = *text_local(locals, &names, slots, "a");
+      code_arena_free(&arena, fn);
+    }
+  }
+  ok = ok && memcmp(results[0], results[1], sizeof(results[0])) == 0;
+  if (!ok) {
+    printf("snippet counts: couldn't compile or WRONG\n");
+  } else {
+    printf("snippet counts: %.1f ns per run counted, %.1f ns not, most run:\n",
+           secs[1] * 1e9 / (iters * countof(sources)), secs[0] * 1e9 / (iters * countof(sources)));
+    jit_print_snippet_counts(12);
+  }
+
+  if (jit_snippet_counts) {
+    os_release(jit_snippet_counts, sizeof(JitSnippetCounts));
+    jit_snippet_counts = NULL;
+  }
+  code_arena_destroy(&arena);
+  os_release(locals, 64 << 10);
+}
+
+#include "suite.c"
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+    return suite_main(argc - 2, argv + 2);
+  }
+
+  const char* code = "a = (b + c + f * g) * (d + 3);";
 
   // -------------------------------------------------------------------------
-  // "lex" into |Token|s resulting in |tokens|.
+  // Lex into |Token|s resulting in |tokens|.
   // -------------------------------------------------------------------------
 
-  Token tokens[] = {
-      VAR("a"),     // 0
-      TOK(EQ),      // 1
-      TOK(LPAREN),  // 2
-      VAR("b"),     // 3
-      TOK(PLUS),    // 4
-      VAR("c"),     // 5
-      TOK(PLUS),    // 6
-      VAR("f"),     // 7
-      TOK(TIMES),   // 8
-      VAR("g"),     // 9
-      TOK(RPAREN),  // 10
-      TOK(TIMES),   // 11
-      TOK(LPAREN),  // 12
-      VAR("d"),     // 13
-      TOK(PLUS),    // 14
-      CONST(3),     // 15
-      TOK(RPAREN),  // 16
-      TOK(EOF),     // 17
-  };
-#undef VAR
-#undef TOK
-#undef CONST
+  lex_simd = lex_best_simd();
+  // The letters go first, so that "a" is locals[0] and so on, as the
+  // benches have them.
+  static Intern names;
+  intern_init(&names);
+  for (int i = 0; i < 26; ++i) {
+    intern(&names, &"abcdefghijklmnopqrstuvwxyz"[i], 1);
+  }
+  Token tokens[32];
+  int num_tokens = lex(code, tokens, countofi(tokens), &names);
+  if (num_tokens < 0) {
+    printf("Couldn't lex \"%s\".\n", code);
+    return 1;
+  }
 
   printf("tokens:\n-------\n");
-  for (int i = 0; i < countofi(tokens); ++i) {
+  for (int i = 0; i < num_tokens; ++i) {
     TokenKind kind = tokens[i] & 0xff;
     printf("%02d: %s", i, token_names[kind]);
     if (kind == TK_IDENT) {
-      printf(" '%c'\n", (int)(tokens[i] >> 8));
+      const InternName* name = &names.names[tokens[i] >> 8];
+      printf(" '%.*s'\n", (int)name->len, name->at);
     } else if (kind == TK_CONST) {
       printf(" %d\n", (int)(tokens[i] >> 8));
     } else {
@@ -156,7 +3793,7 @@ int main() {
   }
 
   // -------------------------------------------------------------------------
-  // "parse" into |Ast|s resulting in |nodes|.
+  // Parse into |Ast|s resulting in |nodes|.
   // -------------------------------------------------------------------------
   //           =
   //          / \
@@ -175,29 +3812,21 @@ int main() {
   // needed, the other one is implicitly the entry immediately preceding
   // it.
 
-  Ast nodes[] = {
-      UNARYOP_LVAL(NAME, 0),  // a
-      UNARYOP(NAME, 3),       // b
-      UNARYOP(NAME, 5),       // c
-      BINOP(ADD, 2),          // +
-      UNARYOP(NAME, 7),       // f
-      UNARYOP(NAME, 9),       // g
-      BINOP(MUL, 2),          // *
-      BINOP(ADD, 4),          // +
-      UNARYOP(NAME, 13),      // d
-      UNARYOP(CONST, 15),     // 3
-      BINOP(ADD, 2),          // +
-      BINOP(MUL, 4),          // *
-      BINOP(ASSIGN, 12),      // =
-  };
+  Ast nodes[32];
+  int num_nodes = parse(tokens, &names, nodes, countofi(nodes), NULL, 0);
+  if (num_nodes < 0) {
+    printf("Couldn't parse \"%s\".\n", code);
+    return 1;
+  }
 
   printf("\nast:\n----\n");
-  for (int i = 0; i < countofi(nodes); ++i) {
+  for (int i = 0; i < num_nodes; ++i) {
     AstKind kind = nodes[i] & 0x7f;
     bool lval = (bool)(nodes[i] & 0x80);
     printf("%02d: %s%s", i, ast_names[kind], lval ? " (lval)" : "");
     if (kind == AST_NAME) {
-      printf(" '%c'\n", (int)(tokens[(int)nodes[i] >> 8] >> 8));
+      const InternName* name = &names.names[tokens[(int)nodes[i] >> 8] >> 8];
+      printf(" '%.*s'\n", (int)name->len, name->at);
     } else if (kind == AST_CONST) {
       printf(" %d\n", (int)(tokens[(int)nodes[i] >> 8] >> 8));
     } else {
@@ -232,19 +3861,31 @@ int main() {
   // appears to support an arbitrary number and deals with them on the
   // stack (at least when I tested up to about 25 arguments).
   //
-  // The snippets also only support uintptr_t and int (i.e. only integer
-  // registers). It should just be a matter of generating a lot more
-  // possibilities and maintaining
-
-  // Create two 64k blobs of memory to hold the code we're about to
-  // generate, and to hold the named stack variables.
-  unsigned char* locals_and_code =
-      VirtualAlloc(NULL, 128 << 10, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-  unsigned char* code_seg = locals_and_code;
-  int* locals = (int*)(locals_and_code + (64 << 10));
-  unsigned char* code_p = code_seg;
-
-#define BYTE_OFFSET_OF_LOCAL(name) ((uintptr_t) & locals[(name[0] - 'a')])
+  // jit_compile() only handles int locals, but jit_compile_typed() (see
+  // bench_typed()) also has i64, f32 and f64 ones. The floats are passed
+  // in xmm registers, which ghccc assigns separately from the general
+  // purpose ones, so the snippets are generated for every combination of
+  // ints and floats beneath the operands, and a mixed vstack never needs
+  // shuffling between the two.
+
+  jit_simd = jit_best_simd();
+  // So that `CNP_PERF_MAP=1 perf record ./cnp bench` can name what it
+  // samples in the arenas.
+  if (getenv("CNP_PERF_MAP")) {
+    jit_perf_map = os_open_perf_map();
+  }
+
+  // The code we're about to generate goes in a CodeArena, and the named
+  // stack variables in a separate 64k blob that's never executable.
+  CodeArena arena;
+  if (!code_arena_init(&arena, 1 << 30, false)) {
+    printf("\nCouldn't reserve the code arena.\n");
+    return 1;
+  }
+  uint64_t* locals = os_alloc(64 << 10);
+
+#define BYTE_OFFSET_OF_LOCAL(name) \
+  ((uintptr_t) & locals[intern_find(&names, name, (uint32_t)strlen(name))])
   // "a" is at locals_stack[0], etc.
   *(int*)BYTE_OFFSET_OF_LOCAL("a") = 0x1111;  // uninitialized
   *(int*)BYTE_OFFSET_OF_LOCAL("b") = 2;
@@ -286,65 +3927,76 @@ int main() {
   // all the snippets) against the possibility of generating code ~as
   // good as clang -O3 if it matches a prebuilt snippet.
 
-  code_p = load_addr_0_fallthrough(code_p, BYTE_OFFSET_OF_LOCAL("a"));
-  // vstack now [&a                ]  0 NAME 'a'
-
-  code_p = load_1_fallthrough(code_p, BYTE_OFFSET_OF_LOCAL("b"));
-  // vstack now [b &a              ]  1 NAME 'b'
-
-  code_p = load_2_fallthrough(code_p, BYTE_OFFSET_OF_LOCAL("c"));
-  // vstack now [c b &a            ]  2 NAME 'c'
-
-  code_p = add_1_fallthrough(code_p);
-  // vstack now [r0 &a             ]  3 ADD
-
-  code_p = load_2_fallthrough(code_p, BYTE_OFFSET_OF_LOCAL("f"));
-  // vstack now [f r0 &a           ]  4 NAME 'f'
-
-  code_p = load_3_fallthrough(code_p, BYTE_OFFSET_OF_LOCAL("g"));
-  // vstack now [g f r0 &a         ]  5 NAME 'g'
-
-  code_p = mul_2_fallthrough(code_p);
-  // vstack now [r1 r0 &a          ]  6 MUL
-
-  code_p = add_1_fallthrough(code_p);
-  // vstack now [r2 &a             ]  7 ADD
-
-  code_p = load_2_fallthrough(code_p, BYTE_OFFSET_OF_LOCAL("d"));
-  // vstack now [d r2 &a           ]  8 NAME 'd'
-
-  code_p = const_3_fallthrough(code_p, 3);
-  // vstack now [3 d r2 &a         ]  9 CONST 3
-
-  code_p = add_2_fallthrough(code_p);
-  // vstack now [r3 r2 &a          ] 10 ADD
-
-  code_p = mul_1_fallthrough(code_p);
-  // vstack now [r4 &a             ] 11 MUL
-
-  code_p = assign_indirect_0_fallthrough(code_p);
-  // vstack now [                  ] 12 ASSIGN
+  // jit_compile() does that walk, picking the variants through the
+  // ast_snippets table. After a stack_frame_0 that points
+  // $stack at the frame (where anything deeper than
+  // SNIPPET_MAX_SAVED_REGS would be spilled), one node at a time this
+  // example is:
+  //
+  //   load_addr_0   vstack now [&a                ]  0 NAME 'a'
+  //   load_1        vstack now [b &a              ]  1 NAME 'b'
+  //   load_2        vstack now [c b &a            ]  2 NAME 'c'
+  //   add_1         vstack now [r0 &a             ]  3 ADD
+  //   load_2        vstack now [f r0 &a           ]  4 NAME 'f'
+  //   load_3        vstack now [g f r0 &a         ]  5 NAME 'g'
+  //   mul_2         vstack now [r1 r0 &a          ]  6 MUL
+  //   add_1         vstack now [r2 &a             ]  7 ADD
+  //   load_2        vstack now [d r2 &a           ]  8 NAME 'd'
+  //   const_3       vstack now [3 d r2 &a         ]  9 CONST 3
+  //   add_2         vstack now [r3 r2 &a          ] 10 ADD
+  //   mul_1         vstack now [r4 &a             ] 11 MUL
+  //   assign_ind_0  vstack now [                  ] 12 ASSIGN
+  //
+  // but with the fused snippets from clang_rip.py's FUSED_PATTERNS it
+  // becomes just:
+  //
+  //   load_addr_0               vstack now [&a          ]  0
+  //   load_load_add_1           vstack now [r0 &a       ]  1-3
+  //   load_load_mul_add_1       vstack now [r2 &a       ]  4-7
+  //   load_const_add_imm8_2     vstack now [r3 r2 &a    ]  8-10
+  //   mul_assign_indirect_0     vstack now [            ] 11-12
+  //
+  // where the 3 is never on the vstack, it's the imm8 of an `add`.
 
-  // Just for testing so we can `call` to the code we just generated.
-  // Normally this would be inside of a large setup that could provide a
-  // top-level continuation that would receive the result, or be inside
-  // a normal __cdecl function that had set up locals, etc. could do a
-  // real `ret` to the caller.
-  *code_p++ = 0xc3;  // ret
+  CodeBlock fn = jit_compile_function(&arena, nodes, num_nodes, tokens, locals);
+  if (!fn.code) {
+    printf("\nExpression too deep to compile.\n");
+    return 1;
+  }
 
-  printf("\nGenerated %zu bytes of code, executing.\n", code_p - code_seg);
+  printf("\nGenerated %u bytes of code, executing.\n", fn.size);
 
 #if 0
   FILE* f = fopen("code.raw", "wb");
-  fwrite(code_seg, 1, code_p - code_seg, f);
+  fwrite(fn.code, 1, fn.size, f);
   fclose(f);
   // `ndisasm -b64 code.raw`
 #endif
 
-  DWORD old_protect;
-  VirtualProtect(code_seg, 64 << 10, PAGE_EXECUTE_READ, &old_protect);
-  VirtualProtect(locals, 64 << 10, PAGE_READWRITE, &old_protect);
-  ((void (*)())code_seg)();
+  ((void (*)(void))fn.code)();
 
-  printf("\nFinal value of 'a': %d\n", locals[0]);
+  printf("\nFinal value of 'a': %d\n", (int)locals[0]);
+
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    printf("\n");
+    bench_snippet_styles();
+    bench_jit_compile(nodes, num_nodes, tokens);
+    bench_deep_expression();
+    bench_code_arena(false);
+    bench_code_arena(true);
+    bench_block_bounds();
+    bench_batch(nodes, num_nodes, tokens);
+    bench_typed(nodes, num_nodes, tokens);
+    bench_branches();
+    bench_loops();
+    bench_natives();
+    bench_liveness();
+    bench_lex();
+    bench_text();
+    bench_fold();
+    bench_code_cache();
+    bench_tiers();
+    bench_concurrent_jit();
+    bench_snippet_counts();
+  }
 }
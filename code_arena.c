@@ -0,0 +1,275 @@
+// An arena for jitted code, included by cnp.c.
+//
+// One large range is reserved up front and committed as it's used.
+// Committed pages are kept execute/read except while a block in them is
+// being written, so no page is ever writable and executable at once.
+// Optionally (on Linux) that's in 2 MiB pages, for fewer iTLB misses
+// once there's a lot of code.
+// Blocks are power of two size classes, each with a free list, so freed
+// functions are reused by later ones of about the same size. None of the
+// bookkeeping is stored in the code pages themselves.
+//
+// A block's pages aren't executable between code_arena_alloc() and
+// code_arena_seal(), including whatever else shares those pages, so
+// nothing in the arena can run while a function is being written.
+//
+// An arena is only for one thread. Threads that compile at the same time
+// each have their own, all in one CodeRegion, which hands out chunks of
+// it with an atomic bump so that no two arenas ever share a page. Code
+// that one thread publishes can be run by any other, as long as nothing
+// stops it being executable, so a shared arena puts each block on pages
+// of its own, or better, each batch (see code_arena_begin_batch()).
+
+#include <stdlib.h>
+
+#define CODE_ARENA_COMMIT_SIZE (64 << 10)
+#define CODE_ARENA_MIN_CLASS 6   // 64 bytes
+#define CODE_ARENA_MAX_CLASS 20  // 1 MiB
+#define CODE_ARENA_CLASSES (CODE_ARENA_MAX_CLASS - CODE_ARENA_MIN_CLASS + 1)
+// What a CodeRegion hands out to an arena at a time, at least the biggest
+// class and a multiple of any page size.
+#define CODE_REGION_CHUNK_SIZE (2 << 20)
+
+typedef struct CodeBlock {
+  unsigned char* code;
+  uint32_t size;  // As requested, the block is the next size class up.
+} CodeBlock;
+
+typedef struct CodeArenaFreeList {
+  uint32_t* offsets;
+  int count;
+  int capacity;
+} CodeArenaFreeList;
+
+// A reserved range shared by the arenas of many threads, see
+// code_arena_init_shared().
+typedef struct CodeRegion {
+  unsigned char* base;
+  size_t reserved;
+  size_t page_size;
+  size_t top;  // How much has been handed out, atomically.
+} CodeRegion;
+
+typedef struct CodeArena {
+  unsigned char* base;
+  size_t reserved;
+  size_t page_size;    // What's protected in, from os_reserve().
+  size_t commit_size;  // What's committed in, a multiple of that.
+  size_t committed;
+  size_t top;  // Bump allocation for when the free list is empty,
+  size_t end;  // up to the end of its chunk of |region|, or |reserved|,
+  size_t commit_end;  // of which this much is committed.
+  CodeRegion* region;  // NULL if it reserved |base| itself.
+  // Where the batch started, see code_arena_begin_batch(), if |batching|.
+  size_t batch_begin;
+  bool batching;
+  CodeArenaFreeList free[CODE_ARENA_CLASSES];
+  size_t live_bytes;     // Sum of the live blocks' requested sizes.
+  size_t free_bytes;     // Sum of blocks on the free lists.
+  uint64_t protections;  // os_protect() calls, i.e. W^X flips.
+} CodeArena;
+
+typedef struct CodeArenaStats {
+  size_t page_size;
+  size_t committed;
+  size_t live_bytes;
+  size_t free_bytes;
+  // Fraction of the allocated part of the arena that isn't live code,
+  // i.e. free blocks and rounding up to size classes.
+  double fragmentation;
+  uint64_t protections;
+} CodeArenaStats;
+
+// |reserve| should be a multiple of 2 MiB for |huge_pages|, which is only
+// a request and can fall back to normal pages.
+static bool code_arena_init(CodeArena* arena, size_t reserve, bool huge_pages) {
+  memset(arena, 0, sizeof(*arena));
+  arena->base = os_reserve(reserve, huge_pages, &arena->page_size);
+  arena->reserved = arena->end = reserve;
+  arena->commit_size = max((size_t)CODE_ARENA_COMMIT_SIZE, arena->page_size);
+  return arena->base != NULL;
+}
+
+// |reserve| is at most 4 GiB, as for an arena, and it's shared by threads
+// once code_arena_init_shared() has set up each one's arena with it.
+static bool code_region_init(CodeRegion* region, size_t reserve, bool huge_pages) {
+  memset(region, 0, sizeof(*region));
+  region->base = os_reserve(reserve, huge_pages, &region->page_size);
+  region->reserved = reserve;
+  return region->base != NULL;
+}
+
+// Once all of its arenas have been destroyed.
+static void code_region_destroy(CodeRegion* region) {
+  os_release(region->base, region->reserved);
+  memset(region, 0, sizeof(*region));
+}
+
+// An arena that allocates from chunks of |region|, taken as it needs
+// them, rather than reserving its own range.
+static void code_arena_init_shared(CodeArena* arena, CodeRegion* region) {
+  memset(arena, 0, sizeof(*arena));
+  arena->base = region->base;
+  arena->reserved = region->reserved;
+  arena->page_size = region->page_size;
+  arena->commit_size = max((size_t)CODE_ARENA_COMMIT_SIZE, arena->page_size);
+  arena->region = region;
+}
+
+static void code_arena_destroy(CodeArena* arena) {
+  if (!arena->region) {
+    os_release(arena->base, arena->reserved);
+  }
+  for (int i = 0; i < CODE_ARENA_CLASSES; ++i) {
+    free(arena->free[i].offsets);
+  }
+  memset(arena, 0, sizeof(*arena));
+}
+
+// The size class for |size| bytes, or -1 if it's too big.
+static int code_arena_class(size_t size) {
+  int c = CODE_ARENA_MIN_CLASS;
+  while (((size_t)1 << c) < size) {
+    if (++c > CODE_ARENA_MAX_CLASS) {
+      return -1;
+    }
+  }
+  return c - CODE_ARENA_MIN_CLASS;
+}
+
+static void code_arena_protect(CodeArena* arena, unsigned char* p, size_t n, OsProtect protect) {
+  uintptr_t mask = arena->page_size - 1;
+  uintptr_t start = (uintptr_t)p & ~mask;
+  uintptr_t end = ((uintptr_t)p + n + mask) & ~mask;
+  os_protect((void*)start, end - start, protect);
+  ++arena->protections;
+}
+
+static void code_arena_free(CodeArena* arena, CodeBlock block) {
+  int c = code_arena_class(block.size);
+  CodeArenaFreeList* list = &arena->free[c];
+  if (list->count == list->capacity) {
+    list->capacity = max(16, list->capacity * 2);
+    list->offsets = realloc(list->offsets, list->capacity * sizeof(uint32_t));
+  }
+  list->offsets[list->count++] = (uint32_t)(block.code - arena->base);
+  arena->live_bytes -= block.size;
+  arena->free_bytes += (size_t)1 << (c + CODE_ARENA_MIN_CLASS);
+}
+
+// Move |arena| to a new chunk of its region, for code_arena_alloc(). The
+// rest of the one it was in is left unused.
+static bool code_arena_next_chunk(CodeArena* arena) {
+  if (!arena->region) {
+    return false;
+  }
+  size_t chunk = __atomic_fetch_add(&arena->region->top, CODE_REGION_CHUNK_SIZE, __ATOMIC_RELAXED);
+  if (chunk + CODE_REGION_CHUNK_SIZE > arena->reserved) {
+    return false;
+  }
+  if (arena->batching && arena->batch_begin < arena->commit_end) {
+    // The batch so far is as written as it'll be, see
+    // code_arena_end_batch().
+    code_arena_protect(arena, arena->base + arena->batch_begin,
+                       arena->commit_end - arena->batch_begin, OS_EXECUTE_READ);
+    os_flush_icache(arena->base + arena->batch_begin, arena->top - arena->batch_begin);
+  }
+  arena->batch_begin = arena->top = arena->commit_end = chunk;
+  arena->end = chunk + CODE_REGION_CHUNK_SIZE;
+  return true;
+}
+
+// A block of at least |size| bytes that's writable until it's passed to
+// code_arena_seal(), or one with a NULL .code if the arena is full. In a
+// shared arena, one that isn't in a batch takes at least a page.
+static CodeBlock code_arena_alloc(CodeArena* arena, size_t size) {
+  CodeBlock block = {NULL, (uint32_t)size};
+  int c = code_arena_class(size);
+  if (c < 0) {
+    return block;
+  }
+  size_t class_size = (size_t)1 << (c + CODE_ARENA_MIN_CLASS);
+  CodeArenaFreeList* list = &arena->free[c];
+  // A batch only has pages of its own, and so does each block of a shared
+  // arena, whose other pages other threads could be running.
+  if (list->count > 0 && !arena->batching && !arena->region) {
+    block.code = arena->base + list->offsets[--list->count];
+    arena->free_bytes -= class_size;
+  } else {
+    if (arena->region && !arena->batching) {
+      size_t mask = arena->page_size - 1;
+      size_t top = (arena->top + mask) & ~mask;
+      arena->top = top < arena->end ? top : arena->end;
+    }
+    // Every class is a multiple of the smallest, so top stays aligned.
+    if (arena->top + class_size > arena->end && !code_arena_next_chunk(arena)) {
+      return block;
+    }
+    size_t offset = arena->top;
+    OsProtect protect = arena->batching ? OS_READWRITE : OS_EXECUTE_READ;
+    while (offset + class_size > arena->commit_end) {
+      if (!os_commit(arena->base + arena->commit_end, arena->commit_size, protect)) {
+        return block;
+      }
+      arena->commit_end += arena->commit_size;
+      arena->committed += arena->commit_size;
+    }
+    block.code = arena->base + offset;
+    arena->top = offset + class_size;
+  }
+  arena->live_bytes += size;
+  if (!arena->batching) {
+    code_arena_protect(arena, block.code, size, OS_READWRITE);
+  }
+  return block;
+}
+
+// Make |block| executable once it's written, or in a batch, once the
+// batch is done.
+static void code_arena_seal(CodeArena* arena, CodeBlock block) {
+  if (arena->batching) {
+    return;
+  }
+  code_arena_protect(arena, block.code, block.size, OS_EXECUTE_READ);
+  os_flush_icache(block.code, block.size);
+}
+
+// Start a batch of blocks that are all writable until
+// code_arena_end_batch(), and only then made executable, with a single
+// protection change and flush for all of them rather than two changes
+// and a flush for each. They go on pages of their own, so that nothing
+// already in the arena, which other threads could be running, stops
+// being executable while they're written. That's what's left of a page
+// when the batch starts, and it's only worth it for several blocks.
+static void code_arena_begin_batch(CodeArena* arena) {
+  size_t mask = arena->page_size - 1;
+  size_t top = (arena->top + mask) & ~mask;
+  arena->top = top < arena->end ? top : arena->end;
+  if (arena->top < arena->commit_end) {
+    code_arena_protect(arena, arena->base + arena->top, arena->commit_end - arena->top,
+                       OS_READWRITE);
+  }
+  arena->batch_begin = arena->top;
+  arena->batching = true;
+}
+
+// Make the blocks since code_arena_begin_batch() executable. None of them
+// can be run before this.
+static void code_arena_end_batch(CodeArena* arena) {
+  arena->batching = false;
+  if (arena->batch_begin < arena->commit_end) {
+    code_arena_protect(arena, arena->base + arena->batch_begin,
+                       arena->commit_end - arena->batch_begin, OS_EXECUTE_READ);
+    os_flush_icache(arena->base + arena->batch_begin, arena->top - arena->batch_begin);
+  }
+}
+
+static CodeArenaStats code_arena_stats(const CodeArena* arena) {
+  CodeArenaStats stats = {arena->page_size,  arena->committed, arena->live_bytes,
+                          arena->free_bytes, 0.0,              arena->protections};
+  // A shared arena's top is only where it is in its region.
+  if (arena->top && !arena->region) {
+    stats.fragmentation = 1.0 - (double)arena->live_bytes / (double)arena->top;
+  }
+  return stats;
+}
@@ -0,0 +1,542 @@
+// A cache on disk of the functions that code_cache_compile_text()
+// compiles, included by cnp.c, so that a process that compiles the same
+// sources as the last one can skip lexing, parsing and stitching.
+//
+// Each function's body is kept as it was compiled into jit_window, along
+// with where in it there's the address of a local or a native, as an
+// ADDR64 or a REL32 from the code. Loading one is then a copy into the
+// arena and a pass over those relocs for where the locals, the natives
+// and the code are now. They're found by compiling the body again with
+// each of those moved and seeing which bytes change, and anything else
+// that changes (which nothing should) means that it isn't cached.
+//
+// The file is a CodeCacheHeader, an index sorted by key, and then the
+// entries, each a CodeCacheEntry followed by its body, relocs and names.
+// It's mapped when the cache is opened, and rewritten with what's been
+// added when it's closed.
+//
+// A cache is only for one thread, and since a miss moves jit_natives
+// while it compiles, nothing else can be compiling while one is used.
+
+#include <stdlib.h>
+
+#define CODE_CACHE_MAGIC 0x3145484341434e43ull  // "CNCACHE1"
+// How much can be added in one process.
+#define CODE_CACHE_MAX_ADDED_BYTES (64 << 20)
+#define CODE_CACHE_MAX_ADDED (1 << 16)
+// A reloc's native when it's the locals.
+#define CODE_CACHE_LOCALS 0xffff
+// In CodeCache.base_of, for a byte that isn't of any reloc.
+#define CODE_CACHE_NO_BASE 0xfffe
+// How far code_cache_add() moves things, which changes every byte of a
+// REL32 of them and the first four of an ADDR64, and is near enough that
+// a REL32 still reaches.
+#define CODE_CACHE_MOVE 0x01010101u
+
+typedef struct CodeCacheHeader {
+  uint64_t magic;
+  uint64_t build;  // See code_cache_build().
+  uint32_t count;
+  uint32_t unused;
+} CodeCacheHeader;
+
+typedef struct CodeCacheIndex {
+  uint64_t key;     // See code_cache_key().
+  uint64_t offset;  // Of the entry, in the file or in CodeCache.added.
+} CodeCacheIndex;
+
+typedef struct CodeCacheEntry {
+  uint64_t code_at;  // Where the body was compiled to.
+  uint32_t size;     // Of the body, which is padded to 8 bytes.
+  uint16_t num_relocs;
+  uint16_t num_names;
+} CodeCacheEntry;
+
+typedef struct CodeCacheReloc {
+  uint64_t base;    // The address of the locals or native it was compiled for.
+  uint32_t offset;  // In the body.
+  uint16_t native;  // Which native, or CODE_CACHE_LOCALS.
+  uint8_t rel32;    // Whether it's a REL32 rather than an ADDR64.
+  uint8_t unused;
+} CodeCacheReloc;
+
+// A name that the function's locals were laid out for, and its slot.
+typedef struct CodeCacheName {
+  uint32_t at;  // Its offset in the source, or index if it was interned before.
+  uint16_t len;
+  uint8_t slot;
+  uint8_t interned;  // Whether it was in the names before the source was lexed.
+} CodeCacheName;
+
+typedef struct CodeCache {
+  const unsigned char* file;  // Mapped, or NULL.
+  size_t file_size;
+  const CodeCacheIndex* index;  // In |file|.
+  int count;
+  // The entries compiled since it was opened, laid out as in the file,
+  // and their index, in the order they were added.
+  unsigned char* added;
+  size_t added_size;
+  CodeCacheIndex* added_index;
+  int num_added;
+  // For code_cache_add(): the body compiled somewhere else, and which
+  // native (or CODE_CACHE_LOCALS) each of its bytes changes with, if any.
+  unsigned char* moved;
+  uint16_t* base_of;
+  int hits;
+  int misses;
+  int uncached;  // Misses that couldn't be added.
+} CodeCache;
+
+static uint64_t code_cache_hash(uint64_t h, const void* p, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    h = (h ^ ((const unsigned char*)p)[i]) * 0x100000001b3u;
+  }
+  return h;
+}
+
+// Another build could have other snippets, so it can't use the file.
+static uint64_t code_cache_build(void) {
+  static const char build[] = __DATE__ " " __TIME__;
+  return code_cache_hash(0xcbf29ce484222325u, build, sizeof(build));
+}
+
+// What the code compiled from |src| depends on: it, the names that are
+// already interned (and whether they're shared), the natives' names, and
+// the JIT's settings.
+static uint64_t code_cache_key(const char* src, const Intern* names) {
+  uint64_t h = code_cache_hash(0xcbf29ce484222325u, src, strlen(src) + 1);
+  for (int i = 0; i < names->count; ++i) {
+    const InternName* name = &names->names[i];
+    h = code_cache_hash(h, &name->len, sizeof(name->len));
+    h = code_cache_hash(h, name->at, name->len);
+    h = code_cache_hash(h, &name->shared, sizeof(name->shared));
+  }
+  for (int i = 0; i < JIT_MAX_NATIVES; ++i) {
+    if (jit_native_names[i]) {
+      h = code_cache_hash(h, &i, sizeof(i));
+      h = code_cache_hash(h, jit_native_names[i], strlen(jit_native_names[i]) + 1);
+    }
+  }
+  int settings[] = {jit_fuse_patterns, jit_hoist_loads, jit_reuse_loads, jit_fold_nodes,
+                    jit_vstack_regs};
+  return code_cache_hash(h, settings, sizeof(settings));
+}
+
+static const CodeCacheReloc* code_cache_relocs(const CodeCacheEntry* entry) {
+  return (const CodeCacheReloc*)((const unsigned char*)(entry + 1) + (entry->size + 7) / 8 * 8);
+}
+
+static const CodeCacheName* code_cache_names(const CodeCacheEntry* entry) {
+  return (const CodeCacheName*)(code_cache_relocs(entry) + entry->num_relocs);
+}
+
+static size_t code_cache_entry_size(const CodeCacheEntry* entry) {
+  return (size_t)((const unsigned char*)(code_cache_names(entry) + entry->num_names) -
+                  (const unsigned char*)entry);
+}
+
+// Map the cache at |path| if there is one (from this build), to add to
+// it. Returns false if there isn't the memory for that.
+static bool code_cache_open(CodeCache* cache, const char* path) {
+  memset(cache, 0, sizeof(*cache));
+  cache->added = os_alloc(CODE_CACHE_MAX_ADDED_BYTES);
+  cache->added_index = os_alloc(CODE_CACHE_MAX_ADDED * sizeof(CodeCacheIndex));
+  cache->moved = os_alloc(JIT_WINDOW_SIZE + JIT_WINDOW_SIZE / 2 * sizeof(uint16_t));
+  if (!cache->added || !cache->added_index || !cache->moved) {
+    return false;
+  }
+  cache->base_of = (uint16_t*)(cache->moved + JIT_WINDOW_SIZE);
+  size_t size = 0;
+  const unsigned char* file = os_map_file(path, &size);
+  if (!file) {
+    return true;
+  }
+  const CodeCacheHeader* header = (const CodeCacheHeader*)file;
+  if (size < sizeof(*header) || header->magic != CODE_CACHE_MAGIC ||
+      header->build != code_cache_build() ||
+      (size - sizeof(*header)) / sizeof(CodeCacheIndex) < header->count) {
+    os_unmap_file(file, size);
+    return true;
+  }
+  cache->file = file;
+  cache->file_size = size;
+  cache->index = (const CodeCacheIndex*)(header + 1);
+  cache->count = (int)header->count;
+  return true;
+}
+
+static const CodeCacheEntry* code_cache_find(const CodeCache* cache, uint64_t key) {
+  int lo = 0, hi = cache->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (cache->index[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == cache->count || cache->index[lo].key != key ||
+      cache->index[lo].offset > cache->file_size - sizeof(CodeCacheEntry)) {
+    return NULL;
+  }
+  // Its body, relocs and names have to be in the file too.
+  const CodeCacheEntry* entry = (const CodeCacheEntry*)(cache->file + cache->index[lo].offset);
+  size_t left = cache->file_size - cache->index[lo].offset - sizeof(*entry);
+  size_t size = ((size_t)entry->size + 7) / 8 * 8 + entry->num_relocs * sizeof(CodeCacheReloc) +
+                entry->num_names * sizeof(CodeCacheName);
+  return size <= left ? entry : NULL;
+}
+
+// Whether |entry|'s relocs are in its body and for locals or a native,
+// and its names are in |src| or of the first |interned| names, for
+// slots of the locals. The file needn't be one that code_cache_close()
+// wrote, so none of that is taken on trust.
+static bool code_cache_entry_ok(const CodeCacheEntry* entry, const char* src, int interned) {
+  const CodeCacheReloc* relocs = code_cache_relocs(entry);
+  for (int i = 0; i < entry->num_relocs; ++i) {
+    const CodeCacheReloc* reloc = &relocs[i];
+    if ((size_t)reloc->offset + (reloc->rel32 ? 4 : 8) > entry->size ||
+        (reloc->native >= JIT_MAX_NATIVES && reloc->native != CODE_CACHE_LOCALS)) {
+      return false;
+    }
+  }
+  size_t src_len = strlen(src);
+  const CodeCacheName* names = code_cache_names(entry);
+  for (int i = 0; i < entry->num_names; ++i) {
+    const CodeCacheName* name = &names[i];
+    if (name->slot >= FRAME_LOCALS ||
+        (name->interned ? name->at >= (uint32_t)interned
+                        : name->at > src_len || name->len > src_len - name->at)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// |entry| (for |src|) copied into a new block in |arena| and relocated
+// for |locals| and jit_natives as they are now, with names and slots as
+// jit_compile_text() sets them. .code is NULL if a REL32 can't reach, or
+// |entry| isn't one that code_cache_add() could have made for |src|.
+static CodeBlock code_cache_load(const CodeCacheEntry* entry,
+                                 const char* src,
+                                 CodeArena* arena,
+                                 uint64_t* locals,
+                                 Intern* names,
+                                 uint8_t* slots) {
+  CodeBlock block = {NULL, 0};
+  if (!code_cache_entry_ok(entry, src, names->count)) {
+    return block;
+  }
+  memset(slots, FRAME_NO_SLOT, names->count);
+  const CodeCacheName* entry_names = code_cache_names(entry);
+  for (int i = 0; i < entry->num_names; ++i) {
+    const CodeCacheName* name = &entry_names[i];
+    int index = name->interned ? (int)name->at : intern(names, src + name->at, name->len);
+    if (index < 0) {
+      return block;
+    }
+    slots[index] = name->slot;
+  }
+
+  size_t entry_size = sizeof(c_entry_0_code);
+  block = code_arena_alloc(arena, entry_size + entry->size + 1);
+  if (!block.code) {
+    return block;
+  }
+  unsigned char* body = block.code + entry_size;
+  c_entry_0(block.code, body);
+  memcpy(body, entry + 1, entry->size);
+  body[entry->size] = 0xc3;  // ret, as in jit_compile_any_function().
+  const CodeCacheReloc* relocs = code_cache_relocs(entry);
+  for (int i = 0; i < entry->num_relocs; ++i) {
+    const CodeCacheReloc* reloc = &relocs[i];
+    uint64_t base = reloc->native == CODE_CACHE_LOCALS ? (uintptr_t)locals
+                                                       : (uintptr_t)jit_natives[reloc->native];
+    unsigned char* at = body + reloc->offset;
+    if (!reloc->rel32) {
+      uint64_t addr;
+      memcpy(&addr, at, sizeof(addr));
+      addr += base - reloc->base;
+      memcpy(at, &addr, sizeof(addr));
+      continue;
+    }
+    // jit_window needn't be near the locals and natives, so the REL32s
+    // compiled there may have wrapped, but they're right modulo 2^32.
+    // It's |body| that has to be in reach of them, and of the rest of the
+    // frame, which with the body is well under 1 MiB.
+    int64_t reach = (int64_t)(base - (uintptr_t)body);
+    if (reach < INT32_MIN + (1 << 20) || reach > INT32_MAX - (1 << 20)) {
+      code_arena_free(arena, block);
+      return (CodeBlock){NULL, 0};
+    }
+    uint32_t rel;
+    memcpy(&rel, at, sizeof(rel));
+    rel += (uint32_t)(base - reloc->base) - (uint32_t)((uintptr_t)body - entry->code_at);
+    memcpy(at, &rel, sizeof(rel));
+  }
+  code_arena_seal(arena, block);
+  jit_perf_map_add(block, "cached");
+  return block;
+}
+
+// |src| compiled into jit_window at |at|, and copied to |out| unless
+// that's NULL. Returns the size, or -1 if it didn't compile or wrapped.
+static int code_cache_compile_at(const JitSource* src, unsigned char* at, unsigned char* out) {
+  jit_wrapped = 0;
+  unsigned char* end = jit_compile_source(src, at);
+  if (!end || jit_wrapped) {
+    return -1;
+  }
+  if (out) {
+    memcpy(out, at, (size_t)(end - at));
+  }
+  return (int)(end - at);
+}
+
+// Find the relocs of |base| in |entry|'s body, by compiling it at |at|
+// from |src|, where |base| is CODE_CACHE_MOVE further on: an ADDR64 is
+// that much more, and so is a REL32 (which also changes with where the
+// code is, as in cache->moved), and each of their bytes is marked as
+// theirs in cache->base_of. Returns false if the size is different, or a
+// byte changes any other way.
+static bool code_cache_mark(CodeCache* cache,
+                            CodeCacheEntry* entry,
+                            const JitSource* src,
+                            unsigned char* at,
+                            uint16_t base,
+                            uint64_t base_addr) {
+  const unsigned char* body = (const unsigned char*)(entry + 1);
+  int size = (int)entry->size;
+  if (code_cache_compile_at(src, at, NULL) != size) {
+    return false;
+  }
+  CodeCacheReloc* relocs = (CodeCacheReloc*)code_cache_relocs(entry);
+  for (int i = 0; i < size;) {
+    if (at[i] == body[i]) {
+      ++i;
+      continue;
+    }
+    bool rel32 = cache->moved[i] != body[i];
+    int len = rel32 ? 4 : 8;
+    uint64_t was = 0, now = 0;
+    if (i + len > size) {
+      return false;
+    }
+    memcpy(&was, body + i, len);
+    memcpy(&now, at + i, len);
+    if ((rel32 ? (uint32_t)(now - was) : now - was) != CODE_CACHE_MOVE) {
+      return false;
+    }
+    for (int j = i; j < i + len; ++j) {
+      if (cache->base_of[j] != CODE_CACHE_NO_BASE) {
+        return false;
+      }
+      cache->base_of[j] = base;
+    }
+    relocs[entry->num_relocs++] = (CodeCacheReloc){base_addr, (uint32_t)i, base, rel32, 0};
+    i += len;
+  }
+  return true;
+}
+
+// Add the function compiled from |src| (the |n| |nodes| with |tokens|,
+// for |locals|) to |cache| as |key|, with the names that its locals were
+// laid out for, of which the first |interned| were there before.
+// Returns false if it's too big (for half of jit_window, or what's left
+// of the cache) or it doesn't only change with the locals and natives.
+static bool code_cache_add(CodeCache* cache,
+                           uint64_t key,
+                           const char* src,
+                           int interned,
+                           const Ast* nodes,
+                           int n,
+                           const Token* tokens,
+                           uint64_t* locals,
+                           const Intern* names,
+                           const uint8_t* slots) {
+  if (cache->num_added == CODE_CACHE_MAX_ADDED) {
+    return false;
+  }
+  // The most an entry can be, with a reloc every 4 bytes.
+  size_t max_size = sizeof(CodeCacheEntry) + JIT_WINDOW_SIZE / 2 +
+                    JIT_WINDOW_SIZE / 8 * sizeof(CodeCacheReloc) +
+                    INTERN_MAX_NAMES * sizeof(CodeCacheName);
+  if (cache->added_size + max_size > CODE_CACHE_MAX_ADDED_BYTES) {
+    return false;
+  }
+  CodeCacheEntry* entry = (CodeCacheEntry*)(cache->added + cache->added_size);
+  unsigned char* body = (unsigned char*)(entry + 1);
+  unsigned char* at = jit_window + sizeof(c_entry_0_code) % JIT_WINDOW_ALIGN;
+  JitSource jit_src = {nodes, n, tokens, locals, NULL, 0, 0, NULL, NULL};
+  int size = code_cache_compile_at(&jit_src, at, body);
+  if (size < 0 || code_cache_compile_at(&jit_src, at + JIT_WINDOW_ALIGN, cache->moved) != size) {
+    return false;
+  }
+
+  // Which bytes change with the locals, and with each native, and then
+  // nothing else can change with where the code is.
+  entry->code_at = (uintptr_t)at;
+  entry->size = (uint32_t)size;
+  entry->num_relocs = 0;
+  for (int i = 0; i < size; ++i) {
+    cache->base_of[i] = CODE_CACHE_NO_BASE;
+  }
+  JitSource moved_locals = jit_src;
+  moved_locals.locals = (uint64_t*)((uintptr_t)locals + CODE_CACHE_MOVE);
+  bool ok =
+      code_cache_mark(cache, entry, &moved_locals, at, CODE_CACHE_LOCALS, (uintptr_t)locals);
+  bool called[JIT_MAX_NATIVES] = {false};
+  for (int i = 0; ok && i < n; ++i) {
+    int native = (int)(nodes[i] >> 16);
+    if ((nodes[i] & 0x7f) != AST_CALL || native >= JIT_MAX_NATIVES || called[native]) {
+      continue;
+    }
+    called[native] = true;
+    JitNative original = jit_natives[native];
+    jit_natives[native] = (JitNative)((uintptr_t)original + CODE_CACHE_MOVE);
+    ok = code_cache_mark(cache, entry, &jit_src, at, (uint16_t)native, (uintptr_t)original);
+    jit_natives[native] = original;
+  }
+  const CodeCacheReloc* relocs = code_cache_relocs(entry);
+  for (int i = 0; ok && i < entry->num_relocs; ++i) {
+    uint32_t rel, moved;
+    memcpy(&rel, body + relocs[i].offset, sizeof(rel));
+    memcpy(&moved, cache->moved + relocs[i].offset, sizeof(moved));
+    ok = !relocs[i].rel32 || rel - moved == JIT_WINDOW_ALIGN;
+  }
+  for (int i = 0; ok && i < size; ++i) {
+    ok = cache->base_of[i] != CODE_CACHE_NO_BASE || cache->moved[i] == body[i];
+  }
+  if (!ok) {
+    return false;
+  }
+
+  entry->num_names = 0;
+  CodeCacheName* entry_names = (CodeCacheName*)code_cache_names(entry);
+  for (int i = 0; i < names->count; ++i) {
+    if (slots[i] == FRAME_NO_SLOT) {
+      continue;
+    }
+    const InternName* name = &names->names[i];
+    uint32_t name_at = i < interned ? (uint32_t)i : (uint32_t)(name->at - src);
+    entry_names[entry->num_names++] = (CodeCacheName){name_at, (uint16_t)name->len, slots[i],
+                                                      i < interned};
+  }
+  cache->added_index[cache->num_added++] = (CodeCacheIndex){key, cache->added_size};
+  cache->added_size += code_cache_entry_size(entry);
+  return true;
+}
+
+// jit_compile_text(), but from |cache| if it has |src| (for the same names
+// and natives, see code_cache_key()), and otherwise adding it to that.
+static CodeBlock code_cache_compile_text(CodeCache* cache,
+                                         CodeArena* arena,
+                                         const char* src,
+                                         uint64_t* locals,
+                                         Intern* names,
+                                         uint8_t* slots) {
+  if (jit_snippet_counts) {
+    // The counters would be relocs that code_cache_add() doesn't know of.
+    return jit_compile_text(arena, src, locals, names, slots);
+  }
+  uint64_t key = code_cache_key(src, names);
+  const CodeCacheEntry* entry = code_cache_find(cache, key);
+  if (entry) {
+    CodeBlock block = code_cache_load(entry, src, arena, locals, names, slots);
+    if (block.code) {
+      ++cache->hits;
+      return block;
+    }
+  }
+  ++cache->misses;
+  Token tokens[JIT_MAX_TOKENS];
+  Ast nodes[JIT_MAX_NODES];
+  int interned = names->count;
+  int n = jit_parse_text(src, tokens, nodes, names, slots);
+  if (n < 0) {
+    return (CodeBlock){NULL, 0};
+  }
+  CodeBlock block = jit_compile_function(arena, nodes, n, tokens, locals);
+  if (block.code && !entry &&
+      !code_cache_add(cache, key, src, interned, nodes, n, tokens, locals, names, slots)) {
+    ++cache->uncached;
+  }
+  return block;
+}
+
+static int code_cache_compare(const void* a, const void* b) {
+  uint64_t ka = ((const CodeCacheIndex*)a)->key, kb = ((const CodeCacheIndex*)b)->key;
+  return ka < kb ? -1 : ka > kb;
+}
+
+// Write what was in |cache| and what's been added to it to |path| (if
+// anything has been), and free it. Returns false if that couldn't be
+// written. The new file is written next to it and then renamed over it.
+static bool code_cache_close(CodeCache* cache, const char* path) {
+  bool ok = true;
+  int total = cache->count + cache->num_added;
+  // The merged index, with the entries that are in |added| marked by the
+  // top bit of their offset.
+  const uint64_t in_added = (uint64_t)1 << 63;
+  size_t merged_size = total * (sizeof(CodeCacheIndex) + sizeof(CodeCacheEntry*));
+  CodeCacheIndex* index = cache->num_added ? os_alloc(merged_size) : NULL;
+  ok = !cache->num_added || index;
+  if (index) {
+    if (cache->count) {
+      memcpy(index, cache->index, cache->count * sizeof(CodeCacheIndex));
+    }
+    for (int i = 0; i < cache->num_added; ++i) {
+      index[cache->count + i] = cache->added_index[i];
+      index[cache->count + i].offset |= in_added;
+    }
+    qsort(index, total, sizeof(CodeCacheIndex), code_cache_compare);
+    const CodeCacheEntry** entries = (const CodeCacheEntry**)(index + total);
+    int count = 0;
+    for (int i = 0; i < total; ++i) {
+      if (count && index[i].key == index[count - 1].key) {
+        continue;  // The same source added twice.
+      }
+      uint64_t offset = index[i].offset & ~in_added;
+      entries[count] = (const CodeCacheEntry*)((index[i].offset & in_added ? cache->added
+                                                                          : cache->file) +
+                                               offset);
+      index[count++].key = index[i].key;
+    }
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    CodeCacheHeader header = {CODE_CACHE_MAGIC, code_cache_build(), (uint32_t)count, 0};
+    uint64_t offset = sizeof(header) + count * sizeof(CodeCacheIndex);
+    for (int i = 0; i < count; ++i) {
+      index[i].offset = offset;
+      offset += code_cache_entry_size(entries[i]);
+    }
+    ok = f && fwrite(&header, sizeof(header), 1, f) == 1 &&
+         fwrite(index, sizeof(CodeCacheIndex), count, f) == (size_t)count;
+    for (int i = 0; ok && i < count; ++i) {
+      ok = fwrite(entries[i], code_cache_entry_size(entries[i]), 1, f) == 1;
+    }
+    ok = f && fclose(f) == 0 && ok;
+    os_release(index, merged_size);
+    // Windows can't rename over a file that's mapped, or at all.
+    if (ok && cache->file) {
+      os_unmap_file(cache->file, cache->file_size);
+      cache->file = NULL;
+    }
+    if (ok) {
+      remove(path);
+    }
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+      remove(tmp);
+    }
+  }
+  if (cache->file) {
+    os_unmap_file(cache->file, cache->file_size);
+  }
+  os_release(cache->added, CODE_CACHE_MAX_ADDED_BYTES);
+  os_release(cache->added_index, CODE_CACHE_MAX_ADDED * sizeof(CodeCacheIndex));
+  os_release(cache->moved, JIT_WINDOW_SIZE + JIT_WINDOW_SIZE / 2 * sizeof(uint16_t));
+  return ok;
+}
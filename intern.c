@@ -0,0 +1,116 @@
+// An intern table of names, included by cnp.c. Each distinct name gets a
+// dense index, in the order they're first seen, which is what lex() puts
+// in a TK_IDENT Token.
+//
+// It's open addressing with linear probing, in a table of indexes that's
+// never more than half full. Each name keeps its first 16 bytes zero
+// padded alongside its hash and length, so that a compare is a single
+// SSE2 compare of those, and only names longer than 16 bytes go on to
+// memcmp() the rest.
+
+#include <immintrin.h>
+
+#define INTERN_MAX_NAMES 256
+#define INTERN_TABLE_SIZE (2 * INTERN_MAX_NAMES)
+
+typedef struct InternName {
+  __m128i prefix;  // The first 16 bytes, zero padded.
+  const char* at;  // All of it, which has to outlive the table.
+  uint32_t len;
+  uint32_t hash;
+  // Set by the caller for a name whose local other threads use too, see
+  // frame_layout().
+  bool shared;
+} InternName;
+
+typedef struct Intern {
+  InternName names[INTERN_MAX_NAMES];
+  uint16_t table[INTERN_TABLE_SIZE];  // An index into |names| + 1, or 0.
+  int count;
+} Intern;
+
+static void intern_init(Intern* in) {
+  memset(in->table, 0, sizeof(in->table));
+  in->count = 0;
+}
+
+// The first 16 bytes of the |len| at |p|, zero padded. That's one load
+// of all 16 if there are that many, and otherwise two that overlap, of
+// however many there are, since reading past the end of a name is
+// undefined even when it's in the same page.
+static __m128i intern_prefix(const char* p, uint32_t len) {
+  if (len >= 16) {
+    return _mm_loadu_si128((const __m128i*)p);
+  }
+  uint64_t lo = 0, hi = 0;
+  if (len > 8) {
+    memcpy(&lo, p, 8);
+    memcpy(&hi, p + len - 8, 8);
+    hi >>= (16 - len) * 8;
+  } else if (len == 8) {
+    memcpy(&lo, p, 8);
+  } else if (len >= 4) {
+    uint32_t first, last;
+    memcpy(&first, p, 4);
+    memcpy(&last, p + len - 4, 4);
+    lo = first | (uint64_t)last << (len - 4) * 8;
+  } else if (len > 0) {
+    lo = (uint64_t)(unsigned char)p[0] | (uint64_t)(unsigned char)p[len / 2] << len / 2 * 8 |
+         (uint64_t)(unsigned char)p[len - 1] << (len - 1) * 8;
+  }
+  return _mm_set_epi64x((long long)hi, (long long)lo);
+}
+
+// Names that are the same for their first 16 bytes and length hash the
+// same, which only means they're compared.
+static uint32_t intern_hash(__m128i prefix, uint32_t len) {
+  uint64_t words[2];
+  memcpy(words, &prefix, sizeof(words));
+  uint64_t h = (words[0] ^ (words[1] + len) * 0x9e3779b97f4a7c15u) * 0xff51afd7ed558ccdu;
+  return (uint32_t)(h >> 32);
+}
+
+// Where in in->table the |len| bytes at |p| are, or the empty entry
+// they'd go in.
+static uint32_t intern_probe(const Intern* in,
+                             const char* p,
+                             uint32_t len,
+                             __m128i prefix,
+                             uint32_t hash) {
+  for (uint32_t at = hash;; ++at) {
+    at &= INTERN_TABLE_SIZE - 1;
+    int index = in->table[at] - 1;
+    if (index < 0) {
+      return at;
+    }
+    const InternName* name = &in->names[index];
+    if (name->hash == hash && name->len == len &&
+        _mm_movemask_epi8(_mm_cmpeq_epi8(name->prefix, prefix)) == 0xffff &&
+        (len <= 16 || memcmp(name->at + 16, p + 16, len - 16) == 0)) {
+      return at;
+    }
+  }
+}
+
+// The index of the |len| bytes at |p|, or -1 if they've not been
+// interned.
+static int intern_find(const Intern* in, const char* p, uint32_t len) {
+  __m128i prefix = intern_prefix(p, len);
+  return in->table[intern_probe(in, p, len, prefix, intern_hash(prefix, len))] - 1;
+}
+
+// The index of the |len| bytes at |p|, adding them if they're new, or -1
+// if there are already INTERN_MAX_NAMES others.
+static int intern(Intern* in, const char* p, uint32_t len) {
+  __m128i prefix = intern_prefix(p, len);
+  uint32_t hash = intern_hash(prefix, len);
+  uint32_t at = intern_probe(in, p, len, prefix, hash);
+  if (in->table[at]) {
+    return in->table[at] - 1;
+  } else if (in->count == INTERN_MAX_NAMES) {
+    return -1;
+  }
+  in->names[in->count] = (InternName){prefix, p, len, hash, false};
+  in->table[at] = (uint16_t)++in->count;
+  return in->count - 1;
+}
@@ -0,0 +1,436 @@
+// An interpreter of the post-order Ast, included by cnp.c, as the tier
+// below the JIT. A TieredFunction is interpreted until it's been called
+// tier_jit_threshold times, and only then compiled, with the profile of
+// which way its IFs went while it was interpreted. A source that only
+// runs a few times never pays for committing and sealing code, or for
+// stitching it.
+//
+// It's direct threaded: interp_prepare() walks the nodes as
+// jit_compile_nodes() does, with the same analysis (jit_begin()), and
+// appends a step for each node the JIT would emit a snippet for, with
+// the same operand, plus the jumps between them. Each step holds the
+// address of its handler in interp_run(), so dispatch is one indirect
+// jump straight to the next one's. The vstack is the snippets' (an entry
+// is 8 bytes, with an int in the low half), all of it in memory.
+
+// The deepest interp_prepare() lets the vstack get.
+#define INTERP_MAX_DEPTH 256
+// The most arguments that interp_call() passes, which is as many as
+// SNIPPET_MAX_NATIVE_ARGS is generated with.
+#define INTERP_MAX_CALL_ARGS 4
+// The most steps there are for JIT_MAX_NODES nodes: one each, and two
+// jumps for each of JIT_MAX_BRANCHES IFs and loops, and the return.
+#define INTERP_MAX_STEPS (JIT_MAX_NODES + 2 * JIT_MAX_BRANCHES + 1)
+
+typedef enum InterpOp {
+  INTERP_INVALID,  // For a node that doesn't have one.
+  INTERP_LOAD,
+  INTERP_LOAD_ADDR,
+  INTERP_CONST,
+  INTERP_ADD,
+  INTERP_MUL,
+  INTERP_LT,
+  INTERP_LE,
+  INTERP_GT,
+  INTERP_GE,
+  INTERP_EQ,
+  INTERP_NE,
+  INTERP_ASSIGN,
+  INTERP_CALL,
+  INTERP_DROP,
+  INTERP_JUMP,
+  INTERP_JUMP_IF_Z,
+  INTERP_JUMP_IF_NZ,
+  INTERP_RETURN,
+  INTERP_OPS,
+} InterpOp;
+
+// The InterpOp for each node that isn't a CALL, by [AstKind][is lval],
+// as AST_SNIPPETS in clang_rip.py has its snippet family.
+static const uint8_t interp_ops[AST_Count][2] = {
+    [AST_NAME] = {INTERP_LOAD, INTERP_LOAD_ADDR},
+    [AST_CONST][0] = INTERP_CONST,
+    [AST_ADD][0] = INTERP_ADD,
+    [AST_MUL][0] = INTERP_MUL,
+    [AST_LT][0] = INTERP_LT,
+    [AST_LE][0] = INTERP_LE,
+    [AST_GT][0] = INTERP_GT,
+    [AST_GE][0] = INTERP_GE,
+    [AST_EQ][0] = INTERP_EQ,
+    [AST_NE][0] = INTERP_NE,
+    [AST_ASSIGN][0] = INTERP_ASSIGN,
+};
+
+typedef struct InterpStep {
+  const void* handler;  // In interp_run(), for its InterpOp.
+  union {
+    uintptr_t x;  // The node's $X, see node_operand().
+    // For an IF's JUMP_IF_Z, how many times it's run its then and else
+    // blocks, as jit_compile() takes them.
+    uint32_t counts[2];
+  };
+  int32_t arg;   // For a jump, the step it goes to, and for a CALL, nargs.
+  int32_t node;  // For an IF's JUMP_IF_Z, the IF.
+} InterpStep;
+
+// interp_run()'s handlers, by InterpOp, once it's been called with NULL.
+static const void* const* interp_handlers;
+
+static int interp_call(JitNative native, int nargs, const uint64_t* args) {
+  int a[INTERP_MAX_CALL_ARGS] = {0};
+  for (int i = 0; i < nargs; ++i) {
+    a[i] = (int)args[i];
+  }
+  switch (nargs) {
+    case 0:
+      return ((int (*)(void))native)();
+    case 1:
+      return ((int (*)(int))native)(a[0]);
+    case 2:
+      return ((int (*)(int, int))native)(a[0], a[1]);
+    case 3:
+      return ((int (*)(int, int, int))native)(a[0], a[1], a[2]);
+    default:
+      return ((int (*)(int, int, int, int))native)(a[0], a[1], a[2], a[3]);
+  }
+}
+
+// Run the steps from |steps|, as interp_prepare() makes them, to the
+// RETURN. The ints are done as uint32_t, so that they wrap as the
+// snippets' do.
+static void interp_run(InterpStep* steps) {
+  static const void* const handlers[INTERP_OPS] = {
+      [INTERP_LOAD] = &&load,
+      [INTERP_LOAD_ADDR] = &&load_addr,
+      [INTERP_CONST] = &&constant,
+      [INTERP_ADD] = &&add,
+      [INTERP_MUL] = &&mul,
+      [INTERP_LT] = &&lt,
+      [INTERP_LE] = &&le,
+      [INTERP_GT] = &&gt,
+      [INTERP_GE] = &&ge,
+      [INTERP_EQ] = &&eq,
+      [INTERP_NE] = &&ne,
+      [INTERP_ASSIGN] = &&assign,
+      [INTERP_CALL] = &&call,
+      [INTERP_DROP] = &&drop,
+      [INTERP_JUMP] = &&jump,
+      [INTERP_JUMP_IF_Z] = &&jump_if_z,
+      [INTERP_JUMP_IF_NZ] = &&jump_if_nz,
+      [INTERP_RETURN] = &&ret,
+  };
+  if (!steps) {
+    // Any thread that prepares first stores the same thing.
+    __atomic_store_n(&interp_handlers, handlers, __ATOMIC_RELEASE);
+    return;
+  }
+  uint64_t stack[INTERP_MAX_DEPTH];
+  uint64_t* sp = stack;  // Just past the top entry.
+  InterpStep* step = steps;
+#define INTERP_NEXT goto *(++step)->handler
+#define INTERP_COMPARE(op)                       \
+  --sp;                                          \
+  sp[-1] = (int32_t)sp[-1] op (int32_t)sp[0];    \
+  INTERP_NEXT
+  goto *step->handler;
+
+load:
+  *sp++ = *(const uint32_t*)step->x;
+  INTERP_NEXT;
+load_addr:
+  *sp++ = step->x;
+  INTERP_NEXT;
+constant:
+  *sp++ = (uint32_t)step->x;
+  INTERP_NEXT;
+add:
+  --sp;
+  sp[-1] = (uint32_t)sp[-1] + (uint32_t)sp[0];
+  INTERP_NEXT;
+mul:
+  --sp;
+  sp[-1] = (uint32_t)sp[-1] * (uint32_t)sp[0];
+  INTERP_NEXT;
+lt:
+  INTERP_COMPARE(<);
+le:
+  INTERP_COMPARE(<=);
+gt:
+  INTERP_COMPARE(>);
+ge:
+  INTERP_COMPARE(>=);
+eq:
+  INTERP_COMPARE(==);
+ne:
+  INTERP_COMPARE(!=);
+assign:
+  sp -= 2;
+  *(uint32_t*)(uintptr_t)sp[0] = (uint32_t)sp[1];
+  INTERP_NEXT;
+call:
+  sp -= step->arg;
+  *sp = (uint32_t)interp_call((JitNative)step->x, step->arg, sp);
+  ++sp;
+  INTERP_NEXT;
+drop:
+  --sp;
+  INTERP_NEXT;
+jump:
+  step = &steps[step->arg];
+  goto *step->handler;
+jump_if_z:
+  if ((uint32_t)*--sp != 0) {
+    ++step->counts[0];
+    INTERP_NEXT;
+  }
+  ++step->counts[1];
+  step = &steps[step->arg];
+  goto *step->handler;
+jump_if_nz:
+  if ((uint32_t)*--sp == 0) {
+    INTERP_NEXT;
+  }
+  step = &steps[step->arg];
+  goto *step->handler;
+ret:
+  return;
+#undef INTERP_COMPARE
+#undef INTERP_NEXT
+}
+
+// What interp_prepare() is making the steps with.
+typedef struct InterpBuilder {
+  JitState s;  // Just for jit_begin()'s analysis of the nodes.
+  InterpStep* steps;
+  int num_steps;
+  int max_steps;
+  int depth;
+} InterpBuilder;
+
+// Append a step for |op| that pops |pops| entries and then pushes
+// |pushes|. Returns its index, or -1 if there isn't room for it, or the
+// vstack would get deeper than INTERP_MAX_DEPTH.
+static int interp_emit(InterpBuilder* b, InterpOp op, uintptr_t x, int pops, int pushes) {
+  b->depth += pushes - pops;
+  if (b->num_steps == b->max_steps || b->depth < 0 || b->depth > INTERP_MAX_DEPTH) {
+    return -1;
+  }
+  b->steps[b->num_steps] = (InterpStep){interp_handlers[op], {x}, 0, 0};
+  return b->num_steps++;
+}
+
+// The step for node |i|, if the JIT would emit a snippet for it, see
+// jit_emit_node().
+static bool interp_emit_node(InterpBuilder* b, int i) {
+  const JitState* s = &b->s;
+  Ast node = s->nodes[i];
+  AstKind kind = node & 0x7f;
+  int lval = (node >> 7) & 1;
+  if (kind == AST_EXPECT || kind == AST_DISPL || (s->unused[i] && kind != AST_CALL)) {
+    return true;
+  }
+  uintptr_t x = node_operand(node, s->tokens, s->locals, NULL);
+  int pops = ast_pops(node);
+  if (kind == AST_CALL) {
+    int at = pops <= INTERP_MAX_CALL_ARGS && x ? interp_emit(b, INTERP_CALL, x, pops, 1) : -1;
+    if (at < 0) {
+      return false;
+    }
+    b->steps[at].arg = pops;
+    return !s->unused[i] || interp_emit(b, INTERP_DROP, 0, 1, 0) >= 0;
+  }
+  InterpOp op = interp_ops[kind][lval];
+  return op != INTERP_INVALID && interp_emit(b, op, x, pops, pops + ast_delta(node)) >= 0;
+}
+
+static bool interp_emit_nodes(InterpBuilder* b, int begin, int end);
+
+// The IF at |k|, whose condition has been emitted up to its branch point
+// |at|: a JUMP_IF_Z over the then block, which also counts which way it
+// went, and a JUMP over the else block at the end of the then block.
+static bool interp_emit_if(InterpBuilder* b, int at, int k) {
+  const Ast* nodes = b->s.nodes;
+  int cond_end = ast_condition_end(nodes, k);
+  int then_end = k - ast_displ(nodes, k, 8);
+  int branch = -1;
+  if (!interp_emit_node(b, at) || (branch = interp_emit(b, INTERP_JUMP_IF_Z, 0, 1, 0)) < 0 ||
+      b->depth != 0 || !interp_emit_nodes(b, cond_end + 1, then_end + 1)) {
+    return false;
+  }
+  b->steps[branch].node = k;
+  if (then_end + 1 < k) {
+    int jump = interp_emit(b, INTERP_JUMP, 0, 0, 0);
+    b->steps[branch].arg = b->num_steps;
+    if (jump < 0 || !interp_emit_nodes(b, then_end + 1, k)) {
+      return false;
+    }
+    b->steps[jump].arg = b->num_steps;
+  } else {
+    b->steps[branch].arg = b->num_steps;
+  }
+  return true;
+}
+
+// The WHILE or FOR at |k|, whose condition starts at |begin|, laid out as
+// in jit_emit_loop() with the condition at the bottom.
+static bool interp_emit_loop(InterpBuilder* b, int begin, int k) {
+  const Ast* nodes = b->s.nodes;
+  int cond_end = ast_condition_end(nodes, k);
+  int body_begin = cond_end + 1, step_begin = k, step_end = k;
+  if ((nodes[k] & 0x7f) == AST_FOR) {
+    step_begin = cond_end + 1;
+    step_end = k - ast_displ(nodes, k, 8) + 1;
+    body_begin = step_end;
+  }
+  int jump = interp_emit(b, INTERP_JUMP, 0, 0, 0);
+  int top = b->num_steps;
+  if (jump < 0 || !interp_emit_nodes(b, body_begin, k) ||
+      !interp_emit_nodes(b, step_begin, step_end)) {
+    return false;
+  }
+  b->steps[jump].arg = b->num_steps;
+  int at = ast_branch_point(nodes, cond_end);
+  for (int i = begin; i <= at; ++i) {
+    if (!interp_emit_node(b, i)) {
+      return false;
+    }
+  }
+  int branch = interp_emit(b, INTERP_JUMP_IF_NZ, 0, 1, 0);
+  if (branch < 0 || b->depth != 0) {
+    return false;
+  }
+  b->steps[branch].arg = top;
+  return true;
+}
+
+// Emit nodes [begin, end) in order, as jit_emit_nodes() does.
+static bool interp_emit_nodes(InterpBuilder* b, int begin, int end) {
+  for (int i = begin; i < end;) {
+    const JitState* s = &b->s;
+    if (s->branch_at[i] >= 0) {
+      int k = s->branch_at[i];
+      if (!interp_emit_if(b, i, k)) {
+        return false;
+      }
+      i = k + 1;
+    } else if (s->loop_at[i] >= 0) {
+      int k = s->loop_at[i];
+      if (!interp_emit_loop(b, i, k)) {
+        return false;
+      }
+      i = k + 1;
+    } else if (!interp_emit_node(b, i++)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Make the steps for interp_run() to run |nodes| with |locals|, into
+// |steps| (INTERP_MAX_STEPS is always enough). Returns how many there
+// are, or -1 if there are more than |max_steps|, the vstack would get
+// deeper than INTERP_MAX_DEPTH, or the JIT couldn't compile it either
+// (see jit_compile_nodes()) for anything but how it's stitched.
+static int interp_prepare(const Ast* nodes,
+                          int n,
+                          const Token* tokens,
+                          uint64_t* locals,
+                          InterpStep* steps,
+                          int max_steps) {
+  if (!__atomic_load_n(&interp_handlers, __ATOMIC_ACQUIRE)) {
+    interp_run(NULL);
+  }
+  InterpBuilder b;
+  b.steps = steps;
+  b.num_steps = 0;
+  b.max_steps = max_steps;
+  b.depth = 0;
+  if (!jit_begin(&b.s, nodes, n, tokens, locals, NULL, NULL, NULL) ||
+      !interp_emit_nodes(&b, 0, n) || b.depth != 0 ||
+      interp_emit(&b, INTERP_RETURN, 0, 0, 0) < 0) {
+    return -1;
+  }
+  return b.num_steps;
+}
+
+// How many calls a TieredFunction is interpreted for before it's
+// compiled, at least 1.
+static uint32_t tier_jit_threshold = 64;
+
+// A function that tiered_call() interprets until it's been called
+// tier_jit_threshold times, and then compiles into |arena| with the
+// profile that the interpreter took of its IFs, and runs that instead.
+// It's only for one thread, as |arena| is: promoting it allocates and
+// writes a block there, which stops code on the same pages being
+// executable until it's done (see code_arena_alloc()).
+typedef struct TieredFunction {
+  JitSource src;
+  CodeArena* arena;
+  InterpStep* steps;  // NULL if it can't be interpreted, only compiled.
+  uint32_t calls;
+  // The compiled code, once it's been promoted to it, which is only ever
+  // set once. tiered_call() runs it whenever it's set.
+  void (*jit)(void);
+  CodeBlock block;
+} TieredFunction;
+
+// Compile |f| with the profile of its steps, if it has any.
+static void tiered_promote(TieredFunction* f) {
+  uint32_t branch_counts[JIT_MAX_NODES][2];
+  JitSource src = f->src;
+  if (f->steps) {
+    memset(branch_counts, 0, f->src.n * sizeof(branch_counts[0]));
+    for (InterpStep* step = f->steps; step->handler != interp_handlers[INTERP_RETURN]; ++step) {
+      if (step->handler == interp_handlers[INTERP_JUMP_IF_Z]) {
+        branch_counts[step->node][0] = step->counts[0];
+        branch_counts[step->node][1] = step->counts[1];
+      }
+    }
+    src.branch_counts = (const uint32_t(*)[2])branch_counts;
+  }
+  f->block = jit_compile_any_function(f->arena, &src);
+  if (f->block.code) {
+    f->jit = (void (*)(void))f->block.code;
+  }
+}
+
+// Set up |f| to run |nodes| with |locals|, which all have to outlive it.
+// Its steps go in |steps|, of |max_steps| (INTERP_MAX_STEPS is always
+// enough). Returns false if it can't be interpreted or compiled. One that
+// can only be compiled (e.g. it's too deep for the interpreter) is
+// compiled now.
+static bool tiered_init(TieredFunction* f,
+                        CodeArena* arena,
+                        const Ast* nodes,
+                        int n,
+                        const Token* tokens,
+                        uint64_t* locals,
+                        InterpStep* steps,
+                        int max_steps) {
+  *f = (TieredFunction){{nodes, n, tokens, locals, NULL, 0, 0, NULL, NULL}, arena, steps, 0,
+                        NULL, {NULL, 0}};
+  if (interp_prepare(nodes, n, tokens, locals, steps, max_steps) < 0) {
+    f->steps = NULL;
+    tiered_promote(f);
+    return f->jit != NULL;
+  }
+  return true;
+}
+
+// Run |f| once.
+static void tiered_call(TieredFunction* f) {
+  if (!f->jit && ++f->calls == tier_jit_threshold) {
+    tiered_promote(f);
+  }
+  if (f->jit) {
+    f->jit();
+  } else {
+    interp_run(f->steps);
+  }
+}
+
+static void tiered_destroy(TieredFunction* f) {
+  if (f->block.code) {
+    code_arena_free(f->arena, f->block);
+  }
+}
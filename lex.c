@@ -0,0 +1,234 @@
+// A lexer from source text straight to Tokens, included by cnp.c.
+//
+// Bytes are classified as whitespace, identifier or digit a 32 byte block
+// at a time, with SSE2 or AVX2, into a bit mask for each class. Then each
+// run, e.g. the rest of an identifier, ends at a ctz of its mask rather
+// than after a loop over its bytes. The loads are of whole aligned
+// blocks, which never cross into another page, so all the source needs
+// is a NUL at the end, and nothing after that has to be readable.
+
+#include <immintrin.h>
+
+typedef enum LexSimd {
+  LEX_SCALAR,
+  LEX_SSE2,
+  LEX_AVX2,
+} LexSimd;
+
+// Which instructions lex() classifies bytes with. LEX_SCALAR does it a
+// byte at a time (for comparison). main() picks LEX_AVX2 if the CPU has
+// it.
+static LexSimd lex_simd = LEX_SSE2;
+
+static LexSimd lex_best_simd(void) {
+  bool avx2, avx512f;
+  os_simd_support(&avx2, &avx512f);
+  return avx2 ? LEX_AVX2 : LEX_SSE2;
+}
+
+#define LEX_BLOCK 32
+
+typedef enum LexClass {
+  LEX_SPACE,
+  LEX_IDENT,  // Letters, digits and '_'.
+  LEX_DIGIT,
+  LEX_CLASSES,
+} LexClass;
+
+// The block that lex() has got to, see lex_run().
+typedef struct Lexer {
+  const char* block;
+  uint32_t masks[LEX_CLASSES];  // Bit i is whether block[i] is in each class.
+} Lexer;
+
+// Keywords as lex_pack() packs them.
+#define LEX_PACK(a, b, c, d, e) \
+  ((Token)(a) | (Token)(b) << 8 | (Token)(c) << 16 | (Token)(d) << 24 | (Token)(e) << 32)
+static const struct {
+  Token name;
+  TokenKind kind;
+} lex_keywords[] = {
+    {LEX_PACK('i', 'f', 0, 0, 0), TK_IF},
+    {LEX_PACK('e', 'l', 's', 'e', 0), TK_ELSE},
+    {LEX_PACK('w', 'h', 'i', 'l', 'e'), TK_WHILE},
+    {LEX_PACK('f', 'o', 'r', 0, 0), TK_FOR},
+};
+#undef LEX_PACK
+
+// The TokenKind of each byte that's an operator or punctuation on its
+// own, and then of it followed by an '=', if that's different.
+static const TokenKind lex_operators[256][2] = {
+    ['='] = {TK_EQ, TK_EQEQ},   ['!'] = {TK_INVALID, TK_NE}, ['<'] = {TK_LT, TK_LE},
+    ['>'] = {TK_GT, TK_GE},     ['+'] = {TK_PLUS},           ['*'] = {TK_TIMES},
+    ['('] = {TK_LPAREN},        [')'] = {TK_RPAREN},         ['{'] = {TK_LBRACE},
+    ['}'] = {TK_RBRACE},        [';'] = {TK_SEMI},           [','] = {TK_COMMA},
+};
+
+static void lex_classify_scalar(const char* block, uint32_t* masks) {
+  memset(masks, 0, LEX_CLASSES * sizeof(uint32_t));
+  for (int i = 0; i < LEX_BLOCK; ++i) {
+    unsigned char c = (unsigned char)block[i];
+    bool digit = c >= '0' && c <= '9';
+    bool letter = (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+    masks[LEX_SPACE] |= (uint32_t)(c == ' ' || (c >= '\t' && c <= '\r')) << i;
+    masks[LEX_IDENT] |= (uint32_t)(letter || digit || c == '_') << i;
+    masks[LEX_DIGIT] |= (uint32_t)digit << i;
+  }
+}
+
+// The bytes of |c| in [lo, hi]: c - lo as unsigned is at most hi - lo,
+// which with only signed compares is c - lo - 128 < hi - lo + 1 - 128.
+static __m128i lex_in_range_sse2(__m128i c, char lo, char hi) {
+  __m128i biased = _mm_add_epi8(c, _mm_set1_epi8((char)(-128 - lo)));
+  return _mm_cmpgt_epi8(_mm_set1_epi8((char)(hi - lo + 1 - 128)), biased);
+}
+
+static void lex_classify_sse2(const char* block, uint32_t* masks) {
+  memset(masks, 0, LEX_CLASSES * sizeof(uint32_t));
+  for (int half = 0; half < LEX_BLOCK; half += 16) {
+    __m128i c = _mm_load_si128((const __m128i*)(block + half));
+    __m128i digit = lex_in_range_sse2(c, '0', '9');
+    __m128i letter = lex_in_range_sse2(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i under = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                 lex_in_range_sse2(c, '\t', '\r'));
+    __m128i ident = _mm_or_si128(_mm_or_si128(letter, digit), under);
+    masks[LEX_SPACE] |= (uint32_t)_mm_movemask_epi8(space) << half;
+    masks[LEX_IDENT] |= (uint32_t)_mm_movemask_epi8(ident) << half;
+    masks[LEX_DIGIT] |= (uint32_t)_mm_movemask_epi8(digit) << half;
+  }
+}
+
+__attribute__((target("avx2"))) static __m256i lex_in_range_avx2(__m256i c, char lo, char hi) {
+  __m256i biased = _mm256_add_epi8(c, _mm256_set1_epi8((char)(-128 - lo)));
+  return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(hi - lo + 1 - 128)), biased);
+}
+
+__attribute__((target("avx2"))) static void lex_classify_avx2(const char* block,
+                                                              uint32_t* masks) {
+  __m256i c = _mm256_load_si256((const __m256i*)block);
+  __m256i digit = lex_in_range_avx2(c, '0', '9');
+  __m256i letter = lex_in_range_avx2(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 'z');
+  __m256i under = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'));
+  __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                  lex_in_range_avx2(c, '\t', '\r'));
+  __m256i ident = _mm256_or_si256(_mm256_or_si256(letter, digit), under);
+  masks[LEX_SPACE] = (uint32_t)_mm256_movemask_epi8(space);
+  masks[LEX_IDENT] = (uint32_t)_mm256_movemask_epi8(ident);
+  masks[LEX_DIGIT] = (uint32_t)_mm256_movemask_epi8(digit);
+}
+
+// The end of the run of bytes in |cls| from |p|, which might be |p|
+// itself. A NUL isn't in any class, so that's as far as it can go.
+static const char* lex_run(Lexer* lx, const char* p, LexClass cls) {
+  for (;;) {
+    if ((uintptr_t)p - (uintptr_t)lx->block >= LEX_BLOCK) {
+      lx->block = (const char*)((uintptr_t)p & ~(uintptr_t)(LEX_BLOCK - 1));
+      if (lex_simd == LEX_AVX2) {
+        lex_classify_avx2(lx->block, lx->masks);
+      } else if (lex_simd == LEX_SSE2) {
+        lex_classify_sse2(lx->block, lx->masks);
+      } else {
+        lex_classify_scalar(lx->block, lx->masks);
+      }
+    }
+    // Shifting in zeros past the end of the block means there's always a
+    // bit set here, at the end of the run or of the block.
+    int offset = (int)(p - lx->block);
+    int run = __builtin_ctz(~(lx->masks[cls] >> offset));
+    if (offset + run < LEX_BLOCK) {
+      return p + run;
+    }
+    p = lx->block + LEX_BLOCK;
+  }
+}
+
+// The |len| (up to 7) bytes at |p| packed into an integer, the first in
+// the low byte.
+static Token lex_pack(const char* p, uint32_t len) {
+  Token packed = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    packed |= (Token)(unsigned char)p[i] << (8 * i);
+  }
+  return packed;
+}
+
+// The Token for the identifier [p, end), see lex().
+static bool lex_name(const char* p, const char* end, Intern* names, Token* token) {
+  uint32_t len = (uint32_t)(end - p);
+  if (len <= 7) {
+    Token packed = lex_pack(p, len);
+    for (int i = 0; i < countofi(lex_keywords); ++i) {
+      if (packed == lex_keywords[i].name) {
+        *token = lex_keywords[i].kind;
+        return true;
+      }
+    }
+  }
+  int index = intern(names, p, len);
+  if (index < 0) {
+    return false;
+  }
+  *token = (Token)index << 8 | TK_IDENT;
+  return true;
+}
+
+// Lex the NUL terminated |src| into |tokens|, ending with a TK_EOF.
+// Identifiers are interned in |names|, and their Tokens are the index.
+// Keywords have their own TokenKinds. Returns the number of tokens,
+// including the EOF, or -1 if there's a byte that doesn't start a token,
+// a number that doesn't fit in a Token or runs into an identifier, or
+// more than |max_tokens| tokens or INTERN_MAX_NAMES names.
+static int lex(const char* src, Token* tokens, int max_tokens, Intern* names) {
+  Lexer lx = {NULL, {0}};  // So that the first lex_run() loads a block.
+  int n = 0;
+  const char* p = src;
+  for (;;) {
+    p = lex_run(&lx, p, LEX_SPACE);
+    if (n == max_tokens) {
+      return -1;
+    }
+    unsigned char c = (unsigned char)*p;
+    Token* token = &tokens[n++];
+    if (c == '_' || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')) {
+      const char* end = lex_run(&lx, p, LEX_IDENT);
+      if (!lex_name(p, end, names, token)) {
+        return -1;
+      }
+      p = end;
+      continue;
+    }
+    if (c >= '0' && c <= '9') {
+      const char* end = lex_run(&lx, p, LEX_DIGIT);
+      uint64_t value = 0;
+      for (; p < end; ++p) {
+        value = value * 10 + (uint64_t)(*p - '0');
+        if (value >> 56) {
+          return -1;
+        }
+      }
+      if (lex_run(&lx, p, LEX_IDENT) != p) {
+        return -1;
+      }
+      *token = value << 8 | TK_CONST;
+      continue;
+    }
+    if (c == '\0') {
+      *token = TK_EOF;
+      return n;
+    }
+    // The operators that can be followed by an '=' are two bytes if they
+    // are, see lex_operators.
+    bool eq = p[1] == '=';
+    TokenKind kind = lex_operators[c][0];
+    if (lex_operators[c][1] != TK_INVALID) {
+      kind = lex_operators[c][eq];
+      p += eq;
+    }
+    if (kind == TK_INVALID) {
+      return -1;
+    }
+    *token = kind;
+    ++p;
+  }
+}
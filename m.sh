@@ -0,0 +1,4 @@
+#!/bin/sh
+set -e
+python3 clang_rip.py
+clang -Wall -Wextra -Werror -Oz -pthread cnp.c -o cnp
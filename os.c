@@ -0,0 +1,308 @@
+// The little that cnp.c needs from the OS, for Windows and POSIX:
+// reserving, committing and protecting pages, mapping files, threads,
+// naming JIT code for profilers, clocks, and which vector instructions
+// can be used. Included by cnp.c.
+
+#include <cpuid.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+typedef enum OsProtect {
+  OS_NOACCESS,
+  OS_READWRITE,
+  OS_EXECUTE_READ,
+} OsProtect;
+
+#define OS_PAGE_SIZE (4 << 10)
+#define OS_HUGE_PAGE_SIZE (2 << 20)
+
+#ifdef _WIN32
+
+static DWORD os_protect_flags(OsProtect protect) {
+  switch (protect) {
+    case OS_READWRITE:
+      return PAGE_READWRITE;
+    case OS_EXECUTE_READ:
+      return PAGE_EXECUTE_READ;
+    default:
+      return PAGE_NOACCESS;
+  }
+}
+
+// Reserve |size| bytes of address space that's inaccessible until
+// os_commit(). |*page_size| is set to the granularity that it can be
+// committed and protected in. Large pages on Windows need
+// SeLockMemoryPrivilege and have to be committed up front, so
+// |huge_pages| is ignored.
+static void* os_reserve(size_t size, bool huge_pages, size_t* page_size) {
+  (void)huge_pages;
+  *page_size = OS_PAGE_SIZE;
+  return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+static bool os_commit(void* p, size_t size, OsProtect protect) {
+  return VirtualAlloc(p, size, MEM_COMMIT, os_protect_flags(protect)) != NULL;
+}
+
+static bool os_protect(void* p, size_t size, OsProtect protect) {
+  DWORD old_protect;
+  return VirtualProtect(p, size, os_protect_flags(protect), &old_protect);
+}
+
+static void os_release(void* p, size_t size) {
+  (void)size;
+  VirtualFree(p, 0, MEM_RELEASE);
+}
+
+static void os_flush_icache(void* p, size_t size) {
+  FlushInstructionCache(GetCurrentProcess(), p, size);
+}
+
+static double os_seconds(void) {
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+// The file at |path| mapped read only, with its size in |*size|, or NULL
+// if it can't be (or is empty).
+static const void* os_map_file(const char* path, size_t* size) {
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return NULL;
+  }
+  void* p = NULL;
+  LARGE_INTEGER file_size;
+  if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+    *size = (size_t)file_size.QuadPart;
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+  return p;
+}
+
+static void os_unmap_file(const void* p, size_t size) {
+  (void)size;
+  UnmapViewOfFile(p);
+}
+
+// A thread running fn(arg), from os_start_thread() until os_join_thread().
+typedef struct OsThread {
+  void (*fn)(void*);
+  void* arg;
+  HANDLE handle;
+} OsThread;
+
+static DWORD WINAPI os_thread_main(LPVOID thread) {
+  ((OsThread*)thread)->fn(((OsThread*)thread)->arg);
+  return 0;
+}
+
+// |*thread| has to stay where it is until it's joined.
+static bool os_start_thread(OsThread* thread, void (*fn)(void*), void* arg) {
+  thread->fn = fn;
+  thread->arg = arg;
+  thread->handle = CreateThread(NULL, 0, os_thread_main, thread, 0, NULL);
+  return thread->handle != NULL;
+}
+
+static void os_join_thread(OsThread* thread) {
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+}
+
+static int os_cpus(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+}
+
+// What profilers read to name JIT code. On Windows that's ETW rundown
+// events from a registered provider, which this doesn't have yet.
+static FILE* os_open_perf_map(void) {
+  return NULL;
+}
+
+#else
+
+static int os_protect_flags(OsProtect protect) {
+  switch (protect) {
+    case OS_READWRITE:
+      return PROT_READ | PROT_WRITE;
+    case OS_EXECUTE_READ:
+      return PROT_READ | PROT_EXEC;
+    default:
+      return PROT_NONE;
+  }
+}
+
+// Reserve |size| bytes of address space that's inaccessible until
+// os_commit(). |*page_size| is set to the granularity that it can be
+// committed and protected in. With |huge_pages| the range is backed by 2
+// MiB pages from hugetlbfs if enough are free, and otherwise marked for
+// transparent huge pages; either way it's then only protected in whole 2
+// MiB pages so that they don't get split back up.
+static void* os_reserve(size_t size, bool huge_pages, size_t* page_size) {
+  *page_size = OS_PAGE_SIZE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  void* p = MAP_FAILED;
+  if (huge_pages && size % OS_HUGE_PAGE_SIZE == 0) {
+#ifdef MAP_HUGETLB
+    // Without MAP_NORESERVE, so this fails up front rather than faulting
+    // later if there aren't enough huge pages.
+    p = mmap(NULL, size, PROT_NONE, (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+      // Over-reserve to align to a huge page, and trim the ends.
+      unsigned char* q = mmap(NULL, size + OS_HUGE_PAGE_SIZE, PROT_NONE, flags, -1, 0);
+      if (q == MAP_FAILED) {
+        return NULL;
+      }
+      uintptr_t mask = OS_HUGE_PAGE_SIZE - 1;
+      unsigned char* aligned = (unsigned char*)(((uintptr_t)q + mask) & ~mask);
+      if (aligned > q) {
+        munmap(q, aligned - q);
+      }
+      munmap(aligned + size, q + OS_HUGE_PAGE_SIZE - aligned);
+      p = aligned;
+#ifdef MADV_HUGEPAGE
+      madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+    *page_size = OS_HUGE_PAGE_SIZE;
+    return p;
+  }
+  p = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Pages are allocated when they're first touched, so this only has to
+// make them accessible.
+static bool os_commit(void* p, size_t size, OsProtect protect) {
+  return mprotect(p, size, os_protect_flags(protect)) == 0;
+}
+
+static bool os_protect(void* p, size_t size, OsProtect protect) {
+  return mprotect(p, size, os_protect_flags(protect)) == 0;
+}
+
+static void os_release(void* p, size_t size) {
+  munmap(p, size);
+}
+
+static void os_flush_icache(void* p, size_t size) {
+  __builtin___clear_cache((char*)p, (char*)p + size);
+}
+
+static double os_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+// The file at |path| mapped read only, with its size in |*size|, or NULL
+// if it can't be (or is empty).
+static const void* os_map_file(const char* path, size_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  void* p = MAP_FAILED;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    *size = (size_t)st.st_size;
+    p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static void os_unmap_file(const void* p, size_t size) {
+  munmap((void*)p, size);
+}
+
+// A thread running fn(arg), from os_start_thread() until os_join_thread().
+typedef struct OsThread {
+  void (*fn)(void*);
+  void* arg;
+  pthread_t handle;
+} OsThread;
+
+static void* os_thread_main(void* thread) {
+  ((OsThread*)thread)->fn(((OsThread*)thread)->arg);
+  return NULL;
+}
+
+// |*thread| has to stay where it is until it's joined.
+static bool os_start_thread(OsThread* thread, void (*fn)(void*), void* arg) {
+  thread->fn = fn;
+  thread->arg = arg;
+  return pthread_create(&thread->handle, NULL, os_thread_main, thread) == 0;
+}
+
+static void os_join_thread(OsThread* thread) {
+  pthread_join(thread->handle, NULL);
+}
+
+static int os_cpus(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (int)cpus : 1;
+}
+
+// What profilers read to name JIT code: perf's map for this process,
+// which has a "start size name" line for each function, in hex.
+static FILE* os_open_perf_map(void) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  return fopen(path, "w");
+}
+
+#endif
+
+// |size| bytes of committed read/write memory, for data.
+static void* os_alloc(size_t size) {
+  size_t page_size;
+  void* p = os_reserve(size, false, &page_size);
+  if (p && !os_commit(p, size, OS_READWRITE)) {
+    os_release(p, size);
+    return NULL;
+  }
+  return p;
+}
+
+// The CPU's time stamp counter, which counts at a fixed rate near the
+// nominal clock, for timing things that take a few cycles.
+static uint64_t os_cycles(void) {
+  return __builtin_ia32_rdtsc();
+}
+
+// Whether the CPU has AVX2 and AVX-512F, and the OS saves the ymm and zmm
+// registers (XCR0) so that they can be used.
+static void os_simd_support(bool* avx2, bool* avx512f) {
+  *avx2 = *avx512f = false;
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 27))) {  // OSXSAVE
+    return;
+  }
+  uint32_t xcr0_low, xcr0_high;
+  __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+  uint64_t xcr0 = (uint64_t)xcr0_high << 32 | xcr0_low;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return;
+  }
+  *avx2 = (xcr0 & 0x6) == 0x6 && (ebx & (1u << 5));
+  *avx512f = (xcr0 & 0xe6) == 0xe6 && (ebx & (1u << 16));
+}
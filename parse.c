@@ -0,0 +1,254 @@
+// A parser from Tokens straight to the post-order Ast, included by cnp.c.
+//
+// Statements are recursive descent and expressions precedence climbing.
+// Each node is appended to the caller's array as soon as its children
+// are all there, so there's no tree and no allocation. The grammar is a
+// little of C's:
+//
+//   statement = simple ";" | ";" | "{" statement* "}"
+//             | "if" "(" expr ")" statement ["else" statement]
+//             | "while" "(" expr ")" statement
+//             | "for" "(" [simple] ";" expr ";" [simple] ")" statement
+//   simple    = name "=" expr | expr
+//   expr      = operand (binop operand)*
+//   operand   = name | number | "(" expr ")" | name "(" [expr ("," expr)*] ")"
+//
+// with the binops all left associative and in C's order of precedence:
+// "*", then "+", then "<" "<=" ">" ">=", then "==" "!=". name(...) is a
+// CALL of the native of that name.
+
+// How deeply statements and expressions can nest, so that a hostile
+// source can't run the C stack out.
+#define PARSE_MAX_DEPTH 256
+
+typedef struct Parser {
+  const Token* tokens;
+  const Intern* names;
+  int at;  // The next token.
+  Ast* nodes;
+  int n;
+  int max_nodes;
+  const char* const* natives;
+  int num_natives;
+  int depth;
+} Parser;
+
+// The Ast for each binop Token and its precedence, higher binding
+// tighter. 0 isn't a binop.
+static const struct {
+  AstKind kind;
+  int precedence;
+} parse_binops[TK_Count] = {
+    [TK_TIMES] = {AST_MUL, 4}, [TK_PLUS] = {AST_ADD, 3}, [TK_LT] = {AST_LT, 2},
+    [TK_LE] = {AST_LE, 2},     [TK_GT] = {AST_GT, 2},    [TK_GE] = {AST_GE, 2},
+    [TK_EQEQ] = {AST_EQ, 1},   [TK_NE] = {AST_NE, 1},
+};
+
+static TokenKind parse_peek(const Parser* p, int ahead) {
+  return p->tokens[p->at + ahead] & 0xff;
+}
+
+// Whether the next token is |kind|, and if so, past it.
+static bool parse_accept(Parser* p, TokenKind kind) {
+  if (parse_peek(p, 0) != kind) {
+    return false;
+  }
+  ++p->at;
+  return true;
+}
+
+static bool parse_node(Parser* p, Ast node) {
+  if (p->n == p->max_nodes) {
+    return false;
+  }
+  p->nodes[p->n++] = node;
+  return true;
+}
+
+// Append a |kind| node whose 12 bit fields from bits 20 and 8 are the
+// disps back to nodes |to20| and |to8|, or -1 for a field that isn't a
+// disp. Each AST_DISPL that a disp needs (see ast_displ()) makes all of
+// them one bigger, so first find how many there'll be.
+static bool parse_displ_node(Parser* p, AstKind kind, int to20, int to8) {
+  const int to[2] = {to8, to20};
+  const int shift[2] = {8, 20};
+  int escapes = 0;
+  for (;;) {
+    int k = p->n + escapes;
+    int need = (to20 >= 0 && k - to20 >= 0xfff) + (to8 >= 0 && k - to8 >= 0xfff);
+    if (need == escapes) {
+      break;
+    }
+    escapes = need;
+  }
+  int k = p->n + escapes;
+  Ast node = kind;
+  // Bit 8's AST_DISPL goes first, so that bit 20's is at k - 1.
+  for (int j = 0; j < 2; ++j) {
+    if (to[j] < 0) {
+      continue;
+    }
+    int displ = k - to[j];
+    if (displ >= 0xfff) {
+      if (displ > 0xffffff || !parse_node(p, UNARYOP(DISPL, displ))) {
+        return false;
+      }
+      displ = 0xfff;
+    }
+    node |= (Ast)displ << shift[j];
+  }
+  return parse_node(p, node);
+}
+
+static bool parse_expr(Parser* p, int min_precedence);
+
+// The index in p->natives of the native called |name|, or -1.
+static int parse_native(const Parser* p, Token name) {
+  for (int i = 0; i < p->num_natives; ++i) {
+    const char* native = p->natives[i];
+    if (native && intern_find(p->names, native, (uint32_t)strlen(native)) == (int)(name >> 8)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// The arguments and ")" after the name at |name| and its "(".
+static bool parse_call(Parser* p, int name) {
+  int native = parse_native(p, p->tokens[name]);
+  if (native < 0) {
+    return false;
+  }
+  int nargs = 0;
+  if (!parse_accept(p, TK_RPAREN)) {
+    do {
+      if (!parse_expr(p, 1)) {
+        return false;
+      }
+      ++nargs;
+    } while (parse_accept(p, TK_COMMA));
+    if (!parse_accept(p, TK_RPAREN)) {
+      return false;
+    }
+  }
+  return nargs <= 0xff && parse_node(p, CALLOP(nargs, native));
+}
+
+static bool parse_operand(Parser* p) {
+  int at = p->at;
+  if (at > 0xffffff) {
+    return false;  // Nodes only have 24 bits for it.
+  } else if (parse_accept(p, TK_CONST)) {
+    return parse_node(p, UNARYOP(CONST, at));
+  } else if (parse_accept(p, TK_LPAREN)) {
+    return parse_expr(p, 1) && parse_accept(p, TK_RPAREN);
+  } else if (!parse_accept(p, TK_IDENT)) {
+    return false;
+  } else if (parse_accept(p, TK_LPAREN)) {
+    return parse_call(p, at);
+  }
+  return parse_node(p, UNARYOP(NAME, at));
+}
+
+// An expr whose binops all have at least |min_precedence|.
+static bool parse_expr(Parser* p, int min_precedence) {
+  if (p->depth++ == PARSE_MAX_DEPTH || !parse_operand(p)) {
+    return false;
+  }
+  for (;;) {
+    TokenKind op = parse_peek(p, 0);
+    int precedence = parse_binops[op].precedence;
+    if (!precedence || precedence < min_precedence) {
+      break;
+    }
+    int lhs = p->n - 1;
+    ++p->at;
+    if (!parse_expr(p, precedence + 1) ||
+        !parse_displ_node(p, parse_binops[op].kind, lhs, -1)) {
+      return false;
+    }
+  }
+  --p->depth;
+  return true;
+}
+
+static bool parse_simple(Parser* p) {
+  if (parse_peek(p, 0) != TK_IDENT || parse_peek(p, 1) != TK_EQ) {
+    return parse_expr(p, 1);
+  }
+  int lhs = p->n;
+  if (p->at > 0xffffff || !parse_node(p, UNARYOP_LVAL(NAME, p->at))) {
+    return false;
+  }
+  p->at += 2;
+  return parse_expr(p, 1) && parse_displ_node(p, AST_ASSIGN, lhs, -1);
+}
+
+// "(" expr ")", setting |*end| to its last node.
+static bool parse_condition(Parser* p, int* end) {
+  if (!parse_accept(p, TK_LPAREN) || !parse_expr(p, 1)) {
+    return false;
+  }
+  *end = p->n - 1;
+  return parse_accept(p, TK_RPAREN);
+}
+
+static bool parse_statement(Parser* p) {
+  if (p->depth++ == PARSE_MAX_DEPTH) {
+    return false;
+  }
+  int cond_end = -1, then_end = -1, step_end = -1;
+  bool ok = true;
+  if (parse_accept(p, TK_SEMI)) {
+    // Nothing to do.
+  } else if (parse_accept(p, TK_LBRACE)) {
+    while (ok && !parse_accept(p, TK_RBRACE)) {
+      ok = parse_statement(p);
+    }
+  } else if (parse_accept(p, TK_IF)) {
+    ok = parse_condition(p, &cond_end) && parse_statement(p);
+    then_end = p->n - 1;
+    if (ok && parse_accept(p, TK_ELSE)) {
+      ok = parse_statement(p);
+    }
+    ok = ok && parse_displ_node(p, AST_IF, cond_end, then_end);
+  } else if (parse_accept(p, TK_WHILE)) {
+    ok = parse_condition(p, &cond_end) && parse_statement(p) &&
+         parse_displ_node(p, AST_WHILE, cond_end, -1);
+  } else if (parse_accept(p, TK_FOR)) {
+    // The init is just a statement before the FOR.
+    ok = parse_accept(p, TK_LPAREN) &&
+         (parse_accept(p, TK_SEMI) || (parse_simple(p) && parse_accept(p, TK_SEMI))) &&
+         parse_expr(p, 1);
+    cond_end = p->n - 1;
+    ok = ok && parse_accept(p, TK_SEMI) && (parse_peek(p, 0) == TK_RPAREN || parse_simple(p));
+    step_end = p->n - 1;
+    ok = ok && parse_accept(p, TK_RPAREN) && parse_statement(p) &&
+         parse_displ_node(p, AST_FOR, cond_end, step_end);
+  } else {
+    ok = parse_simple(p) && parse_accept(p, TK_SEMI);
+  }
+  --p->depth;
+  return ok;
+}
+
+// Parse |tokens|, as lex() makes them with |names|, as a list of
+// statements into |nodes| in post-order. A CALL's native is the index of
+// its name in |natives| (NULLs are skipped). Returns the number of nodes,
+// or -1 if there's a syntax error, a call of a name that isn't in
+// |natives|, nesting deeper than PARSE_MAX_DEPTH, or more than
+// |max_nodes| nodes.
+static int parse(const Token* tokens,
+                 const Intern* names,
+                 Ast* nodes,
+                 int max_nodes,
+                 const char* const* natives,
+                 int num_natives) {
+  Parser p = {tokens, names, 0, nodes, 0, max_nodes, natives, num_natives, 0};
+  while (parse_peek(&p, 0) != TK_EOF) {
+    if (!parse_statement(&p)) {
+      return -1;
+    }
+  }
+  return p.n;
+}
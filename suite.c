@@ -0,0 +1,444 @@
+// A benchmark suite of random expressions for `cnp suite`, included by
+// cnp.c. Each size given makes a config of sources "a = <expr>;" whose
+// expr has that many binops, at most |depth| deep, with operators picked
+// from |mix|, all from |seed|. Every source goes through each of:
+//
+//   switch  lex and parse, then a switch over the Ast each evaluation
+//   interp  lex, parse and interp_prepare(), then interp_run()
+//   jit     jit_compile_text(), then a call
+//   aot     the same exprs compiled ahead of time, when there are some
+//
+// and for each config and engine there's a CSV line on stdout of how long
+// getting from the source to something that runs took per node, how many
+// bytes that is per node, how many cycles (of the time stamp counter) an
+// evaluation took, and whether they all got what switch did.
+//
+// For aot, the exprs are written out as C and built into cnp with -O3:
+//
+//   > cnp suite emit-aot [args] > suite_aot.c
+//   > clang -O3 -fwrapv -DCNP_SUITE_AOT cnp.c -o cnp
+//   > cnp suite [the same args]
+//
+// -fwrapv so that, like the snippets, ints wrap round rather than being
+// undefined when they overflow.
+
+#ifdef CNP_SUITE_AOT
+// The exprs are random, so they compare bools with consts and the like.
+#pragma GCC diagnostic push
+#ifdef __clang__
+#pragma clang diagnostic ignored "-Weverything"
+#else
+#pragma GCC diagnostic ignored "-Wbool-compare"
+#pragma GCC diagnostic ignored "-Wtautological-compare"
+#pragma GCC diagnostic ignored "-Woverflow"
+#endif
+#include "suite_aot.c"
+#pragma GCC diagnostic pop
+#endif
+
+#define SUITE_MAX_CONFIGS 16
+#define SUITE_MAX_SIZE 1024
+#define SUITE_MAX_DEPTH 64  // So the parens stay well inside PARSE_MAX_DEPTH.
+#define SUITE_MAX_SOURCE (32 << 10)
+#define SUITE_INPUTS BENCH_INPUTS  // b..h, or v[1]..v[7] for aot.
+
+typedef enum SuiteEngine {
+  SUITE_SWITCH,
+  SUITE_INTERP,
+  SUITE_JIT,
+  SUITE_AOT,
+  SUITE_Count
+} SuiteEngine;
+
+static const char* const suite_engine_names[SUITE_Count] = {"switch", "interp", "jit", "aot"};
+
+typedef struct SuiteArgs {
+  int sizes[SUITE_MAX_CONFIGS];
+  int num_sizes;
+  int depth;
+  char mix[32];
+  uint64_t seed;
+  int count;  // Sources per config.
+  int iters;  // Evaluations of each.
+  bool emit_aot;
+} SuiteArgs;
+
+typedef struct SuiteGen {
+  uint64_t state;
+  const char* mix;
+  bool aot;  // Names are v[i] rather than letters.
+  char* p;
+} SuiteGen;
+
+// splitmix64.
+static uint64_t suite_random(SuiteGen* g) {
+  uint64_t z = (g->state += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+// The most binops that fit in an expr |depth| of them deep.
+static int suite_fits(int depth) {
+  return depth > 10 ? SUITE_MAX_SIZE : (1 << depth) - 1;
+}
+
+// The binop for a character of |mix|, or NULL.
+static const char* suite_op(char c) {
+  switch (c) {
+    case '+':
+      return " + ";
+    case '*':
+      return " * ";
+    case '<':
+      return " < ";
+    case '>':
+      return " > ";
+    case '=':
+      return " == ";
+    case '!':
+      return " != ";
+  }
+  return NULL;
+}
+
+static void suite_put(SuiteGen* g, const char* s) {
+  size_t n = strlen(s);
+  memcpy(g->p, s, n);
+  g->p += n;
+}
+
+// An expr of |size| binops at most |depth| deep: a name or a small const
+// if there are none, or else a binop with the rest split at random
+// between its operands, as far as they fit.
+static void suite_expr(SuiteGen* g, int size, int depth) {
+  char leaf[16];
+  if (size == 0) {
+    uint64_t r = suite_random(g);
+    int name = 1 + (int)((r >> 1) % SUITE_INPUTS);
+    if (!(r & 1)) {
+      snprintf(leaf, sizeof(leaf), "%d", (int)((r >> 1) % 100));
+    } else if (g->aot) {
+      snprintf(leaf, sizeof(leaf), "v[%d]", name);
+    } else {
+      snprintf(leaf, sizeof(leaf), "%c", 'a' + name);
+    }
+    suite_put(g, leaf);
+    return;
+  }
+  int fits = suite_fits(depth - 1);
+  int lo = size - 1 > fits ? size - 1 - fits : 0;
+  int hi = size - 1 < fits ? size - 1 : fits;
+  int lhs = lo + (int)(suite_random(g) % (uint64_t)(hi - lo + 1));
+  const char* op = suite_op(g->mix[suite_random(g) % strlen(g->mix)]);
+  suite_put(g, "(");
+  suite_expr(g, lhs, depth - 1);
+  suite_put(g, op);
+  suite_expr(g, size - 1 - lhs, depth - 1);
+  suite_put(g, ")");
+}
+
+// Source |i| of the config of |size| binops into |out| (SUITE_MAX_SOURCE),
+// as C for aot if |aot|.
+static void suite_source(const SuiteArgs* args, int size, int i, bool aot, char* out) {
+  SuiteGen g = {args->seed * 0x100000001b3u + (uint64_t)size * 0x10001u + (uint64_t)i,
+                args->mix, aot, out};
+  suite_put(&g, aot ? "v[0] = " : "a = ");
+  suite_expr(&g, size, args->depth);
+  suite_put(&g, ";");
+  *g.p = '\0';
+}
+
+// What identifies the sources, as emit-aot writes it and aot checks it.
+static void suite_args_string(const SuiteArgs* args, char* out, size_t size) {
+  int n = snprintf(out, size, "size=");
+  for (int c = 0; c < args->num_sizes; ++c) {
+    n += snprintf(out + n, size - n, "%s%d", c ? "," : "", args->sizes[c]);
+  }
+  snprintf(out + n, size - n, " depth=%d mix=%s seed=%llu count=%d", args->depth, args->mix,
+           (unsigned long long)args->seed, args->count);
+}
+
+static bool suite_parse_args(int argc, char** argv, SuiteArgs* args) {
+  *args = (SuiteArgs){{4, 16, 64, 256}, 4, 12, "++**<=", 1, 64, 1000, false};
+  for (int i = 0; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+    if (strcmp(arg, "emit-aot") == 0) {
+      args->emit_aot = true;
+    } else if (!value) {
+      return false;
+    } else if (strncmp(arg, "size=", 5) == 0) {
+      args->num_sizes = 0;
+      for (const char* p = value; *p == '=' || *p == ','; ++args->num_sizes) {
+        char* end;
+        long size = strtol(p + 1, &end, 10);
+        if (end == p + 1 || size < 0 || size > SUITE_MAX_SIZE ||
+            args->num_sizes == SUITE_MAX_CONFIGS) {
+          return false;
+        }
+        args->sizes[args->num_sizes] = (int)size;
+        p = end;
+      }
+    } else if (strncmp(arg, "depth=", 6) == 0) {
+      args->depth = atoi(value + 1);
+    } else if (strncmp(arg, "mix=", 4) == 0 && strlen(value + 1) < sizeof(args->mix)) {
+      strcpy(args->mix, value + 1);
+    } else if (strncmp(arg, "seed=", 5) == 0) {
+      args->seed = strtoull(value + 1, NULL, 10);
+    } else if (strncmp(arg, "count=", 6) == 0) {
+      args->count = atoi(value + 1);
+    } else if (strncmp(arg, "iters=", 6) == 0) {
+      args->iters = atoi(value + 1);
+    } else {
+      return false;
+    }
+  }
+  bool ok = args->depth >= 1 && args->depth <= SUITE_MAX_DEPTH && args->mix[0] &&
+            args->count >= 1 && args->iters >= 1;
+  for (const char* c = args->mix; *c; ++c) {
+    ok = ok && suite_op(*c);
+  }
+  for (int c = 0; c < args->num_sizes; ++c) {
+    ok = ok && args->sizes[c] <= suite_fits(args->depth);
+  }
+  return ok;
+}
+
+// Evaluate |nodes| with a switch on each node, as the simplest
+// interpreter of the Ast would. The suite's sources are only
+// assignments of binops of names and consts. ADD and MUL wrap round, as
+// the snippets do.
+static void suite_eval_ast(const Ast* nodes, int n, const Token* tokens, uint64_t* locals) {
+  uintptr_t stack[SUITE_MAX_SIZE + 2];
+  int depth = 0;
+  for (int i = 0; i < n; ++i) {
+    Ast node = nodes[i];
+    uintptr_t x = node_operand(node, tokens, locals, NULL);
+    uintptr_t* top = stack + depth;
+    switch (node & 0x7f) {
+#define SUITE_BINOP(kind, type, op)                                       \
+  case AST_##kind:                                                        \
+    top[-2] = (uintptr_t)(int)((type)(int)top[-2] op (type)(int)top[-1]); \
+    --depth;                                                              \
+    break;
+      SUITE_BINOP(ADD, unsigned, +)
+      SUITE_BINOP(MUL, unsigned, *)
+      SUITE_BINOP(LT, int, <)
+      SUITE_BINOP(LE, int, <=)
+      SUITE_BINOP(GT, int, >)
+      SUITE_BINOP(GE, int, >=)
+      SUITE_BINOP(EQ, int, ==)
+      SUITE_BINOP(NE, int, !=)
+#undef SUITE_BINOP
+      case AST_NAME:
+        stack[depth++] = node & 0x80 ? x : (uintptr_t)*(int*)x;
+        break;
+      case AST_CONST:
+        stack[depth++] = (uintptr_t)(int)x;
+        break;
+      case AST_ASSIGN:
+        *(int*)top[-2] = (int)top[-1];
+        depth -= 2;
+        break;
+      default:
+        break;  // DISPL and EXPECT aren't evaluated.
+    }
+  }
+}
+
+typedef struct SuiteResult {
+  double compile_secs;
+  size_t bytes;
+  uint64_t cycles;
+  bool ok;
+} SuiteResult;
+
+// Scratch for suite_run(), which is too big for the stack.
+static struct {
+  char src[SUITE_MAX_SOURCE];
+  Token tokens[JIT_MAX_TOKENS];
+  Ast nodes[JIT_MAX_NODES];
+  Intern names;
+} suite_scratch;
+
+// Run source |i| of the config of |size| binops with |engine|, adding
+// to |*result|, and setting |*a| to what it got, or returning false if it
+// couldn't.
+static bool suite_run(const SuiteArgs* args,
+                      SuiteEngine engine,
+                      int size,
+                      int first_aot,
+                      int i,
+                      CodeArena* arena,
+                      uint64_t* locals,
+                      InterpStep* steps,
+                      SuiteResult* result,
+                      int* a) {
+  Token* tokens = suite_scratch.tokens;
+  Ast* nodes = suite_scratch.nodes;
+  Intern* names = &suite_scratch.names;
+  uint8_t slots[INTERN_MAX_NAMES];
+  suite_source(args, size, i, false, suite_scratch.src);
+  memset(locals, 0, 64 << 10);
+  intern_init(names);
+  uint64_t start = 0;
+  int n = -1;
+  if (engine == SUITE_AOT) {
+#ifdef CNP_SUITE_AOT
+    int v[1 + SUITE_INPUTS] = {0};
+    for (int j = 1; j <= SUITE_INPUTS; ++j) {
+      v[j] = j + 1;
+    }
+    void (*fn)(int*) = suite_aot[first_aot + i];
+    start = os_cycles();
+    for (int j = 0; j < args->iters; ++j) {
+      fn(v);
+    }
+    result->cycles += os_cycles() - start;
+    *a = v[0];
+    return true;
+#else
+    (void)first_aot;
+    return false;
+#endif
+  }
+
+  double compile_start = os_seconds();
+  CodeBlock fn = {NULL, 0};
+  if (engine == SUITE_JIT) {
+    fn = jit_compile_text(arena, suite_scratch.src, locals, names, slots);
+  } else {
+    n = jit_parse_text(suite_scratch.src, tokens, nodes, names, slots);
+  }
+  int num_steps = engine == SUITE_INTERP && n >= 0
+                      ? interp_prepare(nodes, n, tokens, locals, steps, INTERP_MAX_STEPS)
+                      : 0;
+  result->compile_secs += os_seconds() - compile_start;
+  if (engine == SUITE_JIT ? !fn.code : n < 0 || num_steps < 0) {
+    return false;
+  }
+  bench_set_inputs(locals, &suite_scratch.names, slots);
+  if (engine == SUITE_SWITCH) {
+    result->bytes += (size_t)n * sizeof(Ast);
+    start = os_cycles();
+    for (int j = 0; j < args->iters; ++j) {
+      suite_eval_ast(nodes, n, tokens, locals);
+    }
+  } else if (engine == SUITE_INTERP) {
+    result->bytes += (size_t)num_steps * sizeof(InterpStep);
+    start = os_cycles();
+    for (int j = 0; j < args->iters; ++j) {
+      interp_run(steps);
+    }
+  } else {
+    result->bytes += fn.size;
+    start = os_cycles();
+    for (int j = 0; j < args->iters; ++j) {
+      ((void (*)(void))fn.code)();
+    }
+  }
+  result->cycles += os_cycles() - start;
+  *a = (int)*text_local(locals, names, slots, "a");
+  if (fn.code) {
+    code_arena_free(arena, fn);
+  }
+  return true;
+}
+
+static void suite_emit_aot(const SuiteArgs* args, const char* args_string) {
+  printf("// Generated by `cnp suite emit-aot %s`,\n", args_string);
+  printf("// for building cnp.c with CNP_SUITE_AOT, see suite.c.\n\n");
+  printf("static const char suite_aot_args[] = \"%s\";\n\n", args_string);
+  int k = 0;
+  for (int c = 0; c < args->num_sizes; ++c) {
+    for (int i = 0; i < args->count; ++i, ++k) {
+      suite_source(args, args->sizes[c], i, true, suite_scratch.src);
+      printf("static void suite_aot_%d(int* v) {\n  %s\n}\n\n", k, suite_scratch.src);
+    }
+  }
+  printf("static void (*const suite_aot[])(int*) = {\n");
+  for (int i = 0; i < k; ++i) {
+    printf("    suite_aot_%d,\n", i);
+  }
+  printf("};\n");
+}
+
+static int suite_main(int argc, char** argv) {
+  SuiteArgs args;
+  if (!suite_parse_args(argc, argv, &args)) {
+    fprintf(stderr,
+            "usage: cnp suite [emit-aot] [size=N,...] [depth=D] [mix=OPS] [seed=S] "
+            "[count=C] [iters=I]\n"
+            "  OPS are binops to pick from, each one of + * < > = (==) ! (!=),\n"
+            "  repeated to weight them; sizes are at most %d and 2^depth - 1, depth %d\n",
+            SUITE_MAX_SIZE, SUITE_MAX_DEPTH);
+    return 1;
+  }
+  char args_string[256];
+  suite_args_string(&args, args_string, sizeof(args_string));
+  if (args.emit_aot) {
+    suite_emit_aot(&args, args_string);
+    return 0;
+  }
+  bool have_aot = false;
+#ifdef CNP_SUITE_AOT
+  have_aot = strcmp(suite_aot_args, args_string) == 0;
+  if (!have_aot) {
+    fprintf(stderr, "suite: no aot, suite_aot.c is for %s\n", suite_aot_args);
+  }
+#endif
+
+  lex_simd = lex_best_simd();
+  jit_simd = jit_best_simd();
+  uint64_t* locals = os_alloc(64 << 10);
+  InterpStep* steps = os_alloc(INTERP_MAX_STEPS * sizeof(InterpStep));
+  int* expected = os_alloc(args.count * sizeof(int));
+  CodeArena arena;
+  code_arena_init(&arena, 64 << 20, false);
+
+  printf("size,depth,mix,engine,sources,nodes,compile_ns_per_node,bytes_per_node,"
+         "cycles_per_eval,ok\n");
+  for (int c = 0; c < args.num_sizes; ++c) {
+    int size = args.sizes[c];
+    long nodes = 0;
+    for (int i = 0; i < args.count; ++i) {
+      suite_source(&args, size, i, false, suite_scratch.src);
+      intern_init(&suite_scratch.names);
+      uint8_t slots[INTERN_MAX_NAMES];
+      int n = jit_parse_text(suite_scratch.src, suite_scratch.tokens, suite_scratch.nodes,
+                             &suite_scratch.names, slots);
+      nodes += n > 0 ? n : 0;
+    }
+    for (int e = 0; e < SUITE_Count; ++e) {
+      if (e == SUITE_AOT && !have_aot) {
+        continue;
+      }
+      SuiteResult result = {0, 0, 0, true};
+      for (int i = 0; i < args.count && result.ok; ++i) {
+        int a = 0;
+        result.ok = suite_run(&args, (SuiteEngine)e, size, c * args.count, i, &arena, locals,
+                              steps, &result, &a);
+        if (e == SUITE_SWITCH) {
+          expected[i] = a;
+        }
+        result.ok = result.ok && a == expected[i];
+      }
+      printf("%d,%d,%s,%s,%d,%ld,", size, args.depth, args.mix, suite_engine_names[e],
+             args.count, nodes);
+      if (e == SUITE_AOT) {
+        printf(",,");  // Neither is known.
+      } else {
+        printf("%.1f,%.1f,", result.compile_secs * 1e9 / (double)nodes,
+               (double)result.bytes / (double)nodes);
+      }
+      printf("%.1f,%d\n", (double)result.cycles / ((double)args.count * args.iters), result.ok);
+    }
+  }
+
+  code_arena_destroy(&arena);
+  os_release(expected, args.count * sizeof(int));
+  os_release(steps, INTERP_MAX_STEPS * sizeof(InterpStep));
+  os_release(locals, 64 << 10);
+  return 0;
+}